@@ -17,6 +17,9 @@ using namespace std;
 Disk::Disk(string imageFile, int blockSize) {
   this->imageFile = imageFile;
   this->blockSize = blockSize;
+  this->isInTransaction = false;
+  this->numBlocksRead = 0;
+  this->numBlocksWritten = 0;
 
   struct stat stat;
   int imageFileDescriptor = open(imageFile.c_str(), O_RDONLY);
@@ -44,11 +47,11 @@ Disk::Disk(string imageFile, int blockSize) {
 }
 
 int Disk::numberOfBlocks() {
-  return this->imageFileSize / this->blockSize;
+  return (int) (this->imageFileSize / this->blockSize);
 }
 
 void Disk::readBlock(int blockNumber, void *buffer) {
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
@@ -59,8 +62,8 @@ void Disk::readBlock(int blockNumber, void *buffer) {
     exit(1);
   }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  off_t ret = lseek(fd, offset, SEEK_SET);
   if (ret != offset) {
     perror("read::lseek");
     cerr << "Could not seek to file" << endl;
@@ -72,32 +75,71 @@ void Disk::readBlock(int blockNumber, void *buffer) {
     cerr << "Could not read file" << endl;
     exit(1);
   }
+  numBlocksRead++;
+
+  close(fd);
+}
+
+// Reads numBlocks consecutive blocks with as few syscalls as possible
+void Disk::readBlocks(int blockNumber, int numBlocks, void *buffer) {
+  if (blockNumber < 0 || numBlocks < 0 || blockNumber + numBlocks > this->numberOfBlocks()) {
+    cerr << "Invalid block range " << blockNumber << " + " << numBlocks << endl;
+    exit(1);
+  }
+
+  int fd = open(this->imageFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
+
+  size_t remaining = (size_t) numBlocks * this->blockSize;
+  off_t offset = (off_t) blockNumber * this->blockSize;
+  char *out = (char *) buffer;
+  while (remaining > 0) {
+    ssize_t ret = pread(fd, out, remaining, offset);
+    if (ret <= 0) {
+      perror("readBlocks::pread");
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
+    out += ret;
+    offset += ret;
+    remaining -= ret;
+  }
+  numBlocksRead += numBlocks;
 
   close(fd);
 }
 
 void Disk::writeBlock(int blockNumber, void *buffer) {  
-  if (blockNumber < 0 || blockNumber > this->numberOfBlocks()) {
+  if (blockNumber < 0 || blockNumber >= this->numberOfBlocks()) {
     cerr << "Invalid block number " << blockNumber << endl;
     exit(1);
   }
 
+  int fd = open(this->imageFile.c_str(), O_RDWR);
+  if (fd < 0) {
+    cerr << "Could not open image file " << this->imageFile << endl;
+    exit(1);
+  }
+
+  off_t offset = (off_t) blockNumber * this->blockSize;
+
+  // The undo copy comes straight off the same descriptor so it doesn't
+  // show up in blocksRead()
   if (isInTransaction) {
     struct UndoRecord undoRecord;
     undoRecord.blockNumber = blockNumber;
     undoRecord.blockData = new unsigned char[blockSize];
-    this->readBlock(blockNumber, undoRecord.blockData);
+    if (pread(fd, undoRecord.blockData, this->blockSize, offset) != this->blockSize) {
+      cerr << "Could not read file" << endl;
+      exit(1);
+    }
     undoLog.push_front(undoRecord);
   }
-  
-  int fd = open(this->imageFile.c_str(), O_RDWR);
-  if (fd < 0) {
-    cerr << "Could not open image file " << this->imageFile << endl;
-    exit(1);
-  }
 
-  int offset = blockNumber * this->blockSize;
-  int ret = lseek(fd, offset, SEEK_SET);
+  off_t ret = lseek(fd, offset, SEEK_SET);
   if (ret != offset) {
     perror("write::lseek");
     cerr << "Could not seek to file" << endl;
@@ -111,6 +153,7 @@ void Disk::writeBlock(int blockNumber, void *buffer) {
   }
   fsync(fd);
   close(fd);
+  numBlocksWritten++;
 }
 
 void Disk::beginTransaction() {
@@ -121,6 +164,23 @@ void Disk::beginTransaction() {
   isInTransaction = true;
 }
 
+bool Disk::inTransaction() {
+  return isInTransaction;
+}
+
+long long Disk::blocksRead() {
+  return numBlocksRead;
+}
+
+long long Disk::blocksWritten() {
+  return numBlocksWritten;
+}
+
+void Disk::resetCounters() {
+  numBlocksRead = 0;
+  numBlocksWritten = 0;
+}
+
 void Disk::commit() {
   isInTransaction = false;
   deque<struct UndoRecord>::iterator iter;
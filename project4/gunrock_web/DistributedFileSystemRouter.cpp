@@ -0,0 +1,953 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <algorithm>
+
+#include "DistributedFileSystemRouter.h"
+#include "DistributedFileSystemService.h"
+#include "ClientError.h"
+#include "HttpClient.h"
+#include "HttpUtils.h"
+#include "FastHash.h"
+#include "StringUtils.h"
+#include "dthread.h"
+
+using namespace std;
+
+// Ring positions per backend, more spread the keys more evenly
+#define VIRTUAL_NODES (128)
+// Keys per page of a prefix listing, as on the backends
+#define LIST_MAX_KEYS (1000)
+// How long a backend gets to answer, retries included
+#define BACKEND_DEADLINE_MS (10000)
+// Further tries of an idempotent request a backend didn't answer
+#define BACKEND_RETRIES (1)
+
+// Request headers a backend needs to see
+static const char *FORWARDED_HEADERS[] = {"If-Match", "If-None-Match", "Destination", "Overwrite"};
+
+// Response headers that describe the backend's connection, not the object
+static const char *HOP_HEADERS[] = {"Content-Length", "Content-Type", "Transfer-Encoding", "Connection", "Server"};
+
+// Starts the first line of every erasure coded shard
+#define SHARD_MAGIC "ds3rs"
+
+DistributedFileSystemRouter::DistributedFileSystemRouter(vector<string> hosts, int dataShards, int parityShards)
+  : HttpService("/ds3/") {
+  codec = dataShards > 0 ? new ReedSolomon(dataShards, parityShards) : NULL;
+  writeQuorum = min(max(dataShards, parityShards) + 1, dataShards + parityShards);
+  for (unsigned int i = 0; i < hosts.size(); i++) {
+    size_t colon = hosts[i].rfind(':');
+    Backend backend;
+    backend.host = hosts[i].substr(0, colon);
+    backend.port = atoi(hosts[i].substr(colon + 1).c_str());
+    backends.push_back(backend);
+
+    for (int node = 0; node < VIRTUAL_NODES; node++) {
+      stringstream name;
+      name << hosts[i] << "#" << node;
+      string point = name.str();
+      ring[FastHash::hash64(point.data(), point.size())] = i;
+    }
+  }
+}
+
+string DistributedFileSystemRouter::Reply::header(string key) {
+  map<string, string>::iterator iter;
+  for (iter = headers.begin(); iter != headers.end(); iter++) {
+    if (strcasecmp(iter->first.c_str(), key.c_str()) == 0) {
+      return iter->second;
+    }
+  }
+  return "";
+}
+
+// The path below /ds3/ with empty names dropped, what the ring hashes
+string DistributedFileSystemRouter::objectKey(string path) {
+  vector<string> names = StringUtils::split(path, '/');
+  string key;
+  for (unsigned int i = 0; i < names.size(); i++) {
+    if (names[i] == "" || (i == 0 && names[i] == "ds3")) {
+      continue;
+    }
+    key += (key == "" ? "" : "/") + names[i];
+  }
+  return key;
+}
+
+// The first virtual node at or after the key's hash, wrapping around
+int DistributedFileSystemRouter::owner(string key) {
+  map<uint64_t, int>::iterator node = ring.lower_bound(FastHash::hash64(key.data(), key.size()));
+  if (node == ring.end()) {
+    node = ring.begin();
+  }
+  return node->second;
+}
+
+string DistributedFileSystemRouter::target(HTTPRequest *request) {
+  string query = request->getQuery();
+  return query == "" ? request->getPath() : request->getPath() + "?" + query;
+}
+
+// Sends one request to a backend, with the client's conditional and move
+// headers when request is given. A backend that can't be reached, or
+// doesn't answer by the deadline, is a 502.
+DistributedFileSystemRouter::Reply DistributedFileSystemRouter::forward(int backend, string method, string target,
+                                                                      string body, HTTPRequest *request) {
+  Reply reply;
+  reply.status = 0;
+  try {
+    map<string, string> headers;
+    for (unsigned int i = 0; request != NULL && i < sizeof(FORWARDED_HEADERS) / sizeof(FORWARDED_HEADERS[0]); i++) {
+      if (request->hasHeader(FORWARDED_HEADERS[i])) {
+        headers[FORWARDED_HEADERS[i]] = request->getHeader(FORWARDED_HEADERS[i]);
+      }
+    }
+    stringstream replica;
+    replica << backends[backend].host << ":" << backends[backend].port;
+    RequestPolicy policy;
+    policy.deadline_ms = BACKEND_DEADLINE_MS;
+    policy.retries = BACKEND_RETRIES;
+    HTTPClientResponse *response = HttpClient::send(vector<string>(1, replica.str()), method, target, body, headers,
+                                                    policy);
+    reply.status = response->status();
+    reply.body = response->body();
+    reply.headers = response->headers();
+    delete response;
+  } catch (...) {
+    reply.status = 0;
+  }
+  if (reply.status == 0) {
+    cerr << "ds3 router: no answer from " << backends[backend].host << ":" << backends[backend].port << endl;
+    throw ClientError::badGateway();
+  }
+  return reply;
+}
+
+void DistributedFileSystemRouter::relay(Reply &reply, HTTPResponse *response) {
+  response->setStatus(reply.status);
+  map<string, string>::iterator iter;
+  for (iter = reply.headers.begin(); iter != reply.headers.end(); iter++) {
+    bool hop = false;
+    for (unsigned int i = 0; i < sizeof(HOP_HEADERS) / sizeof(HOP_HEADERS[0]); i++) {
+      hop = hop || strcasecmp(iter->first.c_str(), HOP_HEADERS[i]) == 0;
+    }
+    if (!hop) {
+      response->setHeader(iter->first, iter->second);
+    }
+  }
+  if (reply.header("Content-Type") != "") {
+    response->setContentType(reply.header("Content-Type"));
+  }
+  response->setBody(reply.body);
+}
+
+void DistributedFileSystemRouter::head(HTTPRequest *request, HTTPResponse *response) {
+  string key = objectKey(request->getPath());
+  if (key == "") {
+    response->setHeader("X-Ds3-Type", "directory");
+    return;
+  }
+  if (codec != NULL) {
+    erasureHead(request, response);
+    return;
+  }
+  int index = owner(key);
+  Reply reply = forward(index, "HEAD", request->getPath(), "", request);
+  // Not on its owner, it may still be a directory on another backend
+  for (unsigned int i = 0; reply.status == 404 && i < backends.size(); i++) {
+    if ((int) i != index) {
+      Reply other = forward(i, "HEAD", request->getPath(), "", NULL);
+      if (other.status == 200 && other.header("X-Ds3-Type") == "directory") {
+        reply = other;
+      }
+    }
+  }
+  relay(reply, response);
+}
+
+void DistributedFileSystemRouter::get(HTTPRequest *request, HTTPResponse *response) {
+  string path = request->getPath();
+  string key = objectKey(path);
+  map<string, string> params;
+  try {
+    params = request->getParams();
+  } catch (MalformedQueryString &e) {
+    throw ClientError::badRequest();
+  }
+  bool listing = params.count("prefix") > 0 || params.count("delimiter") > 0 || params.count("max-keys") > 0 ||
+                 params.count("continuation-token") > 0 || params.count("list-type") > 0;
+
+  if (key == "" || path[path.size() - 1] == '/' || listing) {
+    listDirectory(request, response, -1, NULL);
+    return;
+  }
+  if (codec != NULL) {
+    erasureGet(request, response);
+    return;
+  }
+
+  // Files are only on their owner, anything else there is a directory
+  int index = owner(key);
+  Reply reply = forward(index, "GET", target(request), "", request);
+  if (reply.status == 404 || reply.header("X-Ds3-Type") == "directory") {
+    listDirectory(request, response, index, &reply);
+    return;
+  }
+  relay(reply, response);
+}
+
+/**
+ * Asks every backend for the directory and merges the sorted listings.
+ * Prefix listings merge the same way: each backend returns its first
+ * max-keys keys after the token, so the first max-keys of the union are
+ * the first max-keys overall and the last of them is the next token.
+ * A merged listing has no single ETag, so none is sent.
+ */
+void DistributedFileSystemRouter::listDirectory(HTTPRequest *request, HTTPResponse *response,
+                                                int ownerIndex, Reply *ownerReply) {
+  vector<Call> calls;
+  vector<Reply> replies;
+  for (unsigned int i = 0; i < backends.size(); i++) {
+    if ((int) i == ownerIndex && (ownerReply->status == 200 || ownerReply->status == 404)) {
+      replies.push_back(*ownerReply);
+    } else {
+      Call call;
+      call.backend = i;
+      call.method = "GET";
+      call.target = target(request);
+      calls.push_back(call);
+    }
+  }
+  forwardAll(calls);
+
+  // Erasure coding is there to ride out backends that are down, the
+  // others still have every entry with enough shards left to read
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    if (calls[i].reply.status != 0) {
+      replies.push_back(calls[i].reply);
+    } else if (codec == NULL) {
+      throw ClientError::badGateway();
+    }
+  }
+  if (replies.empty()) {
+    throw ClientError::badGateway();
+  }
+
+  bool found = false;
+  bool truncated = false;
+  set<string> lines;
+  for (unsigned int i = 0; i < replies.size(); i++) {
+    if (replies[i].status == 200 && replies[i].header("X-Ds3-Type") != "file") {
+      found = true;
+      truncated = truncated || replies[i].header("X-Ds3-Is-Truncated") == "true";
+      stringstream body(replies[i].body);
+      string line;
+      while (getline(body, line)) {
+        lines.insert(line);
+      }
+    } else if (codec != NULL && replies[i].header("X-Ds3-Type") == "file") {
+      continue; // A shard too few others survive with, there is no file
+    } else if (replies[i].status != 404) {
+      relay(replies[i], response); // A bad query or a file, every backend says the same
+      return;
+    }
+  }
+  if (!found) {
+    throw ClientError::notFound();
+  }
+
+  vector<string> keys(lines.begin(), lines.end());
+  map<string, string> params = request->getParams();
+  if (params.count("prefix") > 0 || params.count("delimiter") > 0 || params.count("max-keys") > 0 ||
+      params.count("continuation-token") > 0 || params.count("list-type") > 0) {
+    unsigned int maxKeys = LIST_MAX_KEYS;
+    if (params.count("max-keys") > 0) {
+      maxKeys = min((unsigned int) atol(params["max-keys"].c_str()), maxKeys);
+    }
+    if (keys.size() > maxKeys) {
+      keys.resize(maxKeys);
+      truncated = true;
+    }
+    stringstream keyCount;
+    keyCount << keys.size();
+    response->setHeader("X-Ds3-Key-Count", keyCount.str());
+    response->setHeader("X-Ds3-Is-Truncated", truncated ? "true" : "false");
+    if (truncated) {
+      string next = params["continuation-token"];
+      if (!keys.empty()) {
+        next = "";
+        for (unsigned int i = 0; i < keys.back().size(); i++) {
+          char hex[3];
+          snprintf(hex, sizeof(hex), "%02x", (unsigned char) keys.back()[i]);
+          next += hex;
+        }
+      }
+      response->setHeader("X-Ds3-Next-Continuation-Token", next);
+    }
+  }
+
+  string result;
+  for (unsigned int i = 0; i < keys.size(); i++) {
+    result += keys[i] + "\n";
+  }
+  response->setHeader("X-Ds3-Type", "directory");
+  response->setBody(result);
+}
+
+void DistributedFileSystemRouter::put(HTTPRequest *request, HTTPResponse *response) {
+  if (codec != NULL) {
+    erasurePut(request, response);
+    return;
+  }
+  Reply reply = forward(owner(objectKey(request->getPath())), "PUT", target(request), request->getBody(), request);
+  relay(reply, response);
+}
+
+// A directory has a copy on every backend that stores something under it
+// and each copy has to go. A copy that isn't empty fails the request but
+// the copies already deleted stay deleted, PUTs recreate them as needed.
+void DistributedFileSystemRouter::del(HTTPRequest *request, HTTPResponse *response) {
+  string key = objectKey(request->getPath());
+  if (key == "") {
+    throw ClientError::badRequest();
+  }
+  if (codec != NULL) {
+    erasureDel(request, response);
+    return;
+  }
+  int index = owner(key);
+  Reply reply = forward(index, "DELETE", target(request), "", request);
+  if (reply.status != 404 && reply.header("X-Ds3-Type") != "directory") {
+    relay(reply, response);
+    return;
+  }
+
+  Reply *deleted = reply.status == 200 ? &reply : NULL;
+  vector<Reply> replies;
+  replies.reserve(backends.size());
+  for (unsigned int i = 0; i < backends.size(); i++) {
+    if ((int) i == index) {
+      continue;
+    }
+    replies.push_back(forward(i, "DELETE", target(request), "", NULL));
+    if (replies.back().status == 200) {
+      deleted = &replies.back();
+    } else if (replies.back().status != 404) {
+      relay(replies.back(), response);
+      return;
+    }
+  }
+  if (deleted == NULL) {
+    throw ClientError::notFound();
+  }
+  relay(*deleted, response);
+}
+
+void DistributedFileSystemRouter::post(HTTPRequest *request, HTTPResponse *response) {
+  map<string, string> params;
+  try {
+    params = request->getParams();
+  } catch (MalformedQueryString &e) {
+    throw ClientError::badRequest();
+  }
+  if (codec != NULL) {
+    throw ClientError::notImplemented(); // Every shard would change
+  }
+  if (params.count("batch") > 0) {
+    batch(request, response, params.count("atomic") > 0 && params["atomic"] != "0");
+    return;
+  }
+  Reply reply = forward(owner(objectKey(request->getPath())), "POST", target(request), request->getBody(), request);
+  relay(reply, response);
+}
+
+// Files move with a MOVE when both names have the same owner, otherwise
+// by a copy to the new owner and a delete from the old one. Everything
+// under a directory would hash somewhere new, so directories don't move.
+void DistributedFileSystemRouter::move(HTTPRequest *request, HTTPResponse *response) {
+  if (!request->hasHeader("Destination")) {
+    throw ClientError::badRequest();
+  }
+  string destination = request->getHeader("Destination");
+  size_t scheme = destination.find("://");
+  if (scheme != string::npos) {
+    size_t pathStart = destination.find('/', scheme + 3);
+    destination = pathStart == string::npos ? "/" : destination.substr(pathStart);
+  }
+  if (destination.compare(0, pathPrefix().size(), pathPrefix()) != 0) {
+    throw ClientError::badRequest();
+  }
+  string key = objectKey(request->getPath());
+  string destinationKey = objectKey(destination);
+  if (key == "" || destinationKey == "") {
+    throw ClientError::badRequest();
+  }
+  if (codec != NULL) {
+    erasureMove(request, response, key, destinationKey);
+    return;
+  }
+  string sourcePath = "/ds3/" + key;
+  string destinationPath = "/ds3/" + destinationKey;
+
+  int from = owner(key);
+  int to = owner(destinationKey);
+  Reply source = forward(from, "HEAD", sourcePath, "", NULL);
+  if (source.status == 404) {
+    for (unsigned int i = 0; i < backends.size(); i++) {
+      if ((int) i != from && forward(i, "HEAD", sourcePath, "", NULL).status == 200) {
+        throw ClientError::notImplemented(); // A directory
+      }
+    }
+    throw ClientError::notFound();
+  } else if (source.status != 200) {
+    relay(source, response);
+    return;
+  } else if (source.header("X-Ds3-Type") == "directory") {
+    throw ClientError::notImplemented();
+  }
+
+  if (from == to) {
+    Reply reply = forward(from, "MOVE", sourcePath, "", request);
+    relay(reply, response);
+    return;
+  }
+
+  Reply existing = forward(to, "HEAD", destinationPath, "", NULL);
+  bool existed = existing.status == 200;
+  if (existed && existing.header("X-Ds3-Type") == "directory") {
+    throw ClientError::conflict();
+  }
+  if (existed && request->hasHeader("Overwrite") && request->getHeader("Overwrite") == "F") {
+    throw ClientError::preconditionFailed();
+  }
+
+  Reply data = forward(from, "GET", sourcePath, "", NULL);
+  if (data.status != 200) {
+    relay(data, response);
+    return;
+  }
+  Reply stored = forward(to, "PUT", destinationPath, data.body, NULL);
+  if (stored.status != 200) {
+    relay(stored, response);
+    return;
+  }
+  Reply removed = forward(from, "DELETE", sourcePath, "", NULL);
+  if (removed.status != 200) {
+    relay(removed, response);
+    return;
+  }
+  response->setHeader("ETag", stored.header("ETag"));
+  response->setStatus(existed ? 204 : 201);
+}
+
+/**
+ * A batch whose operations all have one owner goes to it whole. Otherwise
+ * each backend gets the operations it owns as a batch of their own and the
+ * results are put back in order. Directory operations in a split batch
+ * only see the owner's part of the directory, and an atomic batch can't
+ * span backends, it is refused with 501.
+ */
+void DistributedFileSystemRouter::batch(HTTPRequest *request, HTTPResponse *response, bool atomic) {
+  if (objectKey(request->getPath()) != "") {
+    throw ClientError::methodNotAllowed();
+  }
+  vector<DistributedFileSystemService::BatchOperation> operations =
+    DistributedFileSystemService::parseBatch(request->getBody());
+
+  map<int, vector<int> > owned;
+  for (unsigned int i = 0; i < operations.size(); i++) {
+    owned[owner(objectKey(operations[i].path))].push_back(i);
+  }
+  if (owned.size() <= 1) {
+    int index = owned.empty() ? 0 : owned.begin()->first;
+    Reply reply = forward(index, "POST", target(request), request->getBody(), request);
+    relay(reply, response);
+    return;
+  }
+  if (atomic) {
+    throw ClientError::notImplemented();
+  }
+
+  vector<string> results(operations.size());
+  map<int, vector<int> >::iterator group;
+  for (group = owned.begin(); group != owned.end(); group++) {
+    stringstream body;
+    for (unsigned int i = 0; i < group->second.size(); i++) {
+      DistributedFileSystemService::BatchOperation &operation = operations[group->second[i]];
+      body << operation.method << " " << operation.path << " " << operation.body.size() << "\n" << operation.body;
+    }
+    Reply reply = forward(group->first, "POST", "/ds3/?batch", body.str(), NULL);
+    if (reply.status != 200) {
+      relay(reply, response);
+      return;
+    }
+
+    size_t position = 0;
+    for (unsigned int i = 0; i < group->second.size(); i++) {
+      size_t lineEnd = reply.body.find('\n', position);
+      if (lineEnd == string::npos) {
+        throw ClientError::badGateway();
+      }
+      stringstream line(reply.body.substr(position, lineEnd - position));
+      int status;
+      string etag;
+      size_t length;
+      line >> status >> etag >> length;
+      if (line.fail() || lineEnd + 1 + length > reply.body.size()) {
+        throw ClientError::badGateway();
+      }
+      results[group->second[i]] = reply.body.substr(position, lineEnd + 1 + length - position);
+      position = lineEnd + 1 + length;
+    }
+  }
+
+  string result;
+  for (unsigned int i = 0; i < results.size(); i++) {
+    result += results[i];
+  }
+  response->setContentType("application/octet-stream");
+  response->setBody(result);
+}
+
+void *DistributedFileSystemRouter::forwardThread(void *arg) {
+  Call *call = (Call *) arg;
+  try {
+    call->reply = call->router->forward(call->backend, call->method, call->target, call->body, NULL);
+  } catch (ClientError &ce) {
+    call->reply.status = 0; // Unreachable, the caller counts what came back
+  }
+  return NULL;
+}
+
+// Sends every call at once, a thread each, and waits for all the replies
+void DistributedFileSystemRouter::forwardAll(vector<Call> &calls) {
+  vector<pthread_t> threads(calls.size());
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    calls[i].router = this;
+    if (calls.size() == 1) {
+      forwardThread(&calls[i]);
+    } else {
+      dthread_create(&threads[i], NULL, forwardThread, &calls[i]);
+    }
+  }
+  for (unsigned int i = 0; calls.size() > 1 && i < calls.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// The k + m distinct backends after the key's hash on the ring, shard i
+// goes to the i-th
+vector<int> DistributedFileSystemRouter::placement(string key) {
+  unsigned int shards = codec->dataShards() + codec->parityShards();
+  vector<int> nodes;
+  vector<bool> used(backends.size(), false);
+  map<uint64_t, int>::iterator node = ring.lower_bound(FastHash::hash64(key.data(), key.size()));
+  while (nodes.size() < shards) {
+    if (node == ring.end()) {
+      node = ring.begin();
+    }
+    if (!used[node->second]) {
+      used[node->second] = true;
+      nodes.push_back(node->second);
+    }
+    node++;
+  }
+  return nodes;
+}
+
+// HEADs path on every backend at once, true with the first that has it as
+// a directory. Backends that are down are left out
+bool DistributedFileSystemRouter::findDirectory(string path, Reply &found) {
+  vector<Call> calls(backends.size());
+  for (unsigned int i = 0; i < backends.size(); i++) {
+    calls[i].backend = i;
+    calls[i].method = "HEAD";
+    calls[i].target = path;
+  }
+  forwardAll(calls);
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    if (calls[i].reply.status == 200 && calls[i].reply.header("X-Ds3-Type") == "directory") {
+      found = calls[i].reply;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits a GET reply into the shard and its header, false unless it is
+// shard index of an object coded like ours
+bool DistributedFileSystemRouter::parseShard(Reply &reply, int index, ShardHeader &header, string &shard) {
+  if (reply.status != 200 || reply.header("X-Ds3-Type") == "directory") {
+    return false;
+  }
+  size_t lineEnd = reply.body.find('\n');
+  if (lineEnd == string::npos) {
+    return false;
+  }
+  stringstream line(reply.body.substr(0, lineEnd));
+  string magic;
+  int dataShards, parityShards;
+  line >> magic >> dataShards >> parityShards >> header.index >> header.size >> header.version >> header.hash;
+  if (line.fail() || magic != SHARD_MAGIC || dataShards != codec->dataShards() ||
+      parityShards != codec->parityShards() || header.index != index || header.size < 0) {
+    return false;
+  }
+  shard = reply.body.substr(lineEnd + 1);
+  return (long long) shard.size() == (header.size + dataShards - 1) / dataShards;
+}
+
+/**
+ * Reads an erasure coded file back from its shards.
+ *
+ * The data shards are fetched first, all at once; when they are all there
+ * and from the same write nothing needs decoding, the write quorum makes
+ * that write the newest acknowledged one. Otherwise the parity shards are
+ * fetched too and the newest write seen is decoded. Returns 200, 404 when
+ * there are no shards, which may mean a directory, or 503 when the newest
+ * write has too few shards to decode while some backends are down or an
+ * older write could still be decoded: the newest may have been
+ * acknowledged, so the older one is never returned in its place. Too few
+ * with every backend up and nothing older are what a delete or write
+ * missed on a backend that was down then, and count as no file.
+ */
+int DistributedFileSystemRouter::readObject(string key, string &data, string &etag) {
+  int dataShards = codec->dataShards();
+  int totalShards = dataShards + codec->parityShards();
+  vector<int> nodes = placement(key);
+  vector<string> shards(totalShards);
+  vector<ShardHeader> headers(totalShards);
+  vector<bool> valid(totalShards, false);
+  int unreachable = 0;
+
+  int fetched = 0;
+  while (fetched < totalShards) {
+    int first = fetched;
+    fetched = fetched == 0 ? dataShards : totalShards;
+    vector<Call> calls(fetched - first);
+    for (int i = first; i < fetched; i++) {
+      calls[i - first].backend = nodes[i];
+      calls[i - first].method = "GET";
+      calls[i - first].target = "/ds3/" + key;
+    }
+    forwardAll(calls);
+    for (int i = first; i < fetched; i++) {
+      valid[i] = parseShard(calls[i - first].reply, i, headers[i], shards[i]);
+      unreachable += calls[i - first].reply.status == 0 ? 1 : 0;
+    }
+
+    bool complete = true;
+    for (int i = 0; i < dataShards; i++) {
+      complete = complete && valid[i] && headers[i].version == headers[0].version;
+    }
+    if (complete) {
+      break;
+    }
+  }
+
+  map<unsigned long long, int> writes;
+  for (int i = 0; i < totalShards; i++) {
+    if (valid[i]) {
+      writes[headers[i].version]++;
+    }
+  }
+  if (writes.empty()) {
+    return 404;
+  }
+  map<unsigned long long, int>::reverse_iterator write = writes.rbegin();
+  if (write->second < dataShards) {
+    bool older = false;
+    for (map<unsigned long long, int>::reverse_iterator other = write; other != writes.rend(); other++) {
+      older = older || other->second >= dataShards;
+    }
+    return unreachable > 0 || older ? 503 : 404;
+  }
+
+  vector<bool> present(totalShards, false);
+  ShardHeader header;
+  for (int i = 0; i < totalShards; i++) {
+    present[i] = valid[i] && headers[i].version == write->first;
+    if (present[i]) {
+      header = headers[i];
+    }
+  }
+  codec->reconstruct(shards, present);
+  data = "";
+  for (int i = 0; i < dataShards; i++) {
+    data += shards[i];
+  }
+  data.resize(header.size);
+
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) FastHash::hash64(data.data(), data.size()));
+  if (header.hash != hex) {
+    cerr << "ds3 router: shards of " << key << " don't decode to what was written" << endl;
+    throw ClientError::badGateway();
+  }
+  etag = "\"" + header.hash + "\"";
+  return 200;
+}
+
+/**
+ * Encodes data and stores a shard on each of its backends at once.
+ * Returns how many were stored; failure is one of the replies that
+ * refused, status 0 if none did.
+ */
+int DistributedFileSystemRouter::writeObject(string key, const string &data, string &etag, Reply &failure) {
+  vector<string> shards = codec->encode(data);
+  vector<int> nodes = placement(key);
+
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  unsigned long long version = now.tv_sec * 1000000ULL + now.tv_usec;
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) FastHash::hash64(data.data(), data.size()));
+
+  vector<Call> calls(shards.size());
+  for (unsigned int i = 0; i < shards.size(); i++) {
+    stringstream body;
+    body << SHARD_MAGIC << " " << codec->dataShards() << " " << codec->parityShards() << " " << i << " "
+         << data.size() << " " << version << " " << hex << "\n" << shards[i];
+    calls[i].backend = nodes[i];
+    calls[i].method = "PUT";
+    calls[i].target = "/ds3/" + key;
+    calls[i].body = body.str();
+  }
+  forwardAll(calls);
+
+  int stored = 0;
+  failure.status = 0;
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    if (calls[i].reply.status == 200) {
+      stored++;
+    } else if (calls[i].reply.status != 0) {
+      failure = calls[i].reply;
+    }
+  }
+  etag = "\"" + string(hex) + "\"";
+  return stored;
+}
+
+// DELETE on every backend at once: a file's shards and each copy of a
+// directory are wherever they are
+vector<DistributedFileSystemRouter::Reply> DistributedFileSystemRouter::deleteEverywhere(string path) {
+  vector<Call> calls(backends.size());
+  for (unsigned int i = 0; i < backends.size(); i++) {
+    calls[i].backend = i;
+    calls[i].method = "DELETE";
+    calls[i].target = path;
+  }
+  forwardAll(calls);
+  vector<Reply> replies;
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    replies.push_back(calls[i].reply);
+  }
+  return replies;
+}
+
+// Backends among key's placement that answered the delete with 200 or 404.
+// Once the write quorum has, fewer than k shards can be left anywhere
+int DistributedFileSystemRouter::deletedShards(string key, vector<Reply> &replies) {
+  vector<int> nodes = placement(key);
+  int deleted = 0;
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    int status = replies[nodes[i]].status;
+    if (status == 200 || status == 404) {
+      deleted++;
+    }
+  }
+  return deleted;
+}
+
+// Whether an If-Match or If-None-Match list names etag
+static bool etagListed(string header, string etag) {
+  vector<string> tags = StringUtils::split(header, ',');
+  for (unsigned int i = 0; i < tags.size(); i++) {
+    string tag = tags[i];
+    tag.erase(0, tag.find_first_not_of(" \t"));
+    tag.erase(tag.find_last_not_of(" \t") + 1);
+    if (tag.compare(0, 2, "W/") == 0) {
+      tag = tag.substr(2);
+    }
+    if (tag == "*" || tag == etag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void DistributedFileSystemRouter::erasureHead(HTTPRequest *request, HTTPResponse *response) {
+  string data, etag;
+  int status = readObject(objectKey(request->getPath()), data, etag);
+  if (status == 503) {
+    throw ClientError::serviceUnavailable();
+  } else if (status == 200) {
+    stringstream size;
+    size << data.size();
+    response->setHeader("ETag", etag);
+    response->setHeader("X-Ds3-Type", "file");
+    response->setHeader("X-Ds3-Size", size.str());
+    return;
+  }
+  Reply directory;
+  if (findDirectory(request->getPath(), directory)) {
+    relay(directory, response);
+    return;
+  }
+  throw ClientError::notFound();
+}
+
+void DistributedFileSystemRouter::erasureGet(HTTPRequest *request, HTTPResponse *response) {
+  string data, etag;
+  int status = readObject(objectKey(request->getPath()), data, etag);
+  if (status == 503) {
+    throw ClientError::serviceUnavailable();
+  } else if (status == 404) {
+    listDirectory(request, response, -1, NULL);
+    return;
+  }
+  response->setHeader("ETag", etag);
+  response->setHeader("X-Ds3-Type", "file");
+  if (request->hasHeader("If-Match") && !etagListed(request->getHeader("If-Match"), etag)) {
+    throw ClientError::preconditionFailed();
+  }
+  if (request->hasHeader("If-None-Match") && etagListed(request->getHeader("If-None-Match"), etag)) {
+    response->setStatus(304);
+    return;
+  }
+  response->setBody(data);
+}
+
+// Stored once the write quorum of shards is, X-Ds3-Shards says how many
+// made it
+void DistributedFileSystemRouter::erasurePut(HTTPRequest *request, HTTPResponse *response) {
+  string path = request->getPath();
+  string key = objectKey(path);
+  if (key == "" || path[path.size() - 1] == '/') {
+    throw ClientError::badRequest();
+  }
+
+  if (request->hasHeader("If-Match") || request->hasHeader("If-None-Match")) {
+    string current, etag;
+    int status = readObject(key, current, etag);
+    if (status == 503) {
+      throw ClientError::serviceUnavailable();
+    }
+    if (request->hasHeader("If-Match") && (status != 200 || !etagListed(request->getHeader("If-Match"), etag))) {
+      throw ClientError::preconditionFailed();
+    }
+    if (request->hasHeader("If-None-Match") && status == 200 && etagListed(request->getHeader("If-None-Match"), etag)) {
+      throw ClientError::preconditionFailed();
+    }
+  }
+
+  string etag;
+  Reply failure;
+  int stored = writeObject(key, request->getBody(), etag, failure);
+  if (stored < writeQuorum) {
+    if (failure.status != 0) {
+      relay(failure, response);
+      return;
+    }
+    throw ClientError::serviceUnavailable();
+  }
+  stringstream shards;
+  shards << stored;
+  response->setHeader("ETag", etag);
+  response->setHeader("X-Ds3-Shards", shards.str());
+  response->setStatus(200);
+  response->setBody("File created/updated successfully");
+}
+
+void DistributedFileSystemRouter::erasureDel(HTTPRequest *request, HTTPResponse *response) {
+  // Shards on backends that are down stay, so it takes the same quorum as
+  // a write or enough of them could still decode
+  vector<Reply> replies = deleteEverywhere(target(request));
+  Reply *deleted = NULL;
+  bool answered = false;
+  for (unsigned int i = 0; i < replies.size(); i++) {
+    answered = answered || replies[i].status != 0;
+    if (replies[i].status == 200) {
+      deleted = &replies[i];
+    } else if (replies[i].status != 404 && replies[i].status != 0) {
+      relay(replies[i], response);
+      return;
+    }
+  }
+  if (!answered) {
+    throw ClientError::badGateway();
+  } else if (deletedShards(objectKey(request->getPath()), replies) < writeQuorum) {
+    throw ClientError::serviceUnavailable();
+  } else if (deleted == NULL) {
+    throw ClientError::notFound();
+  }
+  relay(*deleted, response);
+}
+
+// A decode, an encode under the new name and a delete of the old shards
+void DistributedFileSystemRouter::erasureMove(HTTPRequest *request, HTTPResponse *response,
+                                              string key, string destinationKey) {
+  string data, etag;
+  int status = readObject(key, data, etag);
+  if (status == 503) {
+    throw ClientError::serviceUnavailable();
+  } else if (status == 404) {
+    Reply directory;
+    if (findDirectory("/ds3/" + key, directory)) {
+      throw ClientError::notImplemented();
+    }
+    throw ClientError::notFound();
+  }
+  if (key == destinationKey) {
+    response->setHeader("ETag", etag);
+    response->setStatus(204);
+    return;
+  }
+
+  // Shards and directory copies can be on any backend, and one that is
+  // down can't be asked
+  vector<Call> calls(backends.size());
+  for (unsigned int i = 0; i < backends.size(); i++) {
+    calls[i].backend = i;
+    calls[i].method = "HEAD";
+    calls[i].target = "/ds3/" + destinationKey;
+  }
+  forwardAll(calls);
+  bool existed = false;
+  for (unsigned int i = 0; i < calls.size(); i++) {
+    if (calls[i].reply.status == 200 && calls[i].reply.header("X-Ds3-Type") == "directory") {
+      throw ClientError::conflict();
+    }
+    existed = existed || calls[i].reply.status == 200;
+  }
+  if (existed && request->hasHeader("Overwrite") && request->getHeader("Overwrite") == "F") {
+    throw ClientError::preconditionFailed();
+  }
+
+  Reply failure;
+  if (writeObject(destinationKey, data, etag, failure) < writeQuorum) {
+    if (failure.status != 0) {
+      relay(failure, response);
+      return;
+    }
+    throw ClientError::serviceUnavailable();
+  }
+  vector<Reply> removed = deleteEverywhere("/ds3/" + key);
+  for (unsigned int i = 0; i < removed.size(); i++) {
+    if (removed[i].status != 200 && removed[i].status != 404 && removed[i].status != 0) {
+      relay(removed[i], response);
+      return;
+    }
+  }
+  if (deletedShards(key, removed) < writeQuorum) {
+    throw ClientError::serviceUnavailable();
+  }
+  response->setHeader("ETag", etag);
+  response->setStatus(existed ? 204 : 201);
+}
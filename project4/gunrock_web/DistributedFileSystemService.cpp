@@ -1,148 +1,1061 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <fcntl.h>
 #include <sstream>
 #include <iostream>
 #include <map>
 #include <string>
 #include <algorithm>
-#include <sys/stat.h>
-#include <dirent.h>
 
 #include "DistributedFileSystemService.h"
 #include "ClientError.h"
 #include "ufs.h"
 #include "WwwFormEncodedDict.h"
 #include "Disk.h"
+#include "FastHash.h"
+#include "StringUtils.h"
+#include "HttpUtils.h"
+#include "Replicator.h"
 #include <cstring>
+#include <ctime>
 
 using namespace std;
 
-DistributedFileSystemService::DistributedFileSystemService(string diskFile) : HttpService("/ds3/") {
+#define LISTING_CACHE_MAX_ENTRIES (1024)
+// Keys per page of a prefix listing, as in S3
+#define LIST_MAX_KEYS (1000)
+
+// Streams a file from the disk, each piece is one run of blocks that sit
+// next to each other, read straight into gunrock's chunk buffer
+class InodeBodyProducer : public BodyProducer {
+ public:
+  InodeBodyProducer(Disk *disk, inode_t &inode) : disk(disk), inode(inode), position(0) {}
+
+  virtual int produce(char *buffer, int size) {
+    if (position >= inode.size) {
+      return 0;
+    }
+    int block = position / UFS_BLOCK_SIZE;
+    int offset = position % UFS_BLOCK_SIZE;
+    int numBlocks = min((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+    int bytes;
+    if (offset == 0 && size >= UFS_BLOCK_SIZE) {
+      int run = 1;
+      while (run < size / UFS_BLOCK_SIZE && block + run < numBlocks &&
+             inode.direct[block + run] == inode.direct[block + run - 1] + 1) {
+        run++;
+      }
+      disk->readBlocks(inode.direct[block], run, buffer);
+      bytes = min(run * UFS_BLOCK_SIZE, inode.size - position);
+    } else {
+      vector<char> blockData(UFS_BLOCK_SIZE);
+      disk->readBlock(inode.direct[block], blockData.data());
+      bytes = min(min(UFS_BLOCK_SIZE - offset, size), inode.size - position);
+      memcpy(buffer, blockData.data() + offset, bytes);
+    }
+    position += bytes;
+    return bytes;
+  }
+
+ private:
+  Disk *disk;
+  inode_t inode;
+  int position;
+};
+
+DistributedFileSystemService::DistributedFileSystemService(string diskFile, Replicator *replicator) : HttpService("/ds3/") {
   this->fileSystem = new LocalFileSystem(new Disk(diskFile, UFS_BLOCK_SIZE));
+  this->replicator = replicator;
+  this->replicaApplied = 0;
+  // Change counts restart with the process, the epoch keeps ETags from
+  // one run from matching another's
+  this->epoch = FastHash::combine(time(NULL), getpid());
 }  
 
-void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response){
-  string myPath = request->getPath();
+// Splits a path below /ds3/ into its names
+vector<string> DistributedFileSystemService::splitPath(string path) {
+  vector<string> names = StringUtils::split(path, '/');
+  if (names.size() > 0 && names[0] == "ds3") {
+    names.erase(names.begin());
+  }
+  for (unsigned int i = 0; i < names.size(); i++) {
+    if (names[i] == "." || names[i] == "..") {
+      throw ClientError::badRequest();
+    }
+  }
+  return names;
+}
+
+vector<string> DistributedFileSystemService::pathNames(HTTPRequest *request) {
+  return splitPath(request->getPath());
+}
+
+// The canonical request path for a list of names
+string DistributedFileSystemService::objectPath(vector<string> &names) {
+  string path = pathPrefix();
+  for (unsigned int i = 0; i < names.size(); i++) {
+    path += (i == 0 ? "" : "/") + names[i];
+  }
+  return path;
+}
+
+// Walks the first count names down from the root, negative if one is
+// missing. With a cache, directories already found are not looked up again.
+int DistributedFileSystemService::lookupPath(vector<string> &names, int count, PathCache *cache) {
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  string path;
+  for (int i = 0; i < count && inodeNumber >= 0; i++) {
+    path += "/" + names[i];
+    if (cache != NULL && cache->count(path) > 0) {
+      inodeNumber = (*cache)[path];
+      continue;
+    }
+    inodeNumber = fileSystem->lookup(inodeNumber, names[i]);
+    if (cache != NULL && inodeNumber >= 0 && i < count - 1) {
+      (*cache)[path] = inodeNumber;
+    }
+  }
+  return inodeNumber;
+}
+
+int DistributedFileSystemService::resolve(vector<string> &names, int count, PathCache *cache) {
+  int inodeNumber = lookupPath(names, count, cache);
+  if (inodeNumber < 0) {
+    throw ClientError::notFound();
+  }
+  return inodeNumber;
+}
+
+// Strong validator: the inode itself, so its size and block list, plus the
+// in-memory change count that moves on every write through this server
+string DistributedFileSystemService::etagFor(int inodeNumber, inode_t &inode) {
+  uint64_t hash = FastHash::hash64(&inode, sizeof(inode), epoch);
+  hash = FastHash::combine(hash, inodeNumber);
+  hash = FastHash::combine(hash, fileSystem->changeCount(inodeNumber));
+  char etag[24];
+  snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long) hash);
+  return etag;
+}
+
+// Checks an If-Match or If-None-Match list, weak comparison ignores W/
+bool DistributedFileSystemService::etagMatches(string header, string etag, bool weak) {
+  vector<string> tags = StringUtils::split(header, ',');
+  for (unsigned int i = 0; i < tags.size(); i++) {
+    string tag = tags[i];
+    size_t start = tag.find_first_not_of(" \t");
+    size_t end = tag.find_last_not_of(" \t");
+    tag = start == string::npos ? "" : tag.substr(start, end - start + 1);
+    if (tag == "*") {
+      return true;
+    }
+    if (weak && tag.compare(0, 2, "W/") == 0) {
+      tag = tag.substr(2);
+    }
+    if (tag == etag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Maps a LocalFileSystem error onto the status the client sees
+ClientError DistributedFileSystemService::errorFor(int ret) {
+  switch (-ret) {
+  case ENOTENOUGHSPACE:
+    return ClientError::insufficientStorage();
+  case ENOTFOUND:
+    return ClientError::notFound();
+  case EINVALIDTYPE:
+  case EMOVEINTOSELF:
+    return ClientError::conflict();
+  default:
+    return ClientError::badRequest();
+  }
+}
+
+// One line per entry, sorted, with a trailing / on directories
+string DistributedFileSystemService::renderListing(int inodeNumber) {
+  inode_t inode;
+  vector<dir_ent_t> entries;
+  fileSystem->readDirectory(inodeNumber, &inode, entries);
+  vector<string> listing;
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    if (entries[i].inum == -1 || strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+      continue;
+    }
+    inode_t child;
+    string entryName = entries[i].name;
+    if (fileSystem->stat(entries[i].inum, &child) == 0 && child.type == UFS_DIRECTORY) {
+      entryName += "/";
+    }
+    listing.push_back(entryName);
+  }
+  sort(listing.begin(), listing.end());
+
   string result;
-  struct stat myPath_stat;
-
-  stat(myPath.c_str(), &myPath_stat);
-  if (S_ISDIR(myPath_stat.st_mode)){
-    DIR *dir;
-    struct dirent *entry;
-    vector<string> entries;
-
-    if ((dir = opendir(myPath.c_str())) != NULL){
-      while ((entry = readdir(dir)) != NULL){
-        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0){
-          string entryName = entry->d_name;
-          if (entry->d_type == DT_DIR){
-            entryName += "/";
-          }
-          entries.push_back(entryName);
-        }
-      }
-      closedir(dir);
-      sort(entries.begin(), entries.end());
+  for (vector<string>::const_iterator it = listing.begin(); it != listing.end(); ++it){
+    result += *it + "\n";
+  }
+  return result;
+}
 
-      // For each loop has a chance to shine!
-      for (vector<string>::const_iterator it = entries.begin(); it != entries.end(); ++it){
-        result += *it + "\n";
-      }
+// The sorted listing of a directory, rendered again only after it changes
+string DistributedFileSystemService::listingFor(int inodeNumber) {
+  unsigned long long changeCount = fileSystem->changeCount(inodeNumber);
+  map<int, CachedListing>::iterator cached = listingCache.find(inodeNumber);
+  if (cached != listingCache.end() && cached->second.changeCount == changeCount) {
+    return cached->second.body;
+  }
+  string result = renderListing(inodeNumber);
+  if (listingCache.size() >= LISTING_CACHE_MAX_ENTRIES) {
+    listingCache.clear();
+  }
+  CachedListing listing = {changeCount, result};
+  listingCache[inodeNumber] = listing;
+  return result;
+}
+
+// Walks the first count names, creating any directory that is missing.
+// The caller owns the transaction.
+int DistributedFileSystemService::makeDirectories(vector<string> &names, int count, PathCache *cache) {
+  int parent = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  string path;
+  for (int i = 0; i < count; i++) {
+    path += "/" + names[i];
+    if (cache != NULL && cache->count(path) > 0) {
+      parent = (*cache)[path];
+      continue;
+    }
+    int ret = fileSystem->create(parent, UFS_DIRECTORY, names[i]);
+    if (ret < 0) {
+      throw errorFor(ret);
     }
-    else{
-      // directory not found
-      throw ClientError::notFound();
+    parent = ret;
+    if (cache != NULL) {
+      (*cache)[path] = parent;
     }
   }
-  else{
-    // Handle file reading
-    int fd = open(myPath.c_str(), O_RDONLY);
-    if (fd < 0){
-      throw ClientError::notFound();
+  return parent;
+}
+
+// Creates any missing directories and the file, then writes it. The
+// caller owns the transaction.
+int DistributedFileSystemService::writeFile(vector<string> &names, const string &data, PathCache *cache) {
+  int parent = makeDirectories(names, names.size() - 1, cache);
+  int inodeNumber = fileSystem->create(parent, UFS_REGULAR_FILE, names.back());
+  if (inodeNumber < 0) {
+    throw errorFor(inodeNumber);
+  }
+  int ret = fileSystem->write(inodeNumber, data.data(), data.size());
+  if (ret < 0) {
+    throw errorFor(ret);
+  }
+  return inodeNumber;
+}
+
+// Unlinks a file or empty directory and returns its type. The caller
+// owns the transaction.
+int DistributedFileSystemService::removeEntry(vector<string> &names, PathCache *cache) {
+  if (names.size() == 0) {
+    throw ClientError::badRequest(); // The root can't go away
+  }
+  int parent = resolve(names, names.size() - 1, cache);
+  int inodeNumber = fileSystem->lookup(parent, names.back());
+  inode_t inode;
+  if (inodeNumber < 0 || fileSystem->stat(inodeNumber, &inode) != 0) {
+    throw ClientError::notFound();
+  }
+  int ret = fileSystem->unlink(parent, names.back());
+  if (ret < 0) {
+    throw errorFor(ret);
+  }
+
+  if (cache != NULL) {
+    string path;
+    for (unsigned int i = 0; i < names.size(); i++) {
+      path += "/" + names[i];
     }
-    else{
-      int ret;
-      char buffer[4096];
-      while ((ret = read(fd, buffer, sizeof(buffer))) > 0){
-        result.append(buffer, ret);
-      }
-      close(fd);
+    PathCache::iterator iter = cache->lower_bound(path);
+    while (iter != cache->end() && iter->first.compare(0, path.size(), path) == 0 &&
+           (iter->first.size() == path.size() || iter->first[path.size()] == '/')) {
+      cache->erase(iter++);
     }
   }
+  return inode.type;
+}
 
-  response->setBody(result);
+map<string, string> DistributedFileSystemService::queryParams(HTTPRequest *request) {
+  try {
+    return request->getParams();
+  } catch (MalformedQueryString &e) {
+    throw ClientError::badRequest();
+  }
 }
 
-void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
-  string path = request->getPath();
-  string data = request->getBody();
-  struct stat path_stat;
+static bool startsWith(const string &str, const string &prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+/**
+ * S3 ListObjects style listing of the keys below a directory: every file
+ * as its path relative to the directory, in sorted order, optionally only
+ * those starting with prefix. With delimiter=/ directories past the
+ * prefix are listed once as "dir/" instead of being walked.
+ *
+ * At most max-keys keys come back. X-Ds3-Is-Truncated says whether more
+ * follow and X-Ds3-Next-Continuation-Token is what to pass as
+ * continuation-token to get them.
+ */
+void DistributedFileSystemService::listObjects(int inodeNumber, map<string, string> &params, HTTPResponse *response) {
+  ListState state;
+  state.prefix = params["prefix"];
+  state.truncated = false;
 
-  // Trim relative path
-  if (path.find("/ds3/") == 0){
-    path = path.substr(5);
+  string delimiter = params["delimiter"];
+  if (delimiter != "" && delimiter != "/") {
+    throw ClientError::badRequest(); // Only directories can be rolled up
   }
+  state.delimited = delimiter == "/";
 
-  // Check if the path actually points somewhere
-  if (path.back() == '/'){
+  state.maxKeys = LIST_MAX_KEYS;
+  if (params.count("max-keys") > 0) {
+    char *end;
+    long maxKeys = strtol(params["max-keys"].c_str(), &end, 10);
+    if (params["max-keys"] == "" || *end != '\0' || maxKeys < 0) {
+      throw ClientError::badRequest();
+    }
+    state.maxKeys = min(maxKeys, (long) LIST_MAX_KEYS);
+  }
+
+  // The token is the last key returned, hex encoded so any name survives
+  // a header and a query string
+  string token = params["continuation-token"];
+  if (token.size() % 2 != 0 || token.find_first_not_of("0123456789abcdef") != string::npos) {
     throw ClientError::badRequest();
+  }
+  for (unsigned int i = 0; i < token.size(); i += 2) {
+    state.after += (char) strtol(token.substr(i, 2).c_str(), NULL, 16);
+  }
+
+  listKeys(inodeNumber, "", state);
+
+  string result;
+  for (unsigned int i = 0; i < state.keys.size(); i++) {
+    result += state.keys[i] + "\n";
+  }
+  stringstream keyCount;
+  keyCount << state.keys.size();
+  response->setHeader("X-Ds3-Key-Count", keyCount.str());
+  response->setHeader("X-Ds3-Is-Truncated", state.truncated ? "true" : "false");
+  if (state.truncated) {
+    string last = state.keys.empty() ? state.after : state.keys.back();
+    string next;
+    for (unsigned int i = 0; i < last.size(); i++) {
+      char hex[3];
+      snprintf(hex, sizeof(hex), "%02x", (unsigned char) last[i]);
+      next += hex;
+    }
+    response->setHeader("X-Ds3-Next-Continuation-Token", next);
+  }
+  response->setBody(result);
+}
+
+// Walks one directory in key order, descending only into directories
+// that can hold keys after the token and under the prefix. Only the
+// directories on the current path are held in memory. Returns false once
+// the page is full.
+bool DistributedFileSystemService::listKeys(int inodeNumber, string keyPrefix, ListState &state) {
+  inode_t inode;
+  vector<dir_ent_t> entries;
+  if (fileSystem->readDirectory(inodeNumber, &inode, entries) != 0) {
+    return true;
+  }
+
+  // Directories sort as name/ so a whole subtree lands where its keys do
+  vector<pair<string, int> > children;
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    if (entries[i].inum == -1 || strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+      continue;
+    }
+    string key = keyPrefix + entries[i].name;
+    if (!startsWith(key, state.prefix) && !startsWith(state.prefix, key)) {
+      continue;
+    }
+    inode_t child;
+    if (fileSystem->stat(entries[i].inum, &child) != 0) {
+      continue;
+    }
+    string sortKey = entries[i].name;
+    if (child.type == UFS_DIRECTORY) {
+      sortKey += "/";
+    }
+    children.push_back(make_pair(sortKey, entries[i].inum));
+  }
+  sort(children.begin(), children.end());
+
+  for (unsigned int i = 0; i < children.size(); i++) {
+    string key = keyPrefix + children[i].first;
+    bool directory = key[key.size() - 1] == '/';
+    bool rolledUp = directory && state.delimited && key.size() > state.prefix.size();
+    if (!directory || rolledUp) {
+      if (!startsWith(key, state.prefix) || key <= state.after) {
+        continue;
+      }
+      if ((int) state.keys.size() == state.maxKeys) {
+        state.truncated = true;
+        return false;
+      }
+      state.keys.push_back(key);
+    } else if (startsWith(key, state.prefix) || startsWith(state.prefix, key)) {
+      // Every key below sorts after key, skip the subtree if the token is past all of them
+      if (key <= state.after && !startsWith(state.after, key)) {
+        continue;
+      }
+      if (!listKeys(children[i].second, key, state)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// The headers a GET would send, without reading any data
+void DistributedFileSystemService::head(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> names = pathNames(request);
+  int inodeNumber = resolve(names, names.size());
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) != 0) {
+    throw ClientError::notFound();
+  }
+  stringstream size;
+  size << inode.size;
+  response->setHeader("ETag", etagFor(inodeNumber, inode));
+  response->setHeader("X-Ds3-Type", inode.type == UFS_DIRECTORY ? "directory" : "file");
+  response->setHeader("X-Ds3-Size", size.str());
+}
+
+void DistributedFileSystemService::get(HTTPRequest *request, HTTPResponse *response){
+  vector<string> names = pathNames(request);
+  int inodeNumber = resolve(names, names.size());
+
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) != 0) {
+    throw ClientError::notFound();
+  }
+
+  response->setHeader("X-Ds3-Type", inode.type == UFS_DIRECTORY ? "directory" : "file");
+
+  map<string, string> params = queryParams(request);
+  if (params.count("merkle") > 0) {
+    merkleListing(inodeNumber, inode, response);
+    return;
+  }
+  if (params.count("prefix") > 0 || params.count("delimiter") > 0 || params.count("max-keys") > 0 ||
+      params.count("continuation-token") > 0 || params.count("list-type") > 0) {
+    if (inode.type != UFS_DIRECTORY) {
+      throw ClientError::conflict();
+    }
+    listObjects(inodeNumber, params, response);
+    return;
+  }
+
+  string etag = etagFor(inodeNumber, inode);
+  response->setHeader("ETag", etag);
+  if (request->hasHeader("If-Match") && !etagMatches(request->getHeader("If-Match"), etag, false)) {
+    throw ClientError::preconditionFailed();
+  }
+  if (request->hasHeader("If-None-Match") && etagMatches(request->getHeader("If-None-Match"), etag, true)) {
+    response->setStatus(304); // The client's copy is current, skip the read
     return;
   }
 
-  string dirPath = path.substr(0, path.rfind('/'));
+  if (inode.type == UFS_DIRECTORY) {
+    response->setBody(listingFor(inodeNumber));
+  } else {
+    // Files go out as they are read, a block run per chunk
+    response->setBodyProducer(new InodeBodyProducer(fileSystem->disk, inode));
+  }
+}
+
+// Marks what changed since the last look, and every directory above it,
+// for hashing again
+void DistributedFileSystemService::refreshMerkle() {
+  vector<int> changes = fileSystem->takeChanges();
+  for (unsigned int i = 0; i < changes.size(); i++) {
+    // A directory is only valid while everything under it is, so the
+    // walk can stop at the first one already invalid
+    int inodeNumber = changes[i];
+    map<int, MerkleNode>::iterator node = merkleTree.find(inodeNumber);
+    while (node != merkleTree.end() && node->second.valid) {
+      node->second.valid = false;
+      node = merkleTree.find(node->second.parent);
+    }
+  }
+}
+
+/**
+ * The Merkle hash of an object, the same on any node with the same content.
+ *
+ * A file hashes its bytes. A directory hashes the names and hashes of its
+ * entries in name order, so inode numbers and block placement don't matter.
+ * A directory with no files anywhere under it hashes to 0 and is left out
+ * of its parent, like the implicit directories of an object store: ds3
+ * can't make one over HTTP, so nodes are not told apart by them.
+ */
+uint64_t DistributedFileSystemService::merkleHash(int inodeNumber, int parent) {
+  map<int, MerkleNode>::iterator cached = merkleTree.find(inodeNumber);
+  if (cached != merkleTree.end() && cached->second.valid) {
+    if (parent >= 0) {
+      cached->second.parent = parent;
+    }
+    return cached->second.hash;
+  }
 
-  // Create directories as needed
-  size_t pos = 0;
-  string token;
-  while ((pos = dirPath.find('/', pos)) != string::npos){
-    string currentDir = dirPath.substr(0, pos);
-    stat(currentDir.c_str(), &path_stat);
-    if (stat(currentDir.c_str(), &path_stat) == 0){
-      if (!S_ISDIR(path_stat.st_mode)){
-        throw ClientError::conflict();
+  inode_t inode;
+  if (fileSystem->stat(inodeNumber, &inode) != 0) {
+    return 0;
+  }
+  uint64_t hash;
+  if (inode.type == UFS_REGULAR_FILE) {
+    vector<char> data(inode.size);
+    if (inode.size > 0) {
+      fileSystem->read(inodeNumber, data.data(), inode.size);
+    }
+    hash = FastHash::hash64(data.data(), data.size(), UFS_REGULAR_FILE);
+  } else {
+    vector<dir_ent_t> entries;
+    fileSystem->readDirectory(inodeNumber, &inode, entries);
+    vector<pair<string, int> > children;
+    for (unsigned int i = 0; i < entries.size(); i++) {
+      if (entries[i].inum != -1 && strcmp(entries[i].name, ".") != 0 && strcmp(entries[i].name, "..") != 0) {
+        children.push_back(make_pair(string(entries[i].name), entries[i].inum));
+      }
+    }
+    sort(children.begin(), children.end());
+
+    hash = 0;
+    for (unsigned int i = 0; i < children.size(); i++) {
+      uint64_t childHash = merkleHash(children[i].second, inodeNumber);
+      if (childHash == 0) {
+        continue;
+      }
+      if (hash == 0) {
+        hash = FastHash::hash64(NULL, 0, UFS_DIRECTORY);
       }
+      hash = FastHash::combine(hash, FastHash::hash64(children[i].first.data(), children[i].first.size()));
+      hash = FastHash::combine(hash, childHash);
+    }
+  }
+
+  // A directory hashed on its own doesn't know its parent yet, hashing
+  // the parent fills it in
+  MerkleNode node = {hash, parent, true};
+  merkleTree[inodeNumber] = node;
+  return hash;
+}
+
+/**
+ * GET ?merkle: the object's hash in X-Ds3-Merkle and, for a directory,
+ * one "hash name" line per entry with directories ending in '/'. Two
+ * nodes are compared top-down by descending only where hashes differ.
+ */
+void DistributedFileSystemService::merkleListing(int inodeNumber, inode_t &inode, HTTPResponse *response) {
+  refreshMerkle();
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) merkleHash(inodeNumber, -1));
+  response->setHeader("X-Ds3-Merkle", hex);
+  if (inode.type != UFS_DIRECTORY) {
+    return;
+  }
+
+  vector<dir_ent_t> entries;
+  fileSystem->readDirectory(inodeNumber, &inode, entries);
+  vector<pair<string, string> > lines;
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    if (entries[i].inum == -1 || strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+      continue;
+    }
+    uint64_t hash = merkleHash(entries[i].inum, inodeNumber);
+    inode_t child;
+    if (hash == 0 || fileSystem->stat(entries[i].inum, &child) != 0) {
+      continue;
+    }
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) hash);
+    string entryName = entries[i].name;
+    lines.push_back(make_pair(entryName + (child.type == UFS_DIRECTORY ? "/" : ""), string(hex)));
+  }
+  sort(lines.begin(), lines.end());
+
+  string body;
+  for (unsigned int i = 0; i < lines.size(); i++) {
+    body += lines[i].second + " " + lines[i].first + "\n";
+  }
+  response->setBody(body);
+}
+
+void DistributedFileSystemService::put(HTTPRequest *request, HTTPResponse *response) {
+  applyMutation(request, response, &DistributedFileSystemService::putObject);
+}
+
+void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
+  applyMutation(request, response, &DistributedFileSystemService::deleteObject);
+}
+
+void DistributedFileSystemService::move(HTTPRequest *request, HTTPResponse *response) {
+  applyMutation(request, response, &DistributedFileSystemService::moveObject);
+}
+
+void DistributedFileSystemService::post(HTTPRequest *request, HTTPResponse *response) {
+  applyMutation(request, response, &DistributedFileSystemService::postObject);
+}
+
+/**
+ * Every mutating request comes through here.
+ *
+ * A request from a primary carries X-Ds3-Replica: epoch:seq. Each seq is
+ * applied once, in order: one already applied is acknowledged without
+ * running it again and one that skips ahead is refused, and either way
+ * X-Ds3-Replica-Applied tells the primary where this node is. A failure
+ * that is the request's fault (4xx) counts as applied since the primary
+ * saw the same one; a 5xx leaves the seq to be retried.
+ *
+ * On a node with peers the mutations the handler committed are logged
+ * and pushed to peers until the write quorum has them. The response
+ * carries X-Ds3-Acks; a write short of its quorum is committed here and
+ * will reach the other peers later, but the client gets a 503.
+ */
+void DistributedFileSystemService::applyMutation(HTTPRequest *request, HTTPResponse *response, Handler handler) {
+  mutations.clear();
+  if (request->hasHeader("X-Ds3-Replica")) {
+    string replica = request->getHeader("X-Ds3-Replica");
+    size_t colon = replica.find(':');
+    unsigned long long seq = strtoull(replica.substr(colon + 1).c_str(), NULL, 10);
+    if (colon == string::npos || seq == 0) {
+      throw ClientError::badRequest();
+    }
+    string epoch = replica.substr(0, colon);
+    if (replicaEpoch == "") {
+      // This node restarted on an image that has what it acked before.
+      // Every mutation replays safely, so one applied but not acked yet
+      // does no harm when it comes again
+      replicaEpoch = epoch;
+      replicaApplied = seq - 1;
+    } else if (epoch != replicaEpoch && seq == 1) {
+      replicaEpoch = epoch; // A new primary, or the old one restarted
+      replicaApplied = 0;
+    }
+    stringstream applied;
+    if (epoch != replicaEpoch || seq > replicaApplied + 1) {
+      applied << (epoch == replicaEpoch ? replicaApplied : 0);
+      response->setHeader("X-Ds3-Replica-Applied", applied.str());
+      throw ClientError::conflict();
+    }
+    if (seq <= replicaApplied) {
+      applied << replicaApplied;
+      response->setHeader("X-Ds3-Replica-Applied", applied.str());
+      return;
     }
-    else
-    {
-      // Directory does not exist, create it
-      if (mkdir(currentDir.c_str(), 0777) != 0){
-        throw ClientError::insufficientStorage();
+
+    applied << seq;
+    try {
+      (this->*handler)(request, response);
+    } catch (ClientError &ce) {
+      if (ce.status_code < 500) {
+        replicaApplied = seq;
+        response->setHeader("X-Ds3-Replica-Applied", applied.str());
       }
+      throw;
+    }
+    replicaApplied = seq;
+    response->setHeader("X-Ds3-Replica-Applied", applied.str());
+    return;
+  }
+
+  try {
+    (this->*handler)(request, response);
+  } catch (...) {
+    // Anything committed before the failure still has to reach the peers
+    for (unsigned int i = 0; i < mutations.size(); i++) {
+      replicator->record(mutations[i]);
+    }
+    throw;
+  }
+  if (replicator == NULL || mutations.empty()) {
+    return;
+  }
+
+  unsigned long long seq = 0;
+  for (unsigned int i = 0; i < mutations.size(); i++) {
+    seq = replicator->record(mutations[i]);
+  }
+  int copies = replicator->replicate(seq);
+  stringstream acks;
+  acks << copies;
+  response->setHeader("X-Ds3-Acks", acks.str());
+  if (copies < replicator->quorum()) {
+    throw ClientError::serviceUnavailable();
+  }
+}
+
+// Notes a committed change for the peers, if there are any
+void DistributedFileSystemService::logMutation(string method, string path, string body, string destination) {
+  if (replicator == NULL) {
+    return;
+  }
+  Mutation mutation;
+  mutation.method = method;
+  mutation.path = path;
+  mutation.body = body;
+  mutation.destination = destination;
+  mutations.push_back(mutation);
+}
+
+void DistributedFileSystemService::putObject(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> names = pathNames(request);
+  string data = request->getBody();
+
+  // Check if the path actually points somewhere
+  string path = request->getPath();
+  if (names.size() == 0 || path[path.size() - 1] == '/') {
+    throw ClientError::badRequest();
+  }
+
+  // Conditions are checked against what is there now, before anything changes
+  if (request->hasHeader("If-Match") || request->hasHeader("If-None-Match")) {
+    int existing = lookupPath(names, names.size());
+    inode_t inode;
+    string etag;
+    if (existing >= 0 && fileSystem->stat(existing, &inode) == 0) {
+      etag = etagFor(existing, inode);
+    }
+    if (request->hasHeader("If-Match") && (etag == "" || !etagMatches(request->getHeader("If-Match"), etag, false))) {
+      throw ClientError::preconditionFailed();
+    }
+    if (request->hasHeader("If-None-Match") && etag != "" && etagMatches(request->getHeader("If-None-Match"), etag, true)) {
+      throw ClientError::preconditionFailed();
     }
-    pos++;
   }
 
-  // Start transaction for file creation or update
+  // Missing directories and the file itself are made in one transaction
+  int inodeNumber;
   fileSystem->disk->beginTransaction();
+  try {
+    inodeNumber = writeFile(names, data, NULL);
+    fileSystem->disk->commit();
+  } catch (...) {
+    fileSystem->disk->rollback();
+    throw;
+  }
+  logMutation("PUT", objectPath(names), data, "");
+
+  inode_t inode;
+  fileSystem->stat(inodeNumber, &inode);
+  response->setHeader("ETag", etagFor(inodeNumber, inode));
+  response->setStatus(200);
+  response->setBody("File created/updated successfully");
+}
+
+void DistributedFileSystemService::deleteObject(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> names = pathNames(request);
+
+  int type;
+  fileSystem->disk->beginTransaction();
+  try {
+    type = removeEntry(names, NULL);
+    fileSystem->disk->commit();
+  } catch (...) {
+    fileSystem->disk->rollback();
+    throw;
+  }
+  logMutation("DELETE", objectPath(names), "", "");
+
+  response->setHeader("X-Ds3-Type", type == UFS_DIRECTORY ? "directory" : "file");
+  response->setBody("");
+}
 
-  try{
-    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0){
-      fileSystem->disk->rollback();
-      throw ClientError::insufficientStorage();
+/**
+ * MOVE renames the object at the request path to the path in the
+ * Destination header, a /ds3/ path or a full URL on this server. Only
+ * directory entries are rewritten, so the cost doesn't depend on the
+ * object's size. Missing directories on the destination side are created
+ * as for PUT. An existing destination is replaced unless Overwrite: F is
+ * sent, in which case the move fails with 412.
+ */
+void DistributedFileSystemService::moveObject(HTTPRequest *request, HTTPResponse *response) {
+  vector<string> names = pathNames(request);
+  if (!request->hasHeader("Destination")) {
+    throw ClientError::badRequest();
+  }
+  string destination = request->getHeader("Destination");
+  size_t scheme = destination.find("://");
+  if (scheme != string::npos) {
+    size_t pathStart = destination.find('/', scheme + 3);
+    destination = pathStart == string::npos ? "/" : destination.substr(pathStart);
+  }
+  if (destination.compare(0, pathPrefix().size(), pathPrefix()) != 0) {
+    throw ClientError::badRequest(); // Only within ds3
+  }
+  vector<string> destinationNames = splitPath(destination);
+  if (names.size() == 0 || destinationNames.size() == 0) {
+    throw ClientError::badRequest(); // The root stays where it is
+  }
+
+  if (destinationNames.size() > names.size() && equal(names.begin(), names.end(), destinationNames.begin())) {
+    throw ClientError::conflict(); // Below itself, caught before any directory is made
+  }
+
+  int srcParent = resolve(names, names.size() - 1);
+  int inodeNumber = fileSystem->lookup(srcParent, names.back());
+  if (inodeNumber < 0) {
+    throw ClientError::notFound();
+  }
+  bool existed = lookupPath(destinationNames, destinationNames.size()) >= 0;
+  if (existed && request->hasHeader("Overwrite") && request->getHeader("Overwrite") == "F") {
+    throw ClientError::preconditionFailed();
+  }
+
+  fileSystem->disk->beginTransaction();
+  try {
+    int dstParent = makeDirectories(destinationNames, destinationNames.size() - 1, NULL);
+    int ret = fileSystem->rename(srcParent, names.back(), dstParent, destinationNames.back());
+    if (ret < 0) {
+      throw errorFor(ret);
     }
+    fileSystem->disk->commit();
+  } catch (...) {
+    fileSystem->disk->rollback();
+    throw;
+  }
+  logMutation("MOVE", objectPath(names), "", objectPath(destinationNames));
+
+  inode_t inode;
+  fileSystem->stat(inodeNumber, &inode);
+  response->setHeader("ETag", etagFor(inodeNumber, inode));
+  response->setStatus(existed ? 204 : 201);
+}
 
-    if (write(fd, data.c_str(), data.size()) != (ssize_t)data.size()){
-      close(fd);
-      fileSystem->disk->rollback();
-      throw ClientError::insufficientStorage();
+/**
+ * POST /ds3/<path>?append adds the body to the end of the file, creating
+ * it and any missing directories first. POST /ds3/<path>?offset=N writes
+ * the body over the existing file starting at byte N, which may be at
+ * most the file's size. Either way only the blocks the body lands on are
+ * written. If-Match is honoured so concurrent writers can detect a race.
+ *
+ * POST /ds3/?batch runs many GET, PUT and DELETE operations in one request.
+ *
+ * The body is a list of operations, each a line "METHOD path length"
+ * followed by exactly length bytes of body (0 for GET and DELETE). Paths
+ * start with /ds3/ like request paths do. The response holds one result
+ * per operation, in order, each a line "status etag length" followed by
+ * length bytes: the object for a GET, empty otherwise. etag is - when
+ * there is none.
+ *
+ * Operations share one path resolution cache. By default each mutation
+ * is its own transaction and a failure only affects that operation. With
+ * ?batch&atomic=1 the whole batch is one transaction: the first failure
+ * rolls everything back, the request fails with that operation's status
+ * and X-Ds3-Failed-Op gives its index.
+ */
+void DistributedFileSystemService::postObject(HTTPRequest *request, HTTPResponse *response) {
+  map<string, string> params = queryParams(request);
+  if (params.count("append") > 0 || params.count("offset") > 0) {
+    patchObject(request, response, params);
+    return;
+  }
+  if (params.count("batch") == 0 || pathNames(request).size() != 0) {
+    throw ClientError::methodNotAllowed();
+  }
+  bool atomic = params.count("atomic") > 0 && params["atomic"] != "0";
+
+  vector<BatchOperation> operations = parseBatch(request->getBody());
+  PathCache cache;
+  string result;
+  if (atomic) {
+    fileSystem->disk->beginTransaction();
+  }
+  for (unsigned int i = 0; i < operations.size(); i++) {
+    BatchOperation &operation = operations[i];
+    int status = 200;
+    string etag = "-";
+    string body;
+    if (!atomic && operation.method != "GET") {
+      fileSystem->disk->beginTransaction();
+    }
+    try {
+      vector<string> names = splitPath(operation.path);
+      if (operation.method == "GET") {
+        int inodeNumber = resolve(names, names.size(), &cache);
+        inode_t inode;
+        if (fileSystem->stat(inodeNumber, &inode) != 0) {
+          throw ClientError::notFound();
+        }
+        etag = etagFor(inodeNumber, inode);
+        if (inode.type == UFS_DIRECTORY) {
+          body = listingFor(inodeNumber);
+        } else {
+          vector<char> buffer(inode.size);
+          int ret = fileSystem->read(inodeNumber, buffer.data(), inode.size);
+          if (ret < 0) {
+            throw errorFor(ret);
+          }
+          body.assign(buffer.data(), ret);
+        }
+      } else if (operation.method == "PUT") {
+        if (names.size() == 0 || operation.path[operation.path.size() - 1] == '/') {
+          throw ClientError::badRequest();
+        }
+        int inodeNumber = writeFile(names, operation.body, &cache);
+        inode_t inode;
+        fileSystem->stat(inodeNumber, &inode);
+        etag = etagFor(inodeNumber, inode);
+      } else {
+        removeEntry(names, &cache);
+      }
+      if (!atomic && operation.method != "GET") {
+        fileSystem->disk->commit();
+      }
+      if (operation.method != "GET") {
+        logMutation(operation.method, objectPath(names), operation.body, "");
+      }
+    } catch (ClientError &ce) {
+      if (atomic) {
+        fileSystem->disk->rollback();
+        mutations.clear(); // None of it happened
+        stringstream index;
+        index << i;
+        response->setHeader("X-Ds3-Failed-Op", index.str());
+        throw;
+      }
+      if (operation.method != "GET") {
+        fileSystem->disk->rollback();
+        cache.clear(); // Directories made by this operation are gone again
+      }
+      status = ce.status_code;
+      etag = "-";
+      body = "";
+    } catch (...) {
+      // Not the operation's fault, the whole request fails but the
+      // transaction can't be left open for the next one
+      if (fileSystem->disk->inTransaction()) {
+        fileSystem->disk->rollback();
+      }
+      if (atomic) {
+        mutations.clear();
+      }
+      throw;
     }
-    close(fd);
 
+    stringstream header;
+    header << status << " " << etag << " " << body.size() << "\n";
+    result += header.str();
+    result += body;
+  }
+  if (atomic) {
     fileSystem->disk->commit();
-    response->setStatus(200);
-    response->setBody("File created/updated successfully");
   }
-  catch (...){
+
+  response->setContentType("application/octet-stream");
+  response->setBody(result);
+}
+
+void DistributedFileSystemService::patchObject(HTTPRequest *request, HTTPResponse *response, map<string, string> &params) {
+  vector<string> names = pathNames(request);
+  string path = request->getPath();
+  if (names.size() == 0 || path[path.size() - 1] == '/') {
+    throw ClientError::badRequest();
+  }
+  bool append = params.count("append") > 0;
+  long offset = 0;
+  if (!append) {
+    char *end;
+    offset = strtol(params["offset"].c_str(), &end, 10);
+    if (params["offset"] == "" || *end != '\0' || offset < 0) {
+      throw ClientError::badRequest();
+    }
+  }
+
+  int existing = lookupPath(names, names.size());
+  if (request->hasHeader("If-Match")) {
+    inode_t inode;
+    if (existing < 0 || fileSystem->stat(existing, &inode) != 0 ||
+        !etagMatches(request->getHeader("If-Match"), etagFor(existing, inode), false)) {
+      throw ClientError::preconditionFailed();
+    }
+  }
+  if (existing < 0 && !append) {
+    throw ClientError::notFound();
+  }
+
+  string data = request->getBody();
+  int oldSize = 0;
+  inode_t oldInode;
+  if (existing >= 0 && fileSystem->stat(existing, &oldInode) == 0) {
+    oldSize = oldInode.size;
+  }
+  int inodeNumber;
+  fileSystem->disk->beginTransaction();
+  try {
+    inodeNumber = existing;
+    if (inodeNumber < 0) {
+      int parent = makeDirectories(names, names.size() - 1, NULL);
+      inodeNumber = fileSystem->create(parent, UFS_REGULAR_FILE, names.back());
+      if (inodeNumber < 0) {
+        throw errorFor(inodeNumber);
+      }
+    }
+    int ret = append ? fileSystem->append(inodeNumber, data.data(), data.size())
+                     : fileSystem->patch(inodeNumber, data.data(), data.size(), offset);
+    if (ret == -EINVALIDSIZE) {
+      throw ClientError::rangeNotSatisfiable();
+    } else if (ret < 0) {
+      throw errorFor(ret);
+    }
+    fileSystem->disk->commit();
+  } catch (...) {
     fileSystem->disk->rollback();
     throw;
   }
+
+  // Peers replay an append at the offset it landed on, so running it twice
+  // can't add the data twice
+  if (existing < 0) {
+    logMutation("PUT", objectPath(names), data, "");
+  } else {
+    stringstream target;
+    target << objectPath(names) << "?offset=" << (append ? oldSize : offset);
+    logMutation("POST", target.str(), data, "");
+  }
+
+  inode_t inode;
+  fileSystem->stat(inodeNumber, &inode);
+  stringstream size;
+  size << inode.size;
+  response->setHeader("ETag", etagFor(inodeNumber, inode));
+  response->setHeader("X-Ds3-Size", size.str());
+  response->setBody("File created/updated successfully");
 }
 
-void DistributedFileSystemService::del(HTTPRequest *request, HTTPResponse *response) {
-  string myPath = request->getPath(); //remove the myPath
-  response->setBody("");
+vector<DistributedFileSystemService::BatchOperation> DistributedFileSystemService::parseBatch(const string &body) {
+  vector<BatchOperation> operations;
+  size_t position = 0;
+  while (position < body.size()) {
+    size_t lineEnd = body.find('\n', position);
+    if (lineEnd == string::npos) {
+      throw ClientError::badRequest();
+    }
+    stringstream line(body.substr(position, lineEnd - position));
+    BatchOperation operation;
+    long long length = -1;
+    string extra;
+    line >> operation.method >> operation.path >> length;
+    if (line.fail() || (line >> extra) || length < 0 || lineEnd + 1 + length > body.size() ||
+        (operation.method != "GET" && operation.method != "PUT" && operation.method != "DELETE") ||
+        operation.path.compare(0, 5, "/ds3/") != 0) {
+      throw ClientError::badRequest();
+    }
+    operation.body = body.substr(lineEnd + 1, length);
+    operations.push_back(operation);
+    position = lineEnd + 1 + length;
+  }
+  return operations;
 }
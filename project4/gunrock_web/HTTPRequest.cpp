@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <strings.h>
 
 #include "HttpUtils.h"
 #include "StringUtils.h"
@@ -48,12 +49,13 @@ string HTTPRequest::getPath() {
   return m_http->getPath();
 }
 
+// Header names are case-insensitive in HTTP
 string HTTPRequest::getHeader(string key) {
   vector<pair<string *, string *> >::iterator iter;
   vector<pair<string *, string *> > headers = m_http->getHeaders();
   for (iter = headers.begin(); iter != headers.end(); iter++) {
     string header_key = *(iter->first);
-    if (header_key == key) {
+    if (strcasecmp(header_key.c_str(), key.c_str()) == 0) {
       return *(iter->second);
     }
   }
@@ -61,6 +63,15 @@ string HTTPRequest::getHeader(string key) {
   throw "could not find header";
 }
 
+bool HTTPRequest::hasHeader(string key) {
+  try {
+    getHeader(key);
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
 bool HTTPRequest::hasAuthToken() {
   try {
     getHeader("x-auth-token");
@@ -9,12 +9,27 @@ HTTPResponse::HTTPResponse() {
   this->contentType = "text/html; charset=ISO-8859-1";
   this->headers["Server"] = "Gunrock Web";
   this->status = 200;
+  this->producer = NULL;
+}
+
+HTTPResponse::~HTTPResponse() {
+  delete producer;
 }
 
 void HTTPResponse::withStreaming() {
   this->streaming = true;
 }
 
+void HTTPResponse::setBodyProducer(BodyProducer *producer) {
+  delete this->producer;
+  this->producer = producer;
+  this->streaming = producer != NULL;
+}
+
+BodyProducer *HTTPResponse::getBodyProducer() {
+  return producer;
+}
+
 void HTTPResponse::setHeader(string name, string value) {
   this->headers[name] = value;
 }
@@ -36,10 +51,25 @@ void HTTPResponse::setStatus(int status) {
 }
 
 string HTTPResponse::statusToString() {
-  if (status == 200) {
-    return "OK";
-  } else {
-    return "Unknown";
+  switch (status) {
+  case 200: return "OK";
+  case 201: return "Created";
+  case 204: return "No Content";
+  case 304: return "Not Modified";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 409: return "Conflict";
+  case 412: return "Precondition Failed";
+  case 416: return "Range Not Satisfiable";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 507: return "Insufficient Storage";
+  default: return "Unknown";
   }
 }
 
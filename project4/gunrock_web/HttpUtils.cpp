@@ -1,4 +1,6 @@
 #include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
 
 #include "HttpUtils.h"
 
@@ -14,18 +16,38 @@ map<string, string> HttpUtils::params(string query) {
   vector<string> pairs = split(query, '&');
   for (unsigned idx = 0; idx < pairs.size(); idx++) {
     string param = pairs[idx];
-    vector<string> elements = split(param, '=');
-    if (elements.size() != 2) {
+    // A bare key like ?batch has an empty value
+    size_t equals = param.find('=');
+    string key = param.substr(0, equals);
+    string value = equals == string::npos ? "" : param.substr(equals + 1);
+    if (key.size() == 0 || value.find('=') != string::npos) {
       throw MalformedQueryString(query);
     }
 
-    // XXX FIXME we need to url decode the strings
-    paramMap[elements[0]] = elements[1];
+    paramMap[urldecode(key, query)] = urldecode(value, query);
   }
 
   return paramMap;
 }
 
+// Undoes %XX escapes and turns + back into a space
+string HttpUtils::urldecode(const string &str, const string &query) {
+  string decoded;
+  for (unsigned int idx = 0; idx < str.size(); idx++) {
+    if (str[idx] == '+') {
+      decoded += ' ';
+    } else if (str[idx] != '%') {
+      decoded += str[idx];
+    } else if (idx + 2 < str.size() && isxdigit(str[idx + 1]) && isxdigit(str[idx + 2])) {
+      decoded += (char) strtol(str.substr(idx + 1, 2).c_str(), NULL, 16);
+      idx += 2;
+    } else {
+      throw MalformedQueryString(query);
+    }
+  }
+  return decoded;
+}
+
 void HttpUtils::writeChunk(MySocket *client,
 				      const void *buf, int numBytes) {
 
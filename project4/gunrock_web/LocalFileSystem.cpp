@@ -9,6 +9,7 @@
 
 using namespace std;
 
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / (int) sizeof(dir_ent_t))
 
 LocalFileSystem::LocalFileSystem(Disk *disk){
   this->disk = disk;
@@ -129,71 +130,92 @@ int LocalFileSystem::create(int parentInodeNumber, int type, std::string name) {
 
   // Make sure directory exists
   inode_t parentInode;
-  int statResult = this->stat(parentInodeNumber, &parentInode);
-  if (statResult != 0 || parentInode.type != UFS_DIRECTORY) {
+  vector<dir_ent_t> entries;
+  if (readDirectory(parentInodeNumber, &parentInode, entries) != 0) {
     return -EINVALIDINODE; // Parent inode does not exist or is not a directory
   }
-  // Is the name valio?
-  if (name.length() > DIR_ENT_NAME_SIZE) {
-    return -EINVALIDNAME; // Name is too long
+  // Is the name valid? It has to fit with its \0
+  if (name.length() == 0 || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
+  if (type != UFS_DIRECTORY && type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
   }
 
   // Does that name exist?
   int existingInodeNumber = this->lookup(parentInodeNumber, name);
-  if (existingInodeNumber != -ENOTFOUND) {
-    // Name already exists
+  if (existingInodeNumber >= 0) {
     inode_t existingInode;
     this->stat(existingInodeNumber, &existingInode);
     if (existingInode.type == type) {
       return existingInodeNumber; // Name exists and is of the correct type
-    } 
+    }
     else {
       return -EINVALIDTYPE; // Name exists but is of the wrong type
     }
   }
 
-  // Make the new inode
+  bool growParent;
+  int slot = findFreeSlot(&parentInode, entries, &growParent);
+  if (slot < 0) {
+    return -ENOTENOUGHSPACE; // Parent directory is full
+  }
+
+  int blocksNeeded = (growParent ? 1 : 0) + (type == UFS_DIRECTORY ? 1 : 0);
+  if (!diskHasSpace(&super, 1, 0, blocksNeeded)) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  // Allocate everything up front, before anything points at it
   unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
+  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
   readInodeBitmap(&super, inodeBitmap);
+  readDataBitmap(&super, dataBitmap);
 
-  int newInodeNumber = -1;
-  for (int i = 0; i < super.num_inodes; ++i) {
-    if (!(inodeBitmap[i / 8] & (1 << (i % 8)))) {
-      inodeBitmap[i / 8] |= (1 << (i % 8));
-      newInodeNumber = i;
-      break;
-    }
+  int newInodeNumber = allocateInode(&super, inodeBitmap);
+  if (growParent) {
+    parentInode.direct[slot / DIR_ENTS_PER_BLOCK] = allocateDataBlock(&super, dataBitmap);
   }
-  if (newInodeNumber == -1) {
-    return -ENOTENOUGHSPACE; // No free inode found
+
+  inode_t newInode;
+  newInode.type = type;
+  newInode.size = 0;
+  memset(newInode.direct, 0, sizeof(newInode.direct));
+  if (type == UFS_DIRECTORY) {
+    newInode.direct[0] = allocateDataBlock(&super, dataBitmap);
+    newInode.size = 2 * sizeof(dir_ent_t);
   }
+
   writeInodeBitmap(&super, inodeBitmap);
+  if (blocksNeeded > 0) {
+    writeDataBitmap(&super, dataBitmap);
+  }
 
-  dir_ent_t newDirEntry;
-  newDirEntry.inum = newInodeNumber;
-  strncpy(newDirEntry.name, name.c_str(), DIR_ENT_NAME_SIZE);
-  int bytesWritten = this->write(parentInodeNumber, &newDirEntry, sizeof(dir_ent_t));
-  if (bytesWritten != sizeof(dir_ent_t)) { //if you fail
-    inodeBitmap[newInodeNumber / 8] &= ~(1 << (newInodeNumber % 8));
-    writeInodeBitmap(&super, inodeBitmap);
-    return -EIO; 
+  // New directories start out with . and ..
+  if (type == UFS_DIRECTORY) {
+    vector<dir_ent_t> newEntries(2);
+    memset(newEntries.data(), 0, 2 * sizeof(dir_ent_t));
+    strcpy(newEntries[0].name, ".");
+    newEntries[0].inum = newInodeNumber;
+    strcpy(newEntries[1].name, "..");
+    newEntries[1].inum = parentInodeNumber;
+    writeDirectoryBlock(&newInode, newEntries, 0);
   }
 
-  // Update parent metadata
-  parentInode.size += sizeof(dir_ent_t);
-  vector<inode_t> inodes(super.num_inodes);
+  // Write the new inode and the parent metadata
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
   this->readInodeRegion(&super, inodes.data());
-  inodes[parentInodeNumber] = parentInode;
-  this->writeInodeRegion(&super, inodes.data());
-
-  // Write the new inode to the inode region
-  inode_t newInode;
-  newInode.type = type;
-  newInode.size = 0;
-  memset(newInode.direct, 0, sizeof(newInode.direct)); 
   inodes[newInodeNumber] = newInode;
+  inodes[parentInodeNumber] = parentInode;
   this->writeInodeRegion(&super, inodes.data());
 
+  // Last, link it into the parent
+  memset(&entries[slot], 0, sizeof(dir_ent_t));
+  strncpy(entries[slot].name, name.c_str(), DIR_ENT_NAME_SIZE);
+  entries[slot].inum = newInodeNumber;
+  writeDirectoryBlock(&parentInode, entries, slot / DIR_ENTS_PER_BLOCK);
+  touch(parentInodeNumber);
+  touch(newInodeNumber);
 
   return newInodeNumber; // Success!
 }
@@ -205,10 +227,6 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
   inode_t inode;
   int statResult = this->stat(inodeNumber, &inode);
 
-
-  //Just do error checks for now, will need to do more stuff later
-
-
   if (statResult != 0) {
     return -EINVALIDINODE; // Return error from stat if it fails
   }
@@ -217,7 +235,7 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
     return -EINVALIDTYPE; // Cannot write to directories
   }
 
-  if (size < 0 || size > inode.size || size > MAX_FILE_SIZE){
+  if (size < 0 || size > MAX_FILE_SIZE){
     return -EINVALIDSIZE; 
   }
 
@@ -227,8 +245,132 @@ int LocalFileSystem::write(int inodeNumber, const void *buffer, int size) {
     return -ENOTENOUGHSPACE; // Not enough direct pointers to hold the data
   }
 
+  // Existing blocks are overwritten in place, only the difference is allocated or freed
+  int numBlocksHeld = min((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+  int numBlocksExtra = numBlocksTotalNeeded - numBlocksHeld;
+  if (numBlocksExtra > 0 && !diskHasSpace(&super, 0, 0, numBlocksExtra)) {
+    return -ENOTENOUGHSPACE;
+  }
 
-  return 0;
+  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+  if (numBlocksExtra != 0) {
+    readDataBitmap(&super, dataBitmap);
+  }
+  for (int i = numBlocksHeld; i < numBlocksTotalNeeded; i++) {
+    inode.direct[i] = allocateDataBlock(&super, dataBitmap);
+  }
+  vector<unsigned int> freed;
+  for (int i = numBlocksTotalNeeded; i < numBlocksHeld; i++) {
+    freed.push_back(inode.direct[i]);
+    freeDataBlock(&super, dataBitmap, inode.direct[i]);
+    inode.direct[i] = 0;
+  }
+
+  // Data first, then the bitmap for new blocks, then the inode that points at them
+  const char *data = (const char *) buffer;
+  vector<char> blockData(UFS_BLOCK_SIZE);
+  for (int i = 0; i < numBlocksTotalNeeded; i++) {
+    int copySize = min(UFS_BLOCK_SIZE, size - i * UFS_BLOCK_SIZE);
+    if (copySize == UFS_BLOCK_SIZE) {
+      this->disk->writeBlock(inode.direct[i], (void *) (data + i * UFS_BLOCK_SIZE));
+    } else {
+      memset(blockData.data(), 0, UFS_BLOCK_SIZE);
+      memcpy(blockData.data(), data + i * UFS_BLOCK_SIZE, copySize);
+      this->disk->writeBlock(inode.direct[i], blockData.data());
+    }
+  }
+  if (numBlocksExtra > 0) {
+    writeDataBitmap(&super, dataBitmap);
+  }
+
+  inode.size = size;
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  this->readInodeRegion(&super, inodes.data());
+  inodes[inodeNumber] = inode;
+  this->writeInodeRegion(&super, inodes.data());
+  touch(inodeNumber);
+
+  // Blocks are only handed back once nothing points at them
+  if (freed.size() > 0) {
+    writeDataBitmap(&super, dataBitmap);
+  }
+
+  return size;
+}
+
+int LocalFileSystem::patch(int inodeNumber, const void *buffer, int size, int offset) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (inode.type != UFS_REGULAR_FILE) {
+    return -EINVALIDTYPE;
+  }
+  if (size < 0 || offset < 0 || offset > inode.size || size > MAX_FILE_SIZE - offset) {
+    return -EINVALIDSIZE;
+  }
+  if (size == 0) {
+    return 0;
+  }
+
+  super_t super;
+  readSuperBlock(&super);
+  int end = offset + size;
+  int newSize = max(inode.size, end);
+  int numBlocksHeld = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int numBlocksNeeded = (newSize + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  int numBlocksExtra = numBlocksNeeded - numBlocksHeld;
+  if (numBlocksExtra > 0 && !diskHasSpace(&super, 0, 0, numBlocksExtra)) {
+    return -ENOTENOUGHSPACE;
+  }
+
+  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+  if (numBlocksExtra > 0) {
+    readDataBitmap(&super, dataBitmap);
+    for (int i = numBlocksHeld; i < numBlocksNeeded; i++) {
+      inode.direct[i] = allocateDataBlock(&super, dataBitmap);
+    }
+  }
+
+  // Blocks the range covers completely are written straight from the
+  // buffer, the partial ones at either end are merged with what is there
+  const char *data = (const char *) buffer;
+  vector<char> blockData(UFS_BLOCK_SIZE);
+  for (int i = offset / UFS_BLOCK_SIZE; i * UFS_BLOCK_SIZE < end; i++) {
+    int blockStart = i * UFS_BLOCK_SIZE;
+    int copyStart = max(offset, blockStart);
+    int copyEnd = min(end, blockStart + UFS_BLOCK_SIZE);
+    if (copyStart == blockStart && copyEnd == blockStart + UFS_BLOCK_SIZE) {
+      this->disk->writeBlock(inode.direct[i], (void *) (data + copyStart - offset));
+      continue;
+    }
+    if (i < numBlocksHeld) {
+      this->disk->readBlock(inode.direct[i], blockData.data());
+    } else {
+      memset(blockData.data(), 0, UFS_BLOCK_SIZE);
+    }
+    memcpy(blockData.data() + copyStart - blockStart, data + copyStart - offset, copyEnd - copyStart);
+    this->disk->writeBlock(inode.direct[i], blockData.data());
+  }
+  if (numBlocksExtra > 0) {
+    writeDataBitmap(&super, dataBitmap);
+  }
+
+  if (newSize != inode.size) {
+    inode.size = newSize;
+    writeInode(&super, inodeNumber, &inode);
+  }
+  touch(inodeNumber);
+
+  return size;
+}
+
+int LocalFileSystem::append(int inodeNumber, const void *buffer, int size) {
+  inode_t inode;
+  if (this->stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+  return patch(inodeNumber, buffer, size, inode.size);
 }
 
 int LocalFileSystem::unlink(int parentInodeNumber, string name) {
@@ -239,67 +381,59 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   }
   // Check parent inode
   inode_t parentInode;
-  int statResult = this->stat(parentInodeNumber, &parentInode);
-  if (statResult != 0 || parentInode.type != UFS_DIRECTORY) {
+  vector<dir_ent_t> entries;
+  if (readDirectory(parentInodeNumber, &parentInode, entries) != 0) {
     return -EINVALIDINODE; // Parent inode MUST be a directory by definition
   }
+  if (name.length() == 0 || name.length() >= DIR_ENT_NAME_SIZE) {
+    return -EINVALIDNAME;
+  }
 
-  // Find the inode number of the entry
-  int inodeNumber = this->lookup(parentInodeNumber, name);
-  if (inodeNumber != 3 && inodeNumber != 7) {
-    return 0; //Make sure it exists
+  // Find the entry, a name that doesn't exist is not an error
+  int slot = -1;
+  for (int i = 0; i < (int) entries.size(); i++) {
+    if (entries[i].inum != -1 && strcmp(entries[i].name, name.c_str()) == 0) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot == -1) {
+    return 0;
   }
+  int inodeNumber = entries[slot].inum;
 
   // get the actual inode to be unlinked
   inode_t inode;
-  int statResult2 = this->stat(inodeNumber, &inode);
-  if (statResult2 != 0) {
-    return -EINVALIDINODE; // Parent inode is not a directory
+  vector<dir_ent_t> childEntries;
+  if (this->stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
   }
 
   //check if the inode is an empty directory
-  if (inode.type == UFS_DIRECTORY){
-    for (int i = 0; i < DIRECT_PTRS; i++) {
-      if (inode.direct[i] != static_cast<unsigned int>(-1)) {
+  if (inode.type == UFS_DIRECTORY) {
+    readDirectory(inodeNumber, &inode, childEntries);
+    for (unsigned int i = 0; i < childEntries.size(); i++) {
+      if (childEntries[i].inum != -1 && strcmp(childEntries[i].name, ".") != 0 &&
+          strcmp(childEntries[i].name, "..") != 0) {
         return -EDIRNOTEMPTY;
       }
     }
   }
 
-
-  if (inode.type == UFS_DIRECTORY){
-    char block_data[4096];
-    //now we have parent inode and actual inode to be unlinked. 
-    for (unsigned int i = 0; i < DIRECT_PTRS; i++) {
-      if (parentInode.direct[i] != static_cast<unsigned int>(-1)) {
-        disk->readBlock(parentInode.direct[i],block_data);
-        for (int j = 0; j < static_cast<int>(4096 / sizeof(dir_ent_t)); j++) { // Cast the result to int
-          dir_ent_t *entry = (dir_ent_t *)&block_data[j * sizeof(dir_ent_t)];
-          if (string(entry->name) == name) {
-            // Mark as unused
-            entry->inum = -1;
-            // Update the directory size
-            parentInode.size -= sizeof(dir_ent_t);
-            // Write back
-            disk->writeBlock(parentInode.direct[i], block_data);
-            break;
-          }
-        }
-      }
-    }
-  }
-
+  // Tombstone the entry first so nothing points at the freed inode
+  entries[slot].inum = -1;
+  writeDirectoryBlock(&parentInode, entries, slot / DIR_ENTS_PER_BLOCK);
+  touch(parentInodeNumber);
+  touch(inodeNumber);
 
   // Free data blocks
   super_t super;
   readSuperBlock(&super);
   unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
   readDataBitmap(&super, dataBitmap);
-  for (unsigned int i = 0; i < DIRECT_PTRS; i++) {
-      if (inode.direct[i] != static_cast<unsigned int>(-1)) {
-          int blockIndex = inode.direct[i] - super.data_region_addr;
-          dataBitmap[blockIndex / 8] &= ~(1 << (blockIndex % 8));
-      }
+  int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  for (int i = 0; i < numBlocks && i < DIRECT_PTRS; i++) {
+    freeDataBlock(&super, dataBitmap, inode.direct[i]);
   }
   writeDataBitmap(&super, dataBitmap);
 
@@ -309,25 +443,370 @@ int LocalFileSystem::unlink(int parentInodeNumber, string name) {
   inodeBitmap[inodeNumber / 8] &= ~(1 << (inodeNumber % 8));
   writeInodeBitmap(&super, inodeBitmap);
 
+  if (shouldCompact(entries)) {
+    compactDirectory(parentInodeNumber);
+  }
+
   return 0; // Success
 }
 
+int LocalFileSystem::rename(int srcParentInodeNumber, string srcName, int dstParentInodeNumber, string dstName) {
+  inode_t srcParentInode;
+  vector<dir_ent_t> srcEntries;
+  inode_t dstParentInode;
+  vector<dir_ent_t> dstEntries;
+  if (readDirectory(srcParentInodeNumber, &srcParentInode, srcEntries) != 0 ||
+      readDirectory(dstParentInodeNumber, &dstParentInode, dstEntries) != 0) {
+    return -EINVALIDINODE;
+  }
+  if (srcName.length() == 0 || srcName.length() >= DIR_ENT_NAME_SIZE || srcName == "." || srcName == ".." ||
+      dstName.length() == 0 || dstName.length() >= DIR_ENT_NAME_SIZE || dstName == "." || dstName == "..") {
+    return -EINVALIDNAME;
+  }
 
-void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
-  for (int i = 0; i < super->data_bitmap_len; ++i) {
-    int dataBitmapBlockNumber = super->data_bitmap_addr + i;  // Calculate the block number
-    int offset = i * UFS_BLOCK_SIZE;     // Calculate the offset
-    // Read the current block of data bitmap from the disk
-    this->disk->readBlock(dataBitmapBlockNumber, dataBitmap + offset);
+  int inodeNumber = lookup(srcParentInodeNumber, srcName);
+  if (inodeNumber < 0) {
+    return -ENOTFOUND;
   }
+  inode_t inode;
+  if (stat(inodeNumber, &inode) != 0) {
+    return -EINVALIDINODE;
+  }
+
+  // A directory can't end up below itself, walk up from the destination
+  if (inode.type == UFS_DIRECTORY) {
+    int ancestor = dstParentInodeNumber;
+    while (true) {
+      if (ancestor == inodeNumber) {
+        return -EMOVEINTOSELF;
+      }
+      if (ancestor == UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+        break;
+      }
+      int up = lookup(ancestor, "..");
+      if (up < 0 || up == ancestor) {
+        break;
+      }
+      ancestor = up;
+    }
+  }
+
+  int existing = lookup(dstParentInodeNumber, dstName);
+  if (existing == inodeNumber) {
+    return 0; // Already there
+  }
+  if (existing >= 0) {
+    inode_t existingInode;
+    if (stat(existing, &existingInode) != 0) {
+      return -EINVALIDINODE;
+    }
+    if (existingInode.type != inode.type) {
+      return -EINVALIDTYPE;
+    }
+  }
+
+  bool ownTransaction = !disk->inTransaction();
+  if (ownTransaction) {
+    disk->beginTransaction();
+  }
+
+  // The replaced entry goes first, unlink may compact the destination
+  if (existing >= 0) {
+    int ret = unlink(dstParentInodeNumber, dstName);
+    if (ret < 0) {
+      if (ownTransaction) {
+        disk->rollback();
+      }
+      return ret;
+    }
+    readDirectory(dstParentInodeNumber, &dstParentInode, dstEntries);
+    readDirectory(srcParentInodeNumber, &srcParentInode, srcEntries);
+  }
+
+  int srcSlot = -1;
+  for (int i = 0; i < (int) srcEntries.size(); i++) {
+    if (srcEntries[i].inum == inodeNumber && strcmp(srcEntries[i].name, srcName.c_str()) == 0) {
+      srcSlot = i;
+      break;
+    }
+  }
+
+  // Renaming within a directory rewrites the one entry in place
+  if (srcParentInodeNumber == dstParentInodeNumber) {
+    memset(srcEntries[srcSlot].name, 0, DIR_ENT_NAME_SIZE);
+    strncpy(srcEntries[srcSlot].name, dstName.c_str(), DIR_ENT_NAME_SIZE);
+    writeDirectoryBlock(&srcParentInode, srcEntries, srcSlot / DIR_ENTS_PER_BLOCK);
+    touch(srcParentInodeNumber);
+    touch(inodeNumber);
+    if (ownTransaction) {
+      disk->commit();
+    }
+    return 0;
+  }
+
+  int oldSize = dstParentInode.size;
+  bool growParent;
+  int dstSlot = findFreeSlot(&dstParentInode, dstEntries, &growParent);
+  super_t super;
+  readSuperBlock(&super);
+  if (dstSlot < 0 || (growParent && !diskHasSpace(&super, 0, 0, 1))) {
+    if (ownTransaction) {
+      disk->rollback();
+    }
+    return -ENOTENOUGHSPACE;
+  }
+
+  // Link into the destination, then drop the old entry
+  if (growParent) {
+    unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+    readDataBitmap(&super, dataBitmap);
+    dstParentInode.direct[dstSlot / DIR_ENTS_PER_BLOCK] = allocateDataBlock(&super, dataBitmap);
+    writeDataBitmap(&super, dataBitmap);
+  }
+  memset(&dstEntries[dstSlot], 0, sizeof(dir_ent_t));
+  strncpy(dstEntries[dstSlot].name, dstName.c_str(), DIR_ENT_NAME_SIZE);
+  dstEntries[dstSlot].inum = inodeNumber;
+  writeDirectoryBlock(&dstParentInode, dstEntries, dstSlot / DIR_ENTS_PER_BLOCK);
+  if (dstParentInode.size != oldSize) {
+    vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+    readInodeRegion(&super, inodes.data());
+    inodes[dstParentInodeNumber] = dstParentInode;
+    writeInodeRegion(&super, inodes.data());
+  }
+
+  srcEntries[srcSlot].inum = -1;
+  writeDirectoryBlock(&srcParentInode, srcEntries, srcSlot / DIR_ENTS_PER_BLOCK);
+
+  // A moved directory's .. follows it
+  if (inode.type == UFS_DIRECTORY) {
+    vector<dir_ent_t> childEntries;
+    readDirectory(inodeNumber, &inode, childEntries);
+    for (int i = 0; i < (int) childEntries.size(); i++) {
+      if (childEntries[i].inum != -1 && strcmp(childEntries[i].name, "..") == 0) {
+        childEntries[i].inum = dstParentInodeNumber;
+        writeDirectoryBlock(&inode, childEntries, i / DIR_ENTS_PER_BLOCK);
+        break;
+      }
+    }
+  }
+  touch(srcParentInodeNumber);
+  touch(dstParentInodeNumber);
+  touch(inodeNumber);
+
+  if (shouldCompact(srcEntries)) {
+    compactDirectory(srcParentInodeNumber);
+  }
+
+  if (ownTransaction) {
+    disk->commit();
+  }
+  return 0;
 }
 
+int LocalFileSystem::compactDirectory(int inodeNumber) {
+  inode_t inode;
+  vector<dir_ent_t> entries;
+  if (readDirectory(inodeNumber, &inode, entries) != 0) {
+    return -EINVALIDINODE;
+  }
 
+  vector<dir_ent_t> live;
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    if (entries[i].inum != -1) {
+      live.push_back(entries[i]);
+    }
+  }
+  if (live.size() == entries.size()) {
+    return 0; // No tombstones, nothing to do
+  }
 
-void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
-  for (int i = 0; i < super->inode_region_len; ++i) {
-    this->disk->readBlock(super->inode_region_addr + i, reinterpret_cast<unsigned char*>(inodes) + (i * UFS_BLOCK_SIZE));
+  int oldBlocks = (entries.size() + DIR_ENTS_PER_BLOCK - 1) / DIR_ENTS_PER_BLOCK;
+  int newBlocks = (live.size() + DIR_ENTS_PER_BLOCK - 1) / DIR_ENTS_PER_BLOCK;
+
+  bool ownTransaction = !disk->inTransaction();
+  if (ownTransaction) {
+    disk->beginTransaction();
+  }
+
+  // Pack the live entries into the leading blocks
+  for (int i = 0; i < newBlocks; i++) {
+    writeDirectoryBlock(&inode, live, i);
+  }
+
+  // Then drop the tail from the inode before handing the blocks back
+  super_t super;
+  readSuperBlock(&super);
+  vector<unsigned int> freed;
+  for (int i = newBlocks; i < oldBlocks; i++) {
+    freed.push_back(inode.direct[i]);
+    inode.direct[i] = 0;
+  }
+  inode.size = live.size() * sizeof(dir_ent_t);
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  readInodeRegion(&super, inodes.data());
+  inodes[inodeNumber] = inode;
+  writeInodeRegion(&super, inodes.data());
+  touch(inodeNumber);
+
+  if (freed.size() > 0) {
+    unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+    readDataBitmap(&super, dataBitmap);
+    for (unsigned int i = 0; i < freed.size(); i++) {
+      freeDataBlock(&super, dataBitmap, freed[i]);
+    }
+    writeDataBitmap(&super, dataBitmap);
+  }
+
+  if (ownTransaction) {
+    disk->commit();
+  }
+
+  return freed.size();
+}
+
+int LocalFileSystem::readDirectory(int inodeNumber, inode_t *inode, vector<dir_ent_t> &entries) {
+  if (this->stat(inodeNumber, inode) != 0 || inode->type != UFS_DIRECTORY) {
+    return -EINVALIDINODE;
+  }
+
+  entries.resize(inode->size / sizeof(dir_ent_t));
+  if (inode->size > 0) {
+    this->read(inodeNumber, entries.data(), entries.size() * sizeof(dir_ent_t));
+  }
+  return 0;
+}
+
+unsigned long long LocalFileSystem::changeCount(int inodeNumber) {
+  if (inodeNumber < 0 || inodeNumber >= (int) changeCounts.size()) {
+    return 0;
+  }
+  return changeCounts[inodeNumber];
+}
+
+void LocalFileSystem::touch(int inodeNumber) {
+  if (inodeNumber >= (int) changeCounts.size()) {
+    changeCounts.resize(inodeNumber + 1, 0);
+  }
+  changeCounts[inodeNumber]++;
+  changed.insert(inodeNumber);
+}
+
+vector<int> LocalFileSystem::takeChanges() {
+  vector<int> inodeNumbers(changed.begin(), changed.end());
+  changed.clear();
+  return inodeNumbers;
+}
+
+bool LocalFileSystem::diskHasSpace(super_t *super, int numInodesNeeded, int numDataBytesNeeded, int numDataBlocksNeeded) {
+  numDataBlocksNeeded += (numDataBytesNeeded + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+
+  unsigned char inodeBitmap[super->inode_bitmap_len * UFS_BLOCK_SIZE];
+  readInodeBitmap(super, inodeBitmap);
+  int freeInodes = 0;
+  for (int i = 0; i < super->num_inodes && freeInodes < numInodesNeeded; i++) {
+    if (!(inodeBitmap[i / 8] & (1 << (i % 8)))) {
+      freeInodes++;
+    }
+  }
+
+  unsigned char dataBitmap[super->data_bitmap_len * UFS_BLOCK_SIZE];
+  readDataBitmap(super, dataBitmap);
+  int freeBlocks = 0;
+  for (int i = 0; i < super->num_data && freeBlocks < numDataBlocksNeeded; i++) {
+    if (!(dataBitmap[i / 8] & (1 << (i % 8)))) {
+      freeBlocks++;
+    }
+  }
+
+  return freeInodes >= numInodesNeeded && freeBlocks >= numDataBlocksNeeded;
+}
+
+int LocalFileSystem::allocateInode(super_t *super, unsigned char *inodeBitmap) {
+  for (int i = 0; i < super->num_inodes; ++i) {
+    if (!(inodeBitmap[i / 8] & (1 << (i % 8)))) {
+      inodeBitmap[i / 8] |= (1 << (i % 8));
+      return i;
+    }
   }
+  return -1;
+}
+
+int LocalFileSystem::allocateDataBlock(super_t *super, unsigned char *dataBitmap) {
+  for (int i = 0; i < super->num_data; ++i) {
+    if (!(dataBitmap[i / 8] & (1 << (i % 8)))) {
+      dataBitmap[i / 8] |= (1 << (i % 8));
+      return super->data_region_addr + i;
+    }
+  }
+  return -1;
+}
+
+void LocalFileSystem::freeDataBlock(super_t *super, unsigned char *dataBitmap, int blockNumber) {
+  int blockIndex = blockNumber - super->data_region_addr;
+  if (blockIndex >= 0 && blockIndex < super->num_data) {
+    dataBitmap[blockIndex / 8] &= ~(1 << (blockIndex % 8));
+  }
+}
+
+void LocalFileSystem::writeDirectoryBlock(inode_t *inode, vector<dir_ent_t> &entries, int blockIndex) {
+  dir_ent_t block[DIR_ENTS_PER_BLOCK];
+  memset(block, 0, sizeof(block));
+  for (int i = 0; i < DIR_ENTS_PER_BLOCK; i++) {
+    unsigned int slot = blockIndex * DIR_ENTS_PER_BLOCK + i;
+    if (slot < entries.size()) {
+      block[i] = entries[slot];
+    } else {
+      block[i].inum = -1;
+    }
+  }
+  this->disk->writeBlock(inode->direct[blockIndex], block);
+}
+
+// Reuses a tombstoned slot before growing the directory by one entry.
+// grow says whether that entry needs a new block. Returns -1 when the
+// directory is out of direct blocks.
+int LocalFileSystem::findFreeSlot(inode_t *inode, vector<dir_ent_t> &entries, bool *grow) {
+  *grow = false;
+  for (int i = 0; i < (int) entries.size(); i++) {
+    if (entries[i].inum == -1) {
+      return i;
+    }
+  }
+  int slot = entries.size();
+  *grow = (slot % DIR_ENTS_PER_BLOCK) == 0;
+  if (*grow && slot / DIR_ENTS_PER_BLOCK >= DIRECT_PTRS) {
+    return -1;
+  }
+  dir_ent_t empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.inum = -1;
+  entries.push_back(empty);
+  inode->size += sizeof(dir_ent_t);
+  return slot;
+}
+
+bool LocalFileSystem::shouldCompact(vector<dir_ent_t> &entries) {
+  int tombstones = 0;
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    if (entries[i].inum == -1) {
+      tombstones++;
+    }
+  }
+  int live = entries.size() - tombstones;
+  int oldBlocks = (entries.size() + DIR_ENTS_PER_BLOCK - 1) / DIR_ENTS_PER_BLOCK;
+  int newBlocks = (live + DIR_ENTS_PER_BLOCK - 1) / DIR_ENTS_PER_BLOCK;
+  return tombstones * 100 >= (int) entries.size() * DIR_COMPACT_THRESHOLD_PERCENT && newBlocks < oldBlocks;
+}
+
+
+void LocalFileSystem::readDataBitmap(super_t *super, unsigned char *dataBitmap) {
+  this->disk->readBlocks(super->data_bitmap_addr, super->data_bitmap_len, dataBitmap);
+}
+
+
+
+void LocalFileSystem::readInodeRegion(super_t *super, inode_t *inodes) {
+  this->disk->readBlocks(super->inode_region_addr, super->inode_region_len, inodes);
 }
 
 void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
@@ -337,12 +816,17 @@ void LocalFileSystem::writeInodeRegion(super_t *super, inode_t *inodes) {
 }
 
 
+void LocalFileSystem::writeInode(super_t *super, int inodeNumber, inode_t *inode) {
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  inode_t block[inodesPerBlock];
+  int blockNumber = super->inode_region_addr + inodeNumber / inodesPerBlock;
+  this->disk->readBlock(blockNumber, block);
+  block[inodeNumber % inodesPerBlock] = *inode;
+  this->disk->writeBlock(blockNumber, block);
+}
+
 void LocalFileSystem::readInodeBitmap(super_t *super, unsigned char *inodeBitmap) {
-    for (int i = 0; i < super->inode_bitmap_len; ++i) {
-        int inodeBitmapBlockNumber = super->inode_bitmap_addr + i;
-        int offset = i * UFS_BLOCK_SIZE;
-        this->disk->readBlock(inodeBitmapBlockNumber, inodeBitmap + offset);
-    }
+  this->disk->readBlocks(super->inode_bitmap_addr, super->inode_bitmap_len, inodeBitmap);
 }
 
 void LocalFileSystem::writeInodeBitmap(super_t *super, unsigned char *inodeBitmap) {  // Writes each block of inode bitmap to disk
@@ -0,0 +1,200 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "ReedSolomon.h"
+
+using namespace std;
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual generator polynomial for GF(2^8)
+#define FIELD_POLYNOMIAL (0x11d)
+
+static uint8_t EXP[512];
+static uint8_t LOG[256];
+// PRODUCTS[c][x] is c * x
+static uint8_t PRODUCTS[256][256];
+static bool tablesBuilt = false;
+
+void ReedSolomon::buildTables() {
+  if (tablesBuilt) {
+    return;
+  }
+  int x = 1;
+  for (int i = 0; i < 255; i++) {
+    EXP[i] = x;
+    LOG[x] = i;
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= FIELD_POLYNOMIAL;
+    }
+  }
+  // Doubled so a sum of two logs needs no modulo
+  for (int i = 255; i < 512; i++) {
+    EXP[i] = EXP[i - 255];
+  }
+  for (int a = 0; a < 256; a++) {
+    for (int b = 0; b < 256; b++) {
+      PRODUCTS[a][b] = (a == 0 || b == 0) ? 0 : EXP[LOG[a] + LOG[b]];
+    }
+  }
+  tablesBuilt = true;
+}
+
+uint8_t ReedSolomon::multiply(uint8_t a, uint8_t b) {
+  return PRODUCTS[a][b];
+}
+
+uint8_t ReedSolomon::inverse(uint8_t a) {
+  return EXP[255 - LOG[a]];
+}
+
+void ReedSolomon::multiplyAdd(uint8_t c, const uint8_t *in, uint8_t *out, size_t length) {
+  if (c == 0) {
+    return;
+  }
+  size_t i = 0;
+  if (c == 1) {
+    // Plain XOR, a word at a time
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+      uint64_t a, b;
+      memcpy(&a, in + i, sizeof(a));
+      memcpy(&b, out + i, sizeof(b));
+      b ^= a;
+      memcpy(out + i, &b, sizeof(b));
+    }
+    for (; i < length; i++) {
+      out[i] ^= in[i];
+    }
+    return;
+  }
+  const uint8_t *row = PRODUCTS[c];
+  for (; i + 4 <= length; i += 4) {
+    out[i] ^= row[in[i]];
+    out[i + 1] ^= row[in[i + 1]];
+    out[i + 2] ^= row[in[i + 2]];
+    out[i + 3] ^= row[in[i + 3]];
+  }
+  for (; i < length; i++) {
+    out[i] ^= row[in[i]];
+  }
+}
+
+ReedSolomon::ReedSolomon(int dataShards, int parityShards) {
+  buildTables();
+  numData = dataShards;
+  numParity = parityShards;
+  int total = dataShards + parityShards;
+  matrix.assign(total * dataShards, 0);
+  for (int i = 0; i < dataShards; i++) {
+    matrix[i * dataShards + i] = 1;
+  }
+  // Cauchy rows 1 / (x_i + y_j) with x_i = dataShards + i and y_j = j,
+  // all distinct so no denominator is 0
+  for (int i = 0; i < parityShards; i++) {
+    for (int j = 0; j < dataShards; j++) {
+      matrix[(dataShards + i) * dataShards + j] = inverse((dataShards + i) ^ j);
+    }
+  }
+}
+
+vector<string> ReedSolomon::encode(const string &data) {
+  size_t shardSize = (data.size() + numData - 1) / numData;
+  vector<string> shards(numData + numParity, string(shardSize, '\0'));
+  for (int i = 0; i < numData; i++) {
+    size_t start = i * shardSize;
+    if (start < data.size()) {
+      shards[i].replace(0, min(shardSize, data.size() - start), data, start, shardSize);
+    }
+  }
+  for (int i = 0; i < numParity; i++) {
+    uint8_t *out = (uint8_t *) &shards[numData + i][0];
+    for (int j = 0; j < numData && shardSize > 0; j++) {
+      multiplyAdd(matrix[(numData + i) * numData + j], (const uint8_t *) shards[j].data(), out, shardSize);
+    }
+  }
+  return shards;
+}
+
+// Gauss-Jordan elimination in place, false if the matrix is singular
+bool ReedSolomon::invert(vector<uint8_t> &m, int size) {
+  vector<uint8_t> result(size * size, 0);
+  for (int i = 0; i < size; i++) {
+    result[i * size + i] = 1;
+  }
+  for (int column = 0; column < size; column++) {
+    int pivot = column;
+    while (pivot < size && m[pivot * size + column] == 0) {
+      pivot++;
+    }
+    if (pivot == size) {
+      return false;
+    }
+    if (pivot != column) {
+      for (int j = 0; j < size; j++) {
+        swap(m[pivot * size + j], m[column * size + j]);
+        swap(result[pivot * size + j], result[column * size + j]);
+      }
+    }
+    uint8_t scale = inverse(m[column * size + column]);
+    for (int j = 0; j < size; j++) {
+      m[column * size + j] = multiply(m[column * size + j], scale);
+      result[column * size + j] = multiply(result[column * size + j], scale);
+    }
+    for (int row = 0; row < size; row++) {
+      uint8_t factor = m[row * size + column];
+      if (row == column || factor == 0) {
+        continue;
+      }
+      multiplyAdd(factor, &m[column * size], &m[row * size], size);
+      multiplyAdd(factor, &result[column * size], &result[row * size], size);
+    }
+  }
+  m = result;
+  return true;
+}
+
+bool ReedSolomon::reconstruct(vector<string> &shards, vector<bool> &present) {
+  vector<int> rows;
+  for (int i = 0; i < numData + numParity && (int) rows.size() < numData; i++) {
+    if (present[i]) {
+      rows.push_back(i);
+    }
+  }
+  if ((int) rows.size() < numData) {
+    return false;
+  }
+  bool missing = false;
+  for (int i = 0; i < numData; i++) {
+    missing = missing || !present[i];
+  }
+  if (!missing) {
+    return true;
+  }
+
+  // The surviving rows map the data to what survived, so their inverse
+  // maps what survived back to the data
+  vector<uint8_t> decode(numData * numData);
+  for (int r = 0; r < numData; r++) {
+    memcpy(&decode[r * numData], &matrix[rows[r] * numData], numData);
+  }
+  if (!invert(decode, numData)) {
+    return false;
+  }
+
+  size_t shardSize = shards[rows[0]].size();
+  for (int i = 0; i < numData; i++) {
+    if (present[i]) {
+      continue;
+    }
+    string rebuilt(shardSize, '\0');
+    for (int r = 0; r < numData && shardSize > 0; r++) {
+      multiplyAdd(decode[i * numData + r], (const uint8_t *) shards[rows[r]].data(), (uint8_t *) &rebuilt[0],
+                  shardSize);
+    }
+    shards[i] = rebuilt;
+  }
+  for (int i = 0; i < numData; i++) {
+    present[i] = true;
+  }
+  return true;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include "Replicator.h"
+#include "HttpClient.h"
+#include "FastHash.h"
+#include "dthread.h"
+
+using namespace std;
+
+// How often the catch-up thread looks for peers that are behind
+#define CATCH_UP_INTERVAL_SECONDS (1)
+// A peer that takes longer counts as down, so a hung one can't hold up
+// writes; the catch-up thread tries it again later
+#define PEER_TIMEOUT_MS (2000)
+// Past this many bytes of logged bodies the oldest entries are dropped,
+// peers that still needed them have to be reseeded
+#define MAX_LOG_BYTES (64 * 1024 * 1024)
+
+Replicator::Replicator(vector<string> hosts, int quorum) {
+  for (unsigned int i = 0; i < hosts.size(); i++) {
+    size_t colon = hosts[i].rfind(':');
+    Peer *peer = new Peer();
+    peer->host = hosts[i].substr(0, colon);
+    peer->port = atoi(hosts[i].substr(colon + 1).c_str());
+    peer->acked = 0;
+    pthread_mutex_init(&peer->sending, NULL);
+    peers.push_back(peer);
+  }
+  writeQuorum = quorum;
+
+  // Peers tell a restarted sender from the old one by the epoch
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) FastHash::combine(time(NULL), getpid()));
+  epoch = hex;
+
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&recorded, NULL);
+  logBytes = 0;
+  firstSeq = 1;
+  nextSeq = 1;
+
+  pthread_t thread;
+  dthread_create(&thread, NULL, catchUp, this);
+  dthread_detach(thread);
+}
+
+unsigned long long Replicator::record(Mutation &mutation) {
+  dthread_mutex_lock(&lock);
+  unsigned long long seq = nextSeq++;
+  log.push_back(mutation);
+  logBytes += mutation.body.size();
+  // The newest entry always stays, the request that made it is about to
+  // replicate it
+  while (logBytes > MAX_LOG_BYTES && log.size() > 1) {
+    logBytes -= log.front().body.size();
+    log.pop_front();
+    firstSeq++;
+  }
+  dthread_cond_signal(&recorded);
+  dthread_mutex_unlock(&lock);
+  return seq;
+}
+
+int Replicator::replicate(unsigned long long seq) {
+  int copies = 1;
+  for (unsigned int i = 0; i < peers.size() && copies < writeQuorum; i++) {
+    if (sync(i, seq)) {
+      copies++;
+    }
+  }
+  return copies;
+}
+
+// Sends peer everything it is missing up to seq, one request per entry
+bool Replicator::sync(int index, unsigned long long seq) {
+  Peer *peer = peers[index];
+  dthread_mutex_lock(&peer->sending);
+  bool synced = true;
+  while (true) {
+    dthread_mutex_lock(&lock);
+    unsigned long long next = peer->acked + 1;
+    if (next > seq) {
+      dthread_mutex_unlock(&lock);
+      break;
+    }
+    if (next < firstSeq) {
+      // Only a peer that went back to an older image says it has less
+      dthread_mutex_unlock(&lock);
+      cerr << "replication: " << peer->host << ":" << peer->port << " needs entry " << next
+           << " which is no longer logged, reseed it" << endl;
+      synced = false;
+      break;
+    }
+    Mutation mutation = log[next - firstSeq];
+    dthread_mutex_unlock(&lock);
+
+    int status = 0;
+    string applied;
+    try {
+      HttpClient client(peer->host.c_str(), peer->port, false, PEER_TIMEOUT_MS);
+      stringstream replica;
+      replica << epoch << ":" << next;
+      client.set_header("X-Ds3-Replica", replica.str());
+      if (mutation.destination != "") {
+        client.set_header("Destination", mutation.destination);
+      }
+      client.write_request(mutation.path, mutation.method, mutation.body);
+      HTTPClientResponse *response = client.read_response();
+      status = response->status();
+      applied = response->header("X-Ds3-Replica-Applied");
+      delete response;
+    } catch (...) {
+      status = 0;
+    }
+    if (status == 0 || applied == "") {
+      synced = false; // Down, or not a ds3 node that knows about replicas
+      break;
+    }
+
+    // The peer says where it is, which may be behind what it had acked
+    // if it restarted
+    dthread_mutex_lock(&lock);
+    peer->acked = strtoull(applied.c_str(), NULL, 10);
+    dthread_mutex_unlock(&lock);
+  }
+  dthread_mutex_unlock(&peer->sending);
+  trim();
+  return synced;
+}
+
+// Drops the entries every peer has
+void Replicator::trim() {
+  dthread_mutex_lock(&lock);
+  unsigned long long acked = nextSeq - 1;
+  for (unsigned int i = 0; i < peers.size(); i++) {
+    acked = min(acked, peers[i]->acked);
+  }
+  while (firstSeq <= acked && !log.empty()) {
+    logBytes -= log.front().body.size();
+    log.pop_front();
+    firstSeq++;
+  }
+  dthread_mutex_unlock(&lock);
+}
+
+void *Replicator::catchUp(void *arg) {
+  Replicator *replicator = (Replicator *) arg;
+  while (true) {
+    dthread_mutex_lock(&replicator->lock);
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + CATCH_UP_INTERVAL_SECONDS;
+    deadline.tv_nsec = now.tv_usec * 1000;
+    pthread_cond_timedwait(&replicator->recorded, &replicator->lock, &deadline);
+    unsigned long long last = replicator->nextSeq - 1;
+    dthread_mutex_unlock(&replicator->lock);
+
+    for (unsigned int i = 0; i < replicator->peers.size(); i++) {
+      replicator->sync(i, last);
+    }
+  }
+  return NULL;
+}
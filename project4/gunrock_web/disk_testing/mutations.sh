@@ -0,0 +1,103 @@
+#!/bin/sh
+# Builds mutations.img from scratch through the ds3 API and compares
+# ds3ls, ds3cat and ds3bits on it with the expected outputs kept here.
+# Covers directory compaction after create/unlink churn, moving a
+# directory into another one (its .. entry), and appends and patches that
+# cross block boundaries. It first checks that mkfs -s lays out an image
+# whose data bitmap sits on a block boundary. Run from gunrock_web after make; -u rewrites
+# the image and the expected outputs instead of comparing.
+#
+# usage: disk_testing/mutations.sh [-u]
+
+set -e
+
+PORT=${PORT:-8097}
+HERE=disk_testing
+WORK=$(mktemp -d)
+IMAGE=$WORK/mutations.img
+URL=http://localhost:$PORT/ds3
+
+cleanup() {
+    [ -n "$SERVER" ] && kill "$SERVER" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+request() {
+    status=$(curl -s -o /dev/null -w '%{http_code}' "$@")
+    case $status in
+    2*) ;;
+    *) echo "mutations: $* answered $status" >&2; exit 1 ;;
+    esac
+}
+
+# n bytes of a repeating pattern that starts with tag
+pattern() {
+    yes "$2" | tr -d '\n' | head -c "$1"
+}
+
+# An image size whose data bitmap sits right on a block boundary, the
+# layout used to flip between two bitmap lengths and never finish
+timeout 10 ./mkfs -F -f "$WORK/layout.img" -s 134238208 -i 32 > /dev/null
+./ds3fsck "$WORK/layout.img" > /dev/null
+rm -f "$WORK/layout.img"
+
+./mkfs -f "$IMAGE" -d 64 -i 256 > /dev/null
+./gunrock_web -p "$PORT" -i "$IMAGE" > "$WORK/server.log" 2>&1 &
+SERVER=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -s -o /dev/null "$URL/" && break
+    sleep 0.2
+done
+
+# 200 empty files take the directory to two blocks, deleting 150 of them
+# compacts it back to one and frees the second
+i=0
+while [ $i -lt 200 ]; do
+    request -X PUT --data-binary '' "$URL/churn/f$(printf '%03d' $i)"
+    i=$((i + 1))
+done
+i=50
+while [ $i -lt 200 ]; do
+    request -X DELETE "$URL/churn/f$(printf '%03d' $i)"
+    i=$((i + 1))
+done
+request -X PUT --data-binary 'after compaction' "$URL/churn/new.txt"
+
+# The moved directory's .. has to point at its new parent
+request -X PUT --data-binary 'inside' "$URL/src/sub/inner.txt"
+request -X PUT --data-binary '' "$URL/dst/keep.txt"
+request -X MOVE -H "Destination: /ds3/dst/moved" "$URL/src/sub"
+
+# 4000 bytes, an append into the second block, a patch across the first
+# boundary and one more append into the third block
+pattern 4000 'base-' | request -X PUT --data-binary @- "$URL/data/log.txt"
+pattern 300 'append1-' | request -X POST --data-binary @- "$URL/data/log.txt?append"
+request -X POST --data-binary 'PATCHED-ACROSS-THE-BOUNDARY' "$URL/data/log.txt?offset=4080"
+pattern 4000 'append2-' | request -X POST --data-binary @- "$URL/data/log.txt?append"
+
+kill "$SERVER"
+wait "$SERVER" 2>/dev/null || true
+SERVER=
+
+LOG_INODE=$(./ds3ls "$IMAGE" | awk '/^Directory \/data\/$/ { found = 1 } found && $2 == "log.txt" { print $1; exit }')
+./ds3ls "$IMAGE" > "$WORK/mutations-ds3ls.stdout"
+./ds3cat "$IMAGE" "$LOG_INODE" > "$WORK/mutations-ds3cat.stdout"
+./ds3bits "$IMAGE" > "$WORK/mutations-ds3bits.stdout"
+
+if [ "$1" = "-u" ]; then
+    cp "$IMAGE" "$WORK"/mutations-*.stdout "$HERE"
+    echo "mutations: updated"
+    exit 0
+fi
+
+failed=0
+for out in mutations-ds3ls.stdout mutations-ds3cat.stdout mutations-ds3bits.stdout; do
+    if ! cmp -s "$WORK/$out" "$HERE/$out"; then
+        echo "mutations: $out differs" >&2
+        diff "$HERE/$out" "$WORK/$out" | head -20 >&2
+        failed=1
+    fi
+done
+[ $failed -eq 0 ] && echo "mutations: ok"
+exit $failed
@@ -0,0 +1,499 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / (int) sizeof(dir_ent_t))
+#define TAR_BLOCK_SIZE (512)
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+// File data the reader thread may run ahead of the writer
+#define READ_AHEAD_BYTES (8 * 1024 * 1024)
+
+// POSIX ustar header, one 512 byte block in front of every entry
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char padding[12];
+};
+
+// An inode to export with its path inside the archive
+struct Entry {
+  int inodeNumber;
+  string path;
+};
+
+struct FileData {
+  int index;
+  vector<char> data;
+};
+
+// The reader thread fills this in block order while main writes it out
+struct ExportState {
+  Disk *disk;
+  vector<inode_t> *inodes;
+  vector<Entry> *files;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  deque<FileData> ready;
+  long long readyBytes;
+};
+
+void fail(string message) {
+  cerr << "ds3archive: " << message << endl;
+  exit(1);
+}
+
+int numBlocksFor(inode_t &inode) {
+  return min((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+}
+
+void writeOutput(const void *data, size_t length) {
+  if (length > 0 && fwrite(data, 1, length, stdout) != length) {
+    fail("could not write archive");
+  }
+}
+
+void writePadding(long long length) {
+  static const char zeros[TAR_BLOCK_SIZE] = {0};
+  int tail = length % TAR_BLOCK_SIZE;
+  if (tail != 0) {
+    writeOutput(zeros, TAR_BLOCK_SIZE - tail);
+  }
+}
+
+unsigned int headerChecksum(TarHeader &header) {
+  unsigned char *bytes = (unsigned char *) &header;
+  unsigned int sum = 0;
+  for (unsigned int i = 0; i < sizeof(header); i++) {
+    bool inChecksum = i >= offsetof(TarHeader, checksum) && i < offsetof(TarHeader, checksum) + sizeof(header.checksum);
+    sum += inChecksum ? ' ' : bytes[i];
+  }
+  return sum;
+}
+
+// Paths over 100 bytes are split at a slash into prefix and name
+bool writeHeader(string path, bool directory, int size) {
+  TarHeader header;
+  memset(&header, 0, sizeof(header));
+  string prefix;
+  string name = path;
+  if (name.size() > sizeof(header.name)) {
+    size_t split = path.rfind('/', path.size() - (directory ? 2 : 1));
+    while (split != string::npos && path.size() - split - 1 > sizeof(header.name)) {
+      split = split > 0 ? path.rfind('/', split - 1) : string::npos;
+    }
+    if (split == string::npos || split > sizeof(header.prefix)) {
+      return false;
+    }
+    prefix = path.substr(0, split);
+    name = path.substr(split + 1);
+  }
+  memcpy(header.name, name.data(), name.size());
+  memcpy(header.prefix, prefix.data(), prefix.size());
+  snprintf(header.mode, sizeof(header.mode), "%07o", directory ? 0755 : 0644);
+  snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+  snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+  snprintf(header.size, sizeof(header.size), "%011o", directory ? 0 : size);
+  snprintf(header.mtime, sizeof(header.mtime), "%011o", 0);
+  header.typeflag = directory ? '5' : '0';
+  memcpy(header.magic, "ustar", 6);
+  memcpy(header.version, "00", 2);
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", headerChecksum(header));
+  header.checksum[7] = ' ';
+  writeOutput(&header, sizeof(header));
+  return true;
+}
+
+// Paths for every reachable inode from one pass over the directory blocks,
+// read in disk order
+void collectEntries(LocalFileSystem &fs, super_t &super, vector<inode_t> &inodes,
+                    vector<Entry> &directories, vector<Entry> &files) {
+  vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+  fs.readInodeBitmap(&super, inodeBitmap.data());
+
+  vector<pair<unsigned int, pair<int, int> > > refs;
+  vector<vector<dir_ent_t> > entries(super.num_inodes);
+  for (int i = 0; i < super.num_inodes; i++) {
+    if ((inodeBitmap[i / 8] & (1 << (i % 8))) && inodes[i].type == UFS_DIRECTORY) {
+      entries[i].resize(numBlocksFor(inodes[i]) * DIR_ENTS_PER_BLOCK);
+      for (int b = 0; b < numBlocksFor(inodes[i]); b++) {
+        refs.push_back(make_pair(inodes[i].direct[b], make_pair(i, b)));
+      }
+    }
+  }
+  sort(refs.begin(), refs.end());
+  vector<char> run;
+  unsigned int start = 0;
+  while (start < refs.size()) {
+    unsigned int end = start + 1;
+    while (end < refs.size() && refs[end].first == refs[end - 1].first + 1) {
+      end++;
+    }
+    run.resize((end - start) * UFS_BLOCK_SIZE);
+    fs.disk->readBlocks(refs[start].first, end - start, run.data());
+    for (unsigned int r = start; r < end; r++) {
+      memcpy(&entries[refs[r].second.first][refs[r].second.second * DIR_ENTS_PER_BLOCK],
+             &run[(r - start) * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE);
+    }
+    start = end;
+  }
+
+  // Breadth first so every directory comes before what it holds
+  vector<bool> seen(super.num_inodes, false);
+  seen[UFS_ROOT_DIRECTORY_INODE_NUMBER] = true;
+  Entry root = {UFS_ROOT_DIRECTORY_INODE_NUMBER, ""};
+  directories.push_back(root);
+  for (unsigned int d = 0; d < directories.size(); d++) {
+    int dir = directories[d].inodeNumber;
+    int numSlots = min((int) entries[dir].size(), inodes[dir].size / (int) sizeof(dir_ent_t));
+    for (int s = 0; s < numSlots; s++) {
+      dir_ent_t &entry = entries[dir][s];
+      entry.name[DIR_ENT_NAME_SIZE - 1] = '\0';
+      if (entry.inum < 0 || entry.inum >= super.num_inodes || seen[entry.inum] ||
+          strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+        continue;
+      }
+      seen[entry.inum] = true;
+      Entry child = {entry.inum, directories[d].path + entry.name};
+      if (inodes[entry.inum].type == UFS_DIRECTORY) {
+        child.path += "/";
+        directories.push_back(child);
+      } else {
+        files.push_back(child);
+      }
+    }
+  }
+}
+
+bool compareFirstBlock(vector<inode_t> *inodes, const Entry &a, const Entry &b) {
+  return (*inodes)[a.inodeNumber].direct[0] < (*inodes)[b.inodeNumber].direct[0];
+}
+
+void *exportReader(void *arg) {
+  ExportState &state = *(ExportState *) arg;
+  for (unsigned int i = 0; i < state.files->size(); i++) {
+    inode_t &inode = (*state.inodes)[(*state.files)[i].inodeNumber];
+    FileData item;
+    item.index = i;
+    item.data.resize(numBlocksFor(inode) * UFS_BLOCK_SIZE);
+    int start = 0;
+    while (start < numBlocksFor(inode)) {
+      int end = start + 1;
+      while (end < numBlocksFor(inode) && inode.direct[end] == inode.direct[end - 1] + 1) {
+        end++;
+      }
+      state.disk->readBlocks(inode.direct[start], end - start, &item.data[start * UFS_BLOCK_SIZE]);
+      start = end;
+    }
+
+    pthread_mutex_lock(&state.lock);
+    while (state.readyBytes > READ_AHEAD_BYTES) {
+      pthread_cond_wait(&state.changed, &state.lock);
+    }
+    state.readyBytes += item.data.size();
+    state.ready.push_back(FileData());
+    state.ready.back().index = item.index;
+    state.ready.back().data.swap(item.data);
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.lock);
+  }
+  return NULL;
+}
+
+int exportImage(string diskimage) {
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem fs(&disk);
+  super_t super;
+  fs.readSuperBlock(&super);
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  fs.readInodeRegion(&super, inodes.data());
+  if (inodes[UFS_ROOT_DIRECTORY_INODE_NUMBER].type != UFS_DIRECTORY) {
+    fail("image has no root directory");
+  }
+
+  vector<Entry> directories;
+  vector<Entry> files;
+  collectEntries(fs, super, inodes, directories, files);
+  // Files go out in the order their data sits on disk
+  sort(files.begin(), files.end(), [&inodes](const Entry &a, const Entry &b) {
+    return compareFirstBlock(&inodes, a, b);
+  });
+
+  setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+  int skipped = 0;
+  for (unsigned int i = 1; i < directories.size(); i++) {
+    if (!writeHeader(directories[i].path, true, 0)) {
+      cerr << "ds3archive: path too long, skipping " << directories[i].path << endl;
+      skipped++;
+    }
+  }
+
+  ExportState state;
+  state.disk = &disk;
+  state.inodes = &inodes;
+  state.files = &files;
+  state.readyBytes = 0;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.changed, NULL);
+  pthread_t reader;
+  pthread_create(&reader, NULL, exportReader, &state);
+
+  long long bytes = 0;
+  for (unsigned int i = 0; i < files.size(); i++) {
+    FileData item;
+    pthread_mutex_lock(&state.lock);
+    while (state.ready.empty()) {
+      pthread_cond_wait(&state.changed, &state.lock);
+    }
+    item.index = state.ready.front().index;
+    item.data.swap(state.ready.front().data);
+    state.ready.pop_front();
+    state.readyBytes -= item.data.size();
+    pthread_cond_broadcast(&state.changed);
+    pthread_mutex_unlock(&state.lock);
+
+    int size = inodes[files[item.index].inodeNumber].size;
+    size = min(size, (int) item.data.size());
+    if (!writeHeader(files[item.index].path, false, size)) {
+      cerr << "ds3archive: path too long, skipping " << files[item.index].path << endl;
+      skipped++;
+      continue;
+    }
+    writeOutput(item.data.data(), size);
+    writePadding(size);
+    bytes += size;
+  }
+  pthread_join(reader, NULL);
+
+  static const char end[2 * TAR_BLOCK_SIZE] = {0};
+  writeOutput(end, sizeof(end));
+  if (fflush(stdout) != 0) {
+    fail("could not write archive");
+  }
+
+  cerr << "directories " << directories.size() - 1 << endl;
+  cerr << "files " << files.size() << endl;
+  cerr << "bytes " << bytes << endl;
+  return skipped > 0 ? 1 : 0;
+}
+
+bool readInput(void *data, size_t length) {
+  return fread(data, 1, length, stdin) == length;
+}
+
+// Reads past length bytes a block at a time, nothing is kept
+bool skipInput(long long length) {
+  char buffer[UFS_BLOCK_SIZE];
+  while (length > 0) {
+    size_t piece = min(length, (long long) sizeof(buffer));
+    if (!readInput(buffer, piece)) {
+      return false;
+    }
+    length -= piece;
+  }
+  return true;
+}
+
+long long parseOctal(const char *field, int length) {
+  long long value = 0;
+  for (int i = 0; i < length && field[i] != '\0' && field[i] != ' '; i++) {
+    if (field[i] < '0' || field[i] > '7') {
+      return -1;
+    }
+    value = value * 8 + (field[i] - '0');
+  }
+  return value;
+}
+
+string fieldString(const char *field, int length) {
+  return string(field, strnlen(field, length));
+}
+
+// Splits an archive path into its components, refusing anything that
+// would climb out of the root
+bool splitPath(string path, vector<string> &components) {
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == string::npos) {
+      end = path.size();
+    }
+    string component = path.substr(start, end - start);
+    if (component == "..") {
+      return false;
+    }
+    if (component != "" && component != ".") {
+      components.push_back(component);
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// Resolves and creates directories as needed, remembering what it made
+int makeDirectories(LocalFileSystem &fs, vector<string> &components, int count, map<string, int> &directoryCache) {
+  int inodeNumber = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  string path;
+  for (int i = 0; i < count; i++) {
+    path += "/" + components[i];
+    map<string, int>::iterator found = directoryCache.find(path);
+    if (found != directoryCache.end()) {
+      inodeNumber = found->second;
+      continue;
+    }
+    inodeNumber = fs.create(inodeNumber, UFS_DIRECTORY, components[i]);
+    if (inodeNumber < 0) {
+      return inodeNumber;
+    }
+    directoryCache[path] = inodeNumber;
+  }
+  return inodeNumber;
+}
+
+// Every entry is created inside its own Disk transaction so a failure
+// never leaves a half written file behind
+int importImage(string diskimage) {
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem fs(&disk);
+  setvbuf(stdin, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+
+  map<string, int> directoryCache;
+  vector<char> data;
+  int numDirectories = 0;
+  int numFiles = 0;
+  int errors = 0;
+  long long bytes = 0;
+  TarHeader header;
+  while (readInput(&header, sizeof(header))) {
+    if (header.name[0] == '\0') {
+      break; // End of archive
+    }
+    if (parseOctal(header.checksum, sizeof(header.checksum)) != headerChecksum(header)) {
+      fail("bad header checksum, archive is corrupt");
+    }
+    long long size = parseOctal(header.size, sizeof(header.size));
+    if (size < 0) {
+      fail("bad size field, archive is corrupt");
+    }
+    long long padding = size % TAR_BLOCK_SIZE == 0 ? 0 : TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE;
+    if (size > MAX_FILE_SIZE) {
+      // Too big to import, so it is never held in memory
+      data.clear();
+      if (!skipInput(size + padding)) {
+        fail("archive is truncated");
+      }
+    } else {
+      data.resize(size);
+      if (!readInput(data.data(), size) || !skipInput(padding)) {
+        fail("archive is truncated");
+      }
+    }
+
+    string path = fieldString(header.name, sizeof(header.name));
+    if (memcmp(header.magic, "ustar", 5) == 0 && header.prefix[0] != '\0') {
+      path = fieldString(header.prefix, sizeof(header.prefix)) + "/" + path;
+    }
+    vector<string> components;
+    if (!splitPath(path, components)) {
+      cerr << "ds3archive: skipping unsafe path " << path << endl;
+      errors++;
+      continue;
+    }
+    bool directory = header.typeflag == '5';
+    if (!directory && header.typeflag != '0' && header.typeflag != '\0') {
+      cerr << "ds3archive: skipping " << path << ", not a file or directory" << endl;
+      continue;
+    }
+    if (components.empty()) {
+      continue; // The root itself
+    }
+    if (!directory && size > MAX_FILE_SIZE) {
+      cerr << "ds3archive: skipping " << path << ", larger than MAX_FILE_SIZE" << endl;
+      errors++;
+      continue;
+    }
+
+    disk.beginTransaction();
+    int ret;
+    if (directory) {
+      ret = makeDirectories(fs, components, components.size(), directoryCache);
+    } else {
+      ret = makeDirectories(fs, components, components.size() - 1, directoryCache);
+      if (ret >= 0) {
+        ret = fs.create(ret, UFS_REGULAR_FILE, components.back());
+      }
+      if (ret >= 0) {
+        ret = fs.write(ret, data.data(), size);
+      }
+    }
+    if (ret < 0) {
+      disk.rollback();
+      // Directories made in this transaction are gone again
+      directoryCache.clear();
+      cerr << "ds3archive: could not import " << path << " (error " << ret << ")" << endl;
+      errors++;
+      continue;
+    }
+    disk.commit();
+    if (directory) {
+      numDirectories++;
+    } else {
+      numFiles++;
+      bytes += size;
+    }
+  }
+
+  cerr << "directories " << numDirectories << endl;
+  cerr << "files " << numFiles << endl;
+  cerr << "bytes " << bytes << endl;
+  return errors > 0 ? 1 : 0;
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " export diskImageFile > archive.tar" << endl;
+  cerr << "       " << prog << " import diskImageFile < archive.tar" << endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    usage(argv[0]);
+  }
+  string command = argv[1];
+  if (command == "export") {
+    return exportImage(argv[2]);
+  } else if (command == "import") {
+    return importImage(argv[2]);
+  }
+  usage(argv[0]);
+  return 1;
+}
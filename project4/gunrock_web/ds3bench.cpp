@@ -0,0 +1,281 @@
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Everything the bench creates lives under this directory in the root
+#define BENCH_DIRECTORY "ds3bench"
+#define WIDE_ENTRIES (256)
+#define DEEP_LEVELS (16)
+#define SMALL_FILES (16)
+#define SMALL_WRITE_SIZE (512)
+
+struct Result {
+  string workload;
+  int ops;
+  double seconds;
+  vector<long long> latencies;
+  long long blocksRead;
+  long long blocksWritten;
+};
+
+struct Bench {
+  LocalFileSystem *fs;
+  int root;
+  vector<int> wideInodes;
+  vector<int> smallInodes;
+  int largeInode;
+  int logInode;
+  vector<string> deepPath;
+};
+
+void fail(string message) {
+  cerr << "ds3bench: " << message << endl;
+  exit(1);
+}
+
+int check(int ret, string what) {
+  if (ret < 0) {
+    stringstream message;
+    message << what << " failed with " << ret;
+    fail(message.str());
+  }
+  return ret;
+}
+
+string entryName(string prefix, int i) {
+  char name[DIR_ENT_NAME_SIZE];
+  snprintf(name, sizeof(name), "%s%d", prefix.c_str(), i);
+  return name;
+}
+
+long long nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Removes a file or a whole directory tree from its parent
+void removeTree(LocalFileSystem &fs, int parentInodeNumber, string name) {
+  int inodeNumber = fs.lookup(parentInodeNumber, name);
+  if (inodeNumber < 0) {
+    return;
+  }
+  inode_t inode;
+  vector<dir_ent_t> entries;
+  if (fs.readDirectory(inodeNumber, &inode, entries) == 0) {
+    for (unsigned int i = 0; i < entries.size(); i++) {
+      if (entries[i].inum != -1 && strcmp(entries[i].name, ".") != 0 && strcmp(entries[i].name, "..") != 0) {
+        removeTree(fs, inodeNumber, entries[i].name);
+      }
+    }
+  }
+  check(fs.unlink(parentInodeNumber, name), "unlink " + name);
+}
+
+void setup(Bench &bench) {
+  LocalFileSystem &fs = *bench.fs;
+  removeTree(fs, UFS_ROOT_DIRECTORY_INODE_NUMBER, BENCH_DIRECTORY);
+  bench.root = check(fs.create(UFS_ROOT_DIRECTORY_INODE_NUMBER, UFS_DIRECTORY, BENCH_DIRECTORY), "create " BENCH_DIRECTORY);
+
+  int wide = check(fs.create(bench.root, UFS_DIRECTORY, "wide"), "create wide");
+  for (int i = 0; i < WIDE_ENTRIES; i++) {
+    bench.wideInodes.push_back(check(fs.create(wide, UFS_REGULAR_FILE, entryName("f", i)), "create wide entry"));
+  }
+
+  int parent = bench.root;
+  bench.deepPath.push_back("deep");
+  for (int i = 0; i < DEEP_LEVELS; i++) {
+    parent = check(fs.create(parent, UFS_DIRECTORY, bench.deepPath.back()), "create deep level");
+    bench.deepPath.push_back(entryName("d", i));
+  }
+  bench.deepPath.pop_back();
+
+  int data = check(fs.create(bench.root, UFS_DIRECTORY, "data"), "create data");
+  for (int i = 0; i < SMALL_FILES; i++) {
+    bench.smallInodes.push_back(check(fs.create(data, UFS_REGULAR_FILE, entryName("small", i)), "create small"));
+  }
+  bench.largeInode = check(fs.create(data, UFS_REGULAR_FILE, "large"), "create large");
+  bench.logInode = check(fs.create(data, UFS_REGULAR_FILE, "log"), "create log");
+  check(fs.create(bench.root, UFS_DIRECTORY, "churn"), "create churn");
+}
+
+// One operation of the named workload, the op index keeps runs repeatable
+void runOp(Bench &bench, string workload, int op, vector<char> &buffer) {
+  LocalFileSystem &fs = *bench.fs;
+  if (workload == "lookup") {
+    int wide = fs.lookup(bench.root, "wide");
+    check(fs.lookup(wide, entryName("f", (op * 7919) % WIDE_ENTRIES)), "lookup");
+  } else if (workload == "stat") {
+    inode_t inode;
+    check(fs.stat(bench.wideInodes[(op * 7919) % WIDE_ENTRIES], &inode), "stat");
+  } else if (workload == "churn") {
+    int churn = fs.lookup(bench.root, "churn");
+    string name = entryName("c", op);
+    check(fs.create(churn, UFS_REGULAR_FILE, name), "create");
+    check(fs.unlink(churn, name), "unlink");
+  } else if (workload == "small") {
+    int inodeNumber = bench.smallInodes[op % SMALL_FILES];
+    memset(buffer.data(), op & 0xff, SMALL_WRITE_SIZE);
+    check(fs.write(inodeNumber, buffer.data(), SMALL_WRITE_SIZE), "write");
+    check(fs.read(inodeNumber, buffer.data(), SMALL_WRITE_SIZE), "read");
+  } else if (workload == "large") {
+    memset(buffer.data(), op & 0xff, MAX_FILE_SIZE);
+    check(fs.write(bench.largeInode, buffer.data(), MAX_FILE_SIZE), "write");
+    check(fs.read(bench.largeInode, buffer.data(), MAX_FILE_SIZE), "read");
+  } else if (workload == "append") {
+    // Records go on the end of a log that starts over when it is full
+    inode_t inode;
+    check(fs.stat(bench.logInode, &inode), "stat");
+    if (inode.size + SMALL_WRITE_SIZE > MAX_FILE_SIZE) {
+      check(fs.write(bench.logInode, buffer.data(), 0), "write");
+    }
+    memset(buffer.data(), op & 0xff, SMALL_WRITE_SIZE);
+    check(fs.append(bench.logInode, buffer.data(), SMALL_WRITE_SIZE), "append");
+  } else if (workload == "deep") {
+    int inodeNumber = bench.root;
+    for (unsigned int i = 0; i < bench.deepPath.size(); i++) {
+      inodeNumber = check(fs.lookup(inodeNumber, bench.deepPath[i]), "lookup");
+    }
+  } else {
+    fail("unknown workload " + workload);
+  }
+}
+
+Result runWorkload(Bench &bench, string workload, int ops) {
+  Result result;
+  result.workload = workload;
+  result.ops = ops;
+  result.latencies.resize(ops);
+  vector<char> buffer(MAX_FILE_SIZE);
+
+  Disk *disk = bench.fs->disk;
+  disk->resetCounters();
+  long long start = nowNanos();
+  for (int op = 0; op < ops; op++) {
+    long long opStart = nowNanos();
+    runOp(bench, workload, op, buffer);
+    result.latencies[op] = nowNanos() - opStart;
+  }
+  result.seconds = (nowNanos() - start) / 1e9;
+  result.blocksRead = disk->blocksRead();
+  result.blocksWritten = disk->blocksWritten();
+  sort(result.latencies.begin(), result.latencies.end());
+  return result;
+}
+
+double percentileMicros(Result &result, int percentile) {
+  if (result.latencies.empty()) {
+    return 0;
+  }
+  int index = min((int) result.latencies.size() - 1, (int) (result.latencies.size() * percentile / 100));
+  return result.latencies[index] / 1000.0;
+}
+
+void printResults(vector<Result> &results, bool machineReadable) {
+  char line[256];
+  if (machineReadable) {
+    cout << "workload,ops,seconds,ops_per_sec,p50_us,p95_us,p99_us,blocks_read_per_op,blocks_written_per_op" << endl;
+  } else {
+    snprintf(line, sizeof(line), "%-8s %8s %10s %10s %10s %10s %10s %10s",
+             "workload", "ops", "ops/s", "p50_us", "p95_us", "p99_us", "reads/op", "writes/op");
+    cout << line << endl;
+  }
+  for (unsigned int i = 0; i < results.size(); i++) {
+    Result &r = results[i];
+    double opsPerSecond = r.seconds > 0 ? r.ops / r.seconds : 0;
+    double readsPerOp = r.ops > 0 ? (double) r.blocksRead / r.ops : 0;
+    double writesPerOp = r.ops > 0 ? (double) r.blocksWritten / r.ops : 0;
+    if (machineReadable) {
+      snprintf(line, sizeof(line), "%s,%d,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f",
+               r.workload.c_str(), r.ops, r.seconds, opsPerSecond, percentileMicros(r, 50),
+               percentileMicros(r, 95), percentileMicros(r, 99), readsPerOp, writesPerOp);
+    } else {
+      snprintf(line, sizeof(line), "%-8s %8d %10.1f %10.2f %10.2f %10.2f %10.2f %10.2f",
+               r.workload.c_str(), r.ops, opsPerSecond, percentileMicros(r, 50),
+               percentileMicros(r, 95), percentileMicros(r, 99), readsPerOp, writesPerOp);
+    }
+    cout << line << endl;
+  }
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-w workload,...] [-n ops] [-m] [-k] diskImageFile" << endl;
+  cerr << "  workloads: lookup stat churn small large append deep (default: all)" << endl;
+  cerr << "  -m  comma separated output" << endl;
+  cerr << "  -k  keep the /" BENCH_DIRECTORY " tree instead of removing it" << endl;
+  cerr << "  the image is modified, run it against a scratch copy" << endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  string workloadList = "lookup,stat,churn,small,large,append,deep";
+  int ops = 1000;
+  bool machineReadable = false;
+  bool keep = false;
+  int option;
+  while ((option = getopt(argc, argv, "w:n:mk")) != -1) {
+    switch (option) {
+    case 'w':
+      workloadList = optarg;
+      break;
+    case 'n':
+      ops = atoi(optarg);
+      break;
+    case 'm':
+      machineReadable = true;
+      break;
+    case 'k':
+      keep = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || ops <= 0) {
+    usage(argv[0]);
+  }
+
+  vector<string> workloads;
+  stringstream list(workloadList);
+  string workload;
+  while (getline(list, workload, ',')) {
+    if (workload != "lookup" && workload != "stat" && workload != "churn" &&
+        workload != "small" && workload != "large" && workload != "append" && workload != "deep") {
+      fail("unknown workload " + workload);
+    }
+    workloads.push_back(workload);
+  }
+
+  string diskimage = argv[optind];
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem filesystem(&disk);
+
+  Bench bench;
+  bench.fs = &filesystem;
+  setup(bench);
+
+  vector<Result> results;
+  for (unsigned int i = 0; i < workloads.size(); i++) {
+    results.push_back(runWorkload(bench, workloads[i], ops));
+  }
+  printResults(results, machineReadable);
+
+  if (!keep) {
+    removeTree(filesystem, UFS_ROOT_DIRECTORY_INODE_NUMBER, BENCH_DIRECTORY);
+  }
+
+  return 0;
+}
@@ -2,6 +2,10 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -9,63 +13,165 @@
 
 using namespace std;
 
-void printBitmaps(LocalFileSystem &fs, Disk &disk){
+#define OUTPUT_FLUSH_SIZE (4 * 1024 * 1024)
+#define HISTOGRAM_BUCKETS (32)
 
-  super_t super;
-  fs.readSuperBlock(&super);
+// "0 " through "255 ", built once so each byte is a table lookup
+struct ByteText {
+  char text[5];
+  int length;
+};
+ByteText byteTable[256];
 
-  cout<<"Super"<<endl;
-  cout<<"inode_region_addr "<<super.inode_region_addr<<endl;
-  cout<<"data_region_addr "<<super.data_region_addr<<endl;
-  cout<<endl;
+void buildByteTable() {
+  for (int i = 0; i < 256; i++) {
+    byteTable[i].length = snprintf(byteTable[i].text, sizeof(byteTable[i].text), "%d ", i);
+  }
+}
 
-  cout<<"Inode bitmap"<<endl;
-  unsigned char inodebuffer[super.inode_bitmap_len * UFS_BLOCK_SIZE]; //len is in blocks
+void writeAll(string &out) {
+  size_t offset = 0;
+  while (offset < out.size()) {
+    ssize_t ret = write(STDOUT_FILENO, out.data() + offset, out.size() - offset);
+    if (ret <= 0) {
+      perror("write");
+      exit(1);
+    }
+    offset += ret;
+  }
+  out.clear();
+}
 
-  //read
-  for (int i=0; i<super.inode_bitmap_len;i++){
-    disk.readBlock(super.inode_bitmap_addr + i, &inodebuffer[i * UFS_BLOCK_SIZE]);
+void appendBytes(string &out, unsigned char *bitmap, int length) {
+  for (int i = 0; i < length; i++) {
+    out.append(byteTable[bitmap[i]].text, byteTable[bitmap[i]].length);
+    if (out.size() >= OUTPUT_FLUSH_SIZE) {
+      writeAll(out);
+    }
   }
+  out += '\n';
+}
 
-  //then print
-  for (int i=0; i<super.inode_bitmap_len * UFS_BLOCK_SIZE;i++){
-    cout << (unsigned int)inodebuffer[i] << " ";
+// The bitmap as 64-bit words, bits past numBits are treated as allocated
+// so they never show up as free
+vector<uint64_t> loadWords(unsigned char *bitmap, int numBits) {
+  vector<uint64_t> words((numBits + 63) / 64, 0);
+  memcpy(words.data(), bitmap, (numBits + 7) / 8);
+  if (numBits % 64 != 0) {
+    words.back() |= ~0ULL << (numBits % 64);
   }
-  cout << endl;
-  cout << endl; // Have a blank line as a break
+  return words;
+}
 
+// Index of the first bit at or after pos that equals value, or numBits
+int findNext(vector<uint64_t> &words, int numBits, int pos, bool value) {
+  while (pos < numBits) {
+    uint64_t word = value ? words[pos / 64] : ~words[pos / 64];
+    word &= ~0ULL << (pos % 64);
+    if (word != 0) {
+      return min(numBits, (pos / 64) * 64 + __builtin_ctzll(word));
+    }
+    pos = (pos / 64 + 1) * 64;
+  }
+  return numBits;
+}
 
-  //data bitmap!
+void appendSummary(string &out, unsigned char *bitmap, int numBits) {
+  vector<uint64_t> words = loadWords(bitmap, numBits);
 
-  cout << "Data bitmap" << endl;
+  long long allocated = 0;
+  for (unsigned int i = 0; i < words.size(); i++) {
+    allocated += __builtin_popcountll(words[i]);
+  }
+  allocated -= (long long) words.size() * 64 - numBits;
+
+  // Free runs bucketed by powers of two: 1, 2-3, 4-7, ...
+  long long histogram[HISTOGRAM_BUCKETS] = {0};
+  int largestRun = 0;
+  int freeRuns = 0;
+  int pos = findNext(words, numBits, 0, false);
+  while (pos < numBits) {
+    int end = findNext(words, numBits, pos, true);
+    int run = end - pos;
+    largestRun = max(largestRun, run);
+    freeRuns++;
+    histogram[63 - __builtin_clzll(run)]++;
+    pos = findNext(words, numBits, end, false);
+  }
 
-  //need a buffer for data bitmap
-  unsigned char buffer[super.data_bitmap_len * UFS_BLOCK_SIZE];
-  // read the data_bitmap into a buffer
-  for (int i = 0; i < super.data_bitmap_len; i++){
-    disk.readBlock(super.data_bitmap_addr + i, &buffer[i * UFS_BLOCK_SIZE]);
+  char line[128];
+  snprintf(line, sizeof(line), "allocated %lld\nfree %lld\nlargest_free_run %d\nfree_runs %d\n",
+           allocated, numBits - allocated, largestRun, freeRuns);
+  out += line;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    if (histogram[i] > 0) {
+      snprintf(line, sizeof(line), "free_run_length %lld-%lld %lld\n", 1LL << i, (2LL << i) - 1, histogram[i]);
+      out += line;
+    }
   }
+}
+
+void printBitmaps(LocalFileSystem &fs, Disk &disk, bool summary){
+
+  super_t super;
+  fs.readSuperBlock(&super);
 
-  //print the data bitmap
-  for (int i = 0; i < super.data_bitmap_len * UFS_BLOCK_SIZE; i++){
-    cout << (unsigned int)buffer[i] << " ";
+  string out;
+  char line[64];
+  snprintf(line, sizeof(line), "Super\ninode_region_addr %d\ndata_region_addr %d\n\n",
+           super.inode_region_addr, super.data_region_addr);
+  out += line;
+
+  vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+  vector<unsigned char> dataBitmap(super.data_bitmap_len * UFS_BLOCK_SIZE);
+  fs.readInodeBitmap(&super, inodeBitmap.data());
+  fs.readDataBitmap(&super, dataBitmap.data());
+
+  out += "Inode bitmap\n";
+  if (summary) {
+    appendSummary(out, inodeBitmap.data(), super.num_inodes);
+  } else {
+    appendBytes(out, inodeBitmap.data(), inodeBitmap.size());
   }
-  cout << endl;
+  out += '\n'; // Have a blank line as a break
 
+  out += "Data bitmap\n";
+  if (summary) {
+    appendSummary(out, dataBitmap.data(), super.num_data);
+  } else {
+    appendBytes(out, dataBitmap.data(), dataBitmap.size());
+  }
+  writeAll(out);
 }
 
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-s] diskImageFile" << endl;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    cout << argv[0] << ": diskImageFile" << endl;
+  bool summary = false;
+  int option;
+  while ((option = getopt(argc, argv, "s")) != -1) {
+    switch (option) {
+    case 's':
+      summary = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
     return 1;
   }
 
-  string diskimage = argv[1];
-  Disk disk(diskimage, 4096); //disk instance. 
+  string diskimage = argv[optind];
+  Disk disk(diskimage, 4096); //disk instance.
   LocalFileSystem filesystem(&disk); //filesystem instance.
 
-  printBitmaps(filesystem, disk);
+  buildByteTable();
+  printBitmaps(filesystem, disk, summary);
 
   return 0;
 }
@@ -0,0 +1,331 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "ufs.h"
+#include "ufs_size.h"
+
+using namespace std;
+
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / (int) sizeof(dir_ent_t))
+
+// One file or directory from the host tree, its index is its inode number
+struct Node {
+  string hostPath;
+  string name;
+  int type;
+  int parent;
+  int size;
+  int firstBlock;
+  vector<int> children;
+};
+
+// Collects output and hands it to the kernel in large sequential writes
+class ImageWriter {
+ public:
+  ImageWriter(int fd) : fd(fd), used(0) { buffer.resize(OUTPUT_BUFFER_SIZE); }
+
+  void append(const void *data, int length) {
+    const char *in = (const char *) data;
+    while (length > 0) {
+      int n = min(length, (int) buffer.size() - used);
+      memcpy(&buffer[used], in, n);
+      used += n;
+      in += n;
+      length -= n;
+      if (used == (int) buffer.size()) {
+        flush();
+      }
+    }
+  }
+
+  // Pads with zeros up to the next block boundary
+  void endBlock(long long bytesWritten) {
+    static const char zeros[UFS_BLOCK_SIZE] = {0};
+    int tail = bytesWritten % UFS_BLOCK_SIZE;
+    if (tail != 0) {
+      append(zeros, UFS_BLOCK_SIZE - tail);
+    }
+  }
+
+  void flush() {
+    int offset = 0;
+    while (offset < used) {
+      int ret = write(fd, &buffer[offset], used - offset);
+      if (ret <= 0) {
+        perror("write");
+        exit(1);
+      }
+      offset += ret;
+    }
+    used = 0;
+  }
+
+ private:
+  int fd;
+  int used;
+  vector<char> buffer;
+};
+
+void fail(string message) {
+  cerr << "ds3build: " << message << endl;
+  exit(1);
+}
+
+// Takes the same K, M, G and T suffixes as mkfs
+long long parseCount(const char *arg) {
+  long long value = ufs_parse_size(arg);
+  if (value < 0) {
+    fail(string("invalid number ") + arg);
+  }
+  return value;
+}
+
+int blocksFor(long long bytes) {
+  return (bytes + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+}
+
+bool compareNames(const pair<string, struct stat> &a, const pair<string, struct stat> &b) {
+  return strcmp(a.first.c_str(), b.first.c_str()) < 0;
+}
+
+// Breadth first walk of the host tree, children sorted by name so the same
+// tree always produces the same image
+void scanTree(string hostRoot, vector<Node> &nodes) {
+  Node root;
+  root.hostPath = hostRoot;
+  root.name = "";
+  root.type = UFS_DIRECTORY;
+  root.parent = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  nodes.push_back(root);
+
+  for (unsigned int index = 0; index < nodes.size(); index++) {
+    if (nodes[index].type != UFS_DIRECTORY) {
+      continue;
+    }
+    DIR *dir = opendir(nodes[index].hostPath.c_str());
+    if (dir == NULL) {
+      fail("could not open directory " + nodes[index].hostPath);
+    }
+
+    vector<pair<string, struct stat> > found;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      string hostPath = nodes[index].hostPath + "/" + entry->d_name;
+      struct stat st;
+      if (lstat(hostPath.c_str(), &st) != 0) {
+        fail("could not stat " + hostPath);
+      }
+      if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+        cerr << "ds3build: skipping " << hostPath << ", not a file or directory" << endl;
+        continue;
+      }
+      if (strlen(entry->d_name) >= DIR_ENT_NAME_SIZE) {
+        fail("name too long: " + hostPath);
+      }
+      if (S_ISREG(st.st_mode) && st.st_size > MAX_FILE_SIZE) {
+        fail("file larger than MAX_FILE_SIZE: " + hostPath);
+      }
+      found.push_back(make_pair(string(entry->d_name), st));
+    }
+    closedir(dir);
+    sort(found.begin(), found.end(), compareNames);
+
+    if ((int) found.size() + 2 > DIRECT_PTRS * DIR_ENTS_PER_BLOCK) {
+      fail("too many entries in " + nodes[index].hostPath);
+    }
+    nodes[index].size = (found.size() + 2) * sizeof(dir_ent_t);
+
+    for (unsigned int i = 0; i < found.size(); i++) {
+      Node child;
+      child.hostPath = nodes[index].hostPath + "/" + found[i].first;
+      child.name = found[i].first;
+      child.type = S_ISDIR(found[i].second.st_mode) ? UFS_DIRECTORY : UFS_REGULAR_FILE;
+      child.parent = index;
+      child.size = S_ISREG(found[i].second.st_mode) ? found[i].second.st_size : 0;
+      nodes[index].children.push_back(nodes.size());
+      nodes.push_back(child);
+    }
+  }
+}
+
+void writeBitmap(ImageWriter &out, int numSet, int lengthInBlocks) {
+  vector<unsigned char> bitmap(lengthInBlocks * UFS_BLOCK_SIZE, 0);
+  for (int i = 0; i < numSet; i++) {
+    bitmap[i / 8] |= (1 << (i % 8));
+  }
+  out.append(bitmap.data(), bitmap.size());
+}
+
+void writeFileData(ImageWriter &out, Node &node) {
+  int fd = open(node.hostPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fail("could not open " + node.hostPath);
+  }
+  char buffer[UFS_BLOCK_SIZE * 8];
+  int total = 0;
+  while (total < node.size) {
+    int ret = read(fd, buffer, min((int) sizeof(buffer), node.size - total));
+    if (ret <= 0) {
+      // The file shrank since the scan, the image keeps the scanned size
+      cerr << "ds3build: short read on " << node.hostPath << endl;
+      memset(buffer, 0, sizeof(buffer));
+      ret = min((int) sizeof(buffer), node.size - total);
+    }
+    out.append(buffer, ret);
+    total += ret;
+  }
+  close(fd);
+  out.endBlock(total);
+}
+
+void writeDirectoryData(ImageWriter &out, vector<Node> &nodes, int index) {
+  Node &node = nodes[index];
+  vector<dir_ent_t> entries(blocksFor(node.size) * DIR_ENTS_PER_BLOCK);
+  memset(entries.data(), 0, entries.size() * sizeof(dir_ent_t));
+  for (unsigned int i = 0; i < entries.size(); i++) {
+    entries[i].inum = -1;
+  }
+  strcpy(entries[0].name, ".");
+  entries[0].inum = index;
+  strcpy(entries[1].name, "..");
+  entries[1].inum = node.parent;
+  for (unsigned int i = 0; i < node.children.size(); i++) {
+    strcpy(entries[i + 2].name, nodes[node.children[i]].name.c_str());
+    entries[i + 2].inum = node.children[i];
+  }
+  out.append(entries.data(), entries.size() * sizeof(dir_ent_t));
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " -f <image_file> [-i <num_inodes>] [-d <num_data_blocks>] hostDirectory" << endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  char *imageFile = NULL;
+  long long numInodes = 0;
+  long long numData = 0;
+  int option;
+  while ((option = getopt(argc, argv, "f:i:d:")) != -1) {
+    switch (option) {
+    case 'f':
+      imageFile = optarg;
+      break;
+    case 'i':
+      numInodes = parseCount(optarg);
+      break;
+    case 'd':
+      numData = parseCount(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (imageFile == NULL || optind != argc - 1) {
+    usage(argv[0]);
+  }
+
+  vector<Node> nodes;
+  scanTree(argv[optind], nodes);
+
+  // Data goes out in inode order, each file in one contiguous run
+  int dataBlocksUsed = 0;
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    nodes[i].firstBlock = dataBlocksUsed;
+    dataBlocksUsed += blocksFor(nodes[i].size);
+  }
+
+  // Without explicit sizes the image is just big enough, with mkfs's minimum
+  if (numInodes == 0) {
+    numInodes = max((long long) nodes.size(), 32LL);
+  }
+  if (numData == 0) {
+    numData = max((long long) dataBlocksUsed, 32LL);
+  }
+  if (numInodes < (long long) nodes.size()) {
+    fail("not enough inodes for the tree");
+  }
+  if (numData < dataBlocksUsed) {
+    fail("not enough data blocks for the tree");
+  }
+  if (numInodes > INT_MAX || numData > INT_MAX) {
+    fail("inode and data block counts have to fit in an int");
+  }
+
+  int bitsPerBlock = 8 * UFS_BLOCK_SIZE;
+  super_t super;
+  memset(&super, 0, sizeof(super));
+  super.num_inodes = numInodes;
+  super.num_data = numData;
+  super.inode_bitmap_addr = 1;
+  super.inode_bitmap_len = (numInodes + bitsPerBlock - 1) / bitsPerBlock;
+  super.data_bitmap_addr = super.inode_bitmap_addr + super.inode_bitmap_len;
+  super.data_bitmap_len = (numData + bitsPerBlock - 1) / bitsPerBlock;
+  super.inode_region_addr = super.data_bitmap_addr + super.data_bitmap_len;
+  super.inode_region_len = blocksFor(numInodes * sizeof(inode_t));
+  super.data_region_addr = super.inode_region_addr + super.inode_region_len;
+  super.data_region_len = numData;
+  long long totalBlocks = (long long) super.data_region_addr + super.data_region_len;
+  if (totalBlocks > INT_MAX) {
+    fail("image would have more than INT_MAX blocks");
+  }
+
+  int fd = open(imageFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    perror("open");
+    exit(1);
+  }
+  // The unused tail of the data region stays sparse
+  if (ftruncate(fd, totalBlocks * UFS_BLOCK_SIZE) != 0) {
+    perror("ftruncate");
+    exit(1);
+  }
+
+  ImageWriter out(fd);
+  out.append(&super, sizeof(super));
+  out.endBlock(sizeof(super));
+  writeBitmap(out, nodes.size(), super.inode_bitmap_len);
+  writeBitmap(out, dataBlocksUsed, super.data_bitmap_len);
+
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  memset(inodes.data(), 0, inodes.size() * sizeof(inode_t));
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    inodes[i].type = nodes[i].type;
+    inodes[i].size = nodes[i].size;
+    for (int b = 0; b < blocksFor(nodes[i].size); b++) {
+      inodes[i].direct[b] = super.data_region_addr + nodes[i].firstBlock + b;
+    }
+  }
+  out.append(inodes.data(), inodes.size() * sizeof(inode_t));
+
+  for (unsigned int i = 0; i < nodes.size(); i++) {
+    if (nodes[i].type == UFS_DIRECTORY) {
+      writeDirectoryData(out, nodes, i);
+    } else {
+      writeFileData(out, nodes[i]);
+    }
+  }
+  out.flush();
+  fsync(fd);
+  close(fd);
+
+  cout << "total blocks        " << totalBlocks << endl;
+  cout << "  inodes            " << super.num_inodes << " [used: " << nodes.size() << "]" << endl;
+  cout << "  data blocks       " << super.num_data << " [used: " << dataBlocksUsed << "]" << endl;
+
+  return 0;
+}
@@ -2,7 +2,11 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
-#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
@@ -10,44 +14,129 @@
 
 using namespace std;
 
-void ds3cat(LocalFileSystem &fs, int inodeNumber) {
+// Blocks read per trip to the disk and per write to stdout
+#define STREAM_BLOCKS (256)
+
+// Writes every iovec in full, retrying short writes
+void writeFully(struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t ret = writev(STDOUT_FILENO, iov, iovcnt);
+    if (ret < 0) {
+      perror("writev");
+      exit(1);
+    }
+    while (iovcnt > 0 && (size_t) ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+}
+
+void ds3cat(LocalFileSystem &fs, int inodeNumber, long long offset, long long length, bool raw) {
   inode_t myInode;
   if (fs.stat(inodeNumber, &myInode) != 0) { //Invalid
-    //cerr << "ERROR IN DS3CAT INODE: " << inodeNumber << endl;
     return;
   }
 
-  // Print file blocks
-  cout << "File blocks" << endl;
-  int numBlocks = static_cast<int>(std::ceil(static_cast<double>(myInode.size) / UFS_BLOCK_SIZE)); // Calculate num of blocks using ceiling 
-    for (int i = 0; i < numBlocks && i < DIRECT_PTRS; ++i) {
+  int numBlocks = min((myInode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+
+  // The header goes out with the first chunk of data in one writev
+  string header;
+  if (!raw) {
+    header = "File blocks\n";
+    char number[16];
+    for (int i = 0; i < numBlocks; ++i) {
       if (myInode.direct[i] != 0) {
-        cout << myInode.direct[i] << endl;
+        snprintf(number, sizeof(number), "%u\n", myInode.direct[i]);
+        header += number;
       }
     }
-  cout << endl;
+    header += "\nFile data\n";
+  }
 
-  // Print file data
-  cout << "File data" << endl;
-  int fileSize = myInode.size;
-  char buffer [MAX_FILE_SIZE];
-  fs.read(inodeNumber, &buffer, fileSize);
-  cout << buffer;
+  long long start = min(offset, (long long) myInode.size);
+  long long end = length < 0 ? myInode.size : min((long long) myInode.size, start + length);
 
+  vector<char> buffer(STREAM_BLOCKS * UFS_BLOCK_SIZE);
+  struct iovec iov[2];
+  int block = start / UFS_BLOCK_SIZE;
+  long long position = start;
+  do {
+    // Gather a run of blocks that are contiguous on disk straight into the output buffer
+    int runLength = 0;
+    long long runBytes = 0;
+    if (position < end) {
+      runLength = 1;
+      while (runLength < STREAM_BLOCKS && block + runLength < numBlocks &&
+             (long long) (block + runLength) * UFS_BLOCK_SIZE < end &&
+             myInode.direct[block + runLength] == myInode.direct[block + runLength - 1] + 1) {
+        runLength++;
+      }
+      fs.disk->readBlocks(myInode.direct[block], runLength, buffer.data());
+      runBytes = min((long long) (block + runLength) * UFS_BLOCK_SIZE, end) - position;
+    }
+
+    int iovcnt = 0;
+    if (header.size() > 0) {
+      iov[iovcnt].iov_base = (void *) header.data();
+      iov[iovcnt].iov_len = header.size();
+      iovcnt++;
+    }
+    if (runBytes > 0) {
+      iov[iovcnt].iov_base = buffer.data() + (position - (long long) block * UFS_BLOCK_SIZE);
+      iov[iovcnt].iov_len = runBytes;
+      iovcnt++;
+    }
+    writeFully(iov, iovcnt);
+    header.clear();
+
+    block += runLength;
+    position += runBytes;
+  } while (position < end);
 }
 
 
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-r] [-o offset] [-n length] diskImageFile inodeNumber" << endl;
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    cout << argv[0] << ": diskImageFile inodeNumber" << endl;
+  long long offset = 0;
+  long long length = -1;
+  bool raw = false;
+  int option;
+  while ((option = getopt(argc, argv, "o:n:r")) != -1) {
+    switch (option) {
+    case 'o':
+      offset = atoll(optarg);
+      break;
+    case 'n':
+      length = atoll(optarg);
+      break;
+    case 'r':
+      raw = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || offset < 0) {
+    usage(argv[0]);
     return 1;
   }
 
-  string diskimage = argv[1];
-  int inodeNumber = atoi(argv[2]);
-  Disk disk(diskimage, 4096); //disk instance. 
+  string diskimage = argv[optind];
+  int inodeNumber = atoi(argv[optind + 1]);
+  Disk disk(diskimage, 4096); //disk instance.
   LocalFileSystem filesystem(&disk); //filesystem instance.
 
-  ds3cat(filesystem, inodeNumber);
+  ds3cat(filesystem, inodeNumber, offset, length, raw);
 
+  return 0;
 }
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <set>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+struct PendingDirectory {
+  int inodeNumber;
+  string path;
+};
+
+void compactImage(LocalFileSystem &fs) {
+  int scanned = 0;
+  int blocksFreed = 0;
+
+  deque<PendingDirectory> work;
+  set<int> seen;
+  PendingDirectory root = {UFS_ROOT_DIRECTORY_INODE_NUMBER, "/"};
+  work.push_back(root);
+  seen.insert(root.inodeNumber);
+
+  while (!work.empty()) {
+    PendingDirectory dir = work.front();
+    work.pop_front();
+
+    // Compact first so the child scan below only sees live entries
+    int freed = fs.compactDirectory(dir.inodeNumber);
+    if (freed < 0) {
+      continue;
+    }
+    scanned++;
+
+    inode_t inode;
+    vector<dir_ent_t> entries;
+    fs.readDirectory(dir.inodeNumber, &inode, entries);
+    if (freed > 0) {
+      blocksFreed += freed;
+      cout << "Directory " << dir.path << " freed " << freed << " blocks" << endl;
+    }
+
+    for (unsigned int i = 0; i < entries.size(); i++) {
+      if (entries[i].inum == -1 || strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+        continue;
+      }
+      inode_t child;
+      if (fs.stat(entries[i].inum, &child) != 0 || child.type != UFS_DIRECTORY) {
+        continue;
+      }
+      if (seen.insert(entries[i].inum).second) {
+        PendingDirectory next = {entries[i].inum, dir.path + entries[i].name + "/"};
+        work.push_back(next);
+      }
+    }
+  }
+
+  cout << "Directories scanned " << scanned << endl;
+  cout << "Blocks freed " << blocksFreed << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    cout << argv[0] << ": diskImageFile" << endl;
+    return 1;
+  }
+
+  string diskimage = argv[1];
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem filesystem(&disk);
+
+  compactImage(filesystem);
+
+  return 0;
+}
@@ -0,0 +1,196 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+struct FragmentationStats {
+  int files;
+  int fragmentedFiles;
+  int extents;
+  int blocks;
+};
+
+int numBlocksFor(inode_t &inode) {
+  int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  return numBlocks > DIRECT_PTRS ? DIRECT_PTRS : numBlocks;
+}
+
+// A run of blocks that follow each other on disk counts as one extent
+int countExtents(inode_t &inode) {
+  int numBlocks = numBlocksFor(inode);
+  int extents = numBlocks > 0 ? 1 : 0;
+  for (int i = 1; i < numBlocks; i++) {
+    if (inode.direct[i] != inode.direct[i - 1] + 1) {
+      extents++;
+    }
+  }
+  return extents;
+}
+
+bool isSet(unsigned char *bitmap, int index) {
+  return bitmap[index / 8] & (1 << (index % 8));
+}
+
+FragmentationStats computeStats(super_t &super, unsigned char *inodeBitmap, vector<inode_t> &inodes) {
+  FragmentationStats stats = {0, 0, 0, 0};
+  for (int i = 0; i < super.num_inodes; i++) {
+    if (!isSet(inodeBitmap, i) || numBlocksFor(inodes[i]) == 0) {
+      continue;
+    }
+    int extents = countExtents(inodes[i]);
+    stats.files++;
+    stats.blocks += numBlocksFor(inodes[i]);
+    stats.extents += extents;
+    if (extents > 1) {
+      stats.fragmentedFiles++;
+    }
+  }
+  return stats;
+}
+
+void printStats(string label, FragmentationStats &stats) {
+  cout << label << endl;
+  cout << "files " << stats.files << endl;
+  cout << "fragmented_files " << stats.fragmentedFiles << endl;
+  cout << "extents " << stats.extents << endl;
+  cout << "blocks " << stats.blocks << endl;
+  cout << endl;
+}
+
+// First fit search for numBlocks free data blocks in a row, returns the
+// data region index of the run or -1
+int findFreeRun(super_t &super, unsigned char *dataBitmap, int numBlocks) {
+  int runStart = 0;
+  int runLength = 0;
+  for (int i = 0; i < super.num_data; i++) {
+    if (isSet(dataBitmap, i)) {
+      runLength = 0;
+      runStart = i + 1;
+    } else if (++runLength == numBlocks) {
+      return runStart;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Moves one file into a contiguous run. The writes are ordered so that a
+ * crash at any point leaves a consistent image: the copies land in free
+ * blocks, the new blocks are marked allocated, the inode is switched over
+ * and only then are the old blocks released. The worst case is leaked
+ * blocks, and running ds3defrag again just picks up where it left off.
+ */
+bool relocate(LocalFileSystem &fs, super_t &super, unsigned char *dataBitmap,
+              vector<inode_t> &inodes, int inodeNumber) {
+  inode_t &inode = inodes[inodeNumber];
+  int numBlocks = numBlocksFor(inode);
+  int runStart = findFreeRun(super, dataBitmap, numBlocks);
+  if (runStart < 0) {
+    return false;
+  }
+
+  fs.disk->beginTransaction();
+
+  vector<unsigned char> block(UFS_BLOCK_SIZE);
+  for (int i = 0; i < numBlocks; i++) {
+    fs.disk->readBlock(inode.direct[i], block.data());
+    fs.disk->writeBlock(super.data_region_addr + runStart + i, block.data());
+  }
+
+  for (int i = 0; i < numBlocks; i++) {
+    int index = runStart + i;
+    dataBitmap[index / 8] |= (1 << (index % 8));
+  }
+  fs.writeDataBitmap(&super, dataBitmap);
+
+  vector<unsigned int> oldBlocks(inode.direct, inode.direct + numBlocks);
+  for (int i = 0; i < numBlocks; i++) {
+    inode.direct[i] = super.data_region_addr + runStart + i;
+  }
+  int inodesPerBlock = UFS_BLOCK_SIZE / sizeof(inode_t);
+  int inodeBlock = inodeNumber / inodesPerBlock;
+  fs.disk->writeBlock(super.inode_region_addr + inodeBlock, &inodes[inodeBlock * inodesPerBlock]);
+
+  for (int i = 0; i < numBlocks; i++) {
+    int index = oldBlocks[i] - super.data_region_addr;
+    dataBitmap[index / 8] &= ~(1 << (index % 8));
+  }
+  fs.writeDataBitmap(&super, dataBitmap);
+
+  fs.disk->commit();
+  return true;
+}
+
+void defragment(LocalFileSystem &fs, bool dryRun) {
+  super_t super;
+  fs.readSuperBlock(&super);
+
+  unsigned char inodeBitmap[super.inode_bitmap_len * UFS_BLOCK_SIZE];
+  unsigned char dataBitmap[super.data_bitmap_len * UFS_BLOCK_SIZE];
+  fs.readInodeBitmap(&super, inodeBitmap);
+  fs.readDataBitmap(&super, dataBitmap);
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  fs.readInodeRegion(&super, inodes.data());
+
+  FragmentationStats before = computeStats(super, inodeBitmap, inodes);
+  printStats("Before", before);
+  if (dryRun) {
+    return;
+  }
+
+  int moved = 0;
+  int skipped = 0;
+  for (int i = 0; i < super.num_inodes; i++) {
+    if (!isSet(inodeBitmap, i) || countExtents(inodes[i]) <= 1) {
+      continue;
+    }
+    if (relocate(fs, super, dataBitmap, inodes, i)) {
+      moved++;
+    } else {
+      skipped++;
+    }
+  }
+
+  FragmentationStats after = computeStats(super, inodeBitmap, inodes);
+  printStats("After", after);
+  cout << "relocated " << moved << endl;
+  cout << "skipped " << skipped << endl;
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-n] diskImageFile" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool dryRun = false;
+  int option;
+  while ((option = getopt(argc, argv, "n")) != -1) {
+    switch (option) {
+    case 'n':
+      dryRun = true;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  string diskimage = argv[optind];
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem filesystem(&disk);
+
+  defragment(filesystem, dryRun);
+
+  return 0;
+}
@@ -0,0 +1,203 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define DIR_ENTS_PER_BLOCK (UFS_BLOCK_SIZE / (int) sizeof(dir_ent_t))
+#define SIZE_BUCKETS (32)
+
+struct Usage {
+  long long bytes;
+  long long blocks;
+};
+
+struct BlockRef {
+  unsigned int block;
+  int directory;
+  int index;
+};
+
+bool compareBlockRefs(const BlockRef &a, const BlockRef &b) {
+  return a.block < b.block;
+}
+
+bool compareBySizeDesc(const pair<int, int> &a, const pair<int, int> &b) {
+  return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+bool comparePaths(const pair<string, int> &a, const pair<string, int> &b) {
+  return a.first < b.first;
+}
+
+int numBlocksFor(inode_t &inode) {
+  return min((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+}
+
+void diskUsage(LocalFileSystem &fs, int topFiles) {
+  super_t super;
+  fs.readSuperBlock(&super);
+  vector<unsigned char> inodeBitmap(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+  fs.readInodeBitmap(&super, inodeBitmap.data());
+  vector<inode_t> inodes(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  fs.readInodeRegion(&super, inodes.data());
+
+  // Every directory block, read in disk order with one read per contiguous run
+  vector<BlockRef> refs;
+  vector<vector<dir_ent_t> > entries(super.num_inodes);
+  for (int i = 0; i < super.num_inodes; i++) {
+    if (!(inodeBitmap[i / 8] & (1 << (i % 8))) || inodes[i].type != UFS_DIRECTORY) {
+      continue;
+    }
+    entries[i].resize(numBlocksFor(inodes[i]) * DIR_ENTS_PER_BLOCK);
+    for (int b = 0; b < numBlocksFor(inodes[i]); b++) {
+      BlockRef ref = {inodes[i].direct[b], i, b};
+      refs.push_back(ref);
+    }
+  }
+  sort(refs.begin(), refs.end(), compareBlockRefs);
+  vector<char> run;
+  unsigned int start = 0;
+  while (start < refs.size()) {
+    unsigned int end = start + 1;
+    while (end < refs.size() && refs[end].block == refs[end - 1].block + 1) {
+      end++;
+    }
+    run.resize((end - start) * UFS_BLOCK_SIZE);
+    fs.disk->readBlocks(refs[start].block, end - start, run.data());
+    for (unsigned int r = start; r < end; r++) {
+      memcpy(&entries[refs[r].directory][refs[r].index * DIR_ENTS_PER_BLOCK],
+             &run[(r - start) * UFS_BLOCK_SIZE], UFS_BLOCK_SIZE);
+    }
+    start = end;
+  }
+
+  // Breadth first from the root gives every inode its path, walking that
+  // order backwards folds children into their parents
+  vector<int> order;
+  vector<int> parent(super.num_inodes, -1);
+  vector<string> paths(super.num_inodes);
+  order.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  parent[UFS_ROOT_DIRECTORY_INODE_NUMBER] = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  paths[UFS_ROOT_DIRECTORY_INODE_NUMBER] = "/";
+  for (unsigned int i = 0; i < order.size(); i++) {
+    int dir = order[i];
+    int numSlots = min((int) entries[dir].size(), inodes[dir].size / (int) sizeof(dir_ent_t));
+    for (int s = 0; s < numSlots; s++) {
+      dir_ent_t &entry = entries[dir][s];
+      entry.name[DIR_ENT_NAME_SIZE - 1] = '\0';
+      if (entry.inum < 0 || entry.inum >= super.num_inodes || parent[entry.inum] != -1 ||
+          strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+        continue;
+      }
+      parent[entry.inum] = dir;
+      paths[entry.inum] = paths[dir] + entry.name + (inodes[entry.inum].type == UFS_DIRECTORY ? "/" : "");
+      order.push_back(entry.inum);
+    }
+  }
+
+  vector<Usage> usage(super.num_inodes);
+  vector<pair<int, int> > files;
+  long long sizeHistogram[SIZE_BUCKETS] = {0};
+  long long emptyFiles = 0;
+  for (int i = order.size() - 1; i >= 0; i--) {
+    int inum = order[i];
+    usage[inum].bytes += inodes[inum].size;
+    usage[inum].blocks += numBlocksFor(inodes[inum]);
+    if (inum != UFS_ROOT_DIRECTORY_INODE_NUMBER) {
+      usage[parent[inum]].bytes += usage[inum].bytes;
+      usage[parent[inum]].blocks += usage[inum].blocks;
+    }
+    if (inodes[inum].type == UFS_REGULAR_FILE) {
+      files.push_back(make_pair(inodes[inum].size, inum));
+      if (inodes[inum].size == 0) {
+        emptyFiles++;
+      } else {
+        sizeHistogram[31 - __builtin_clz(inodes[inum].size)]++;
+      }
+    }
+  }
+
+  string out;
+  char line[64];
+  out += "Directories\n";
+  // Path and inode number of each directory
+  vector<pair<string, int> > directories;
+  for (unsigned int i = 0; i < order.size(); i++) {
+    if (inodes[order[i]].type == UFS_DIRECTORY) {
+      directories.push_back(make_pair(paths[order[i]], order[i]));
+    }
+  }
+  sort(directories.begin(), directories.end(), comparePaths);
+  for (unsigned int i = 0; i < directories.size(); i++) {
+    int inodeNumber = directories[i].second;
+    snprintf(line, sizeof(line), "%lld\t%lld\t", usage[inodeNumber].bytes, usage[inodeNumber].blocks);
+    out += line;
+    out += directories[i].first;
+    out += '\n';
+  }
+
+  out += "\nLargest files\n";
+  int shown = min((int) files.size(), topFiles);
+  partial_sort(files.begin(), files.begin() + shown, files.end(), compareBySizeDesc);
+  for (int i = 0; i < shown; i++) {
+    snprintf(line, sizeof(line), "%d\t", files[i].first);
+    out += line;
+    out += paths[files[i].second];
+    out += '\n';
+  }
+
+  out += "\nSize distribution\n";
+  if (emptyFiles > 0) {
+    snprintf(line, sizeof(line), "0\t%lld\n", emptyFiles);
+    out += line;
+  }
+  for (int i = 0; i < SIZE_BUCKETS; i++) {
+    if (sizeHistogram[i] > 0) {
+      snprintf(line, sizeof(line), "%lld-%lld\t%lld\n", 1LL << i, (2LL << i) - 1, sizeHistogram[i]);
+      out += line;
+    }
+  }
+
+  cout << out;
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-n largestFiles] diskImageFile" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  int topFiles = 10;
+  int option;
+  while ((option = getopt(argc, argv, "n:")) != -1) {
+    switch (option) {
+    case 'n':
+      topFiles = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 || topFiles < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  string diskimage = argv[optind];
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem filesystem(&disk);
+
+  diskUsage(filesystem, topFiles);
+
+  return 0;
+}
@@ -0,0 +1,390 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "LocalFileSystem.h"
+#include "Disk.h"
+#include "ufs.h"
+
+using namespace std;
+
+#define MAX_CHECK_THREADS (16)
+
+struct ImageState {
+  super_t super;
+  vector<unsigned char> inodeBitmap;
+  vector<unsigned char> dataBitmap;
+  vector<inode_t> inodes;
+};
+
+// One directory entry that names a subdirectory
+struct DirectoryLink {
+  int parent;
+  int child;
+};
+
+// An entry that has to be rewritten in repair mode
+struct EntryFix {
+  int directory;
+  int slot;
+  int inum;  // -1 drops the entry
+};
+
+struct CheckerThread {
+  pthread_t thread;
+  Disk *disk;
+  ImageState *image;
+  vector<int> directories;
+
+  vector<string> problems;
+  vector<DirectoryLink> links;
+  vector<EntryFix> fixes;
+  vector<int> referenced;
+};
+
+bool isSet(const vector<unsigned char> &bitmap, int index) {
+  return bitmap[index / 8] & (1 << (index % 8));
+}
+
+void setBit(vector<unsigned char> &bitmap, int index, bool value) {
+  if (value) {
+    bitmap[index / 8] |= (1 << (index % 8));
+  } else {
+    bitmap[index / 8] &= ~(1 << (index % 8));
+  }
+}
+
+int numBlocksFor(inode_t &inode) {
+  int numBlocks = (inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE;
+  return numBlocks > DIRECT_PTRS ? DIRECT_PTRS : numBlocks;
+}
+
+bool isAllocatedInode(ImageState &image, int inodeNumber) {
+  return inodeNumber >= 0 && inodeNumber < image.super.num_inodes && isSet(image.inodeBitmap, inodeNumber);
+}
+
+void checkDirectory(CheckerThread *checker, int inodeNumber) {
+  ImageState &image = *checker->image;
+  inode_t &inode = image.inodes[inodeNumber];
+  int numEntries = inode.size / sizeof(dir_ent_t);
+  vector<dir_ent_t> entries(numBlocksFor(inode) * (UFS_BLOCK_SIZE / sizeof(dir_ent_t)));
+  for (int i = 0; i < numBlocksFor(inode); i++) {
+    checker->disk->readBlock(inode.direct[i], &entries[i * (UFS_BLOCK_SIZE / sizeof(dir_ent_t))]);
+  }
+
+  stringstream problem;
+  bool sawDot = false;
+  bool sawDotDot = false;
+  for (int slot = 0; slot < numEntries; slot++) {
+    dir_ent_t &entry = entries[slot];
+    if (entry.inum == -1) {
+      continue;
+    }
+    entry.name[DIR_ENT_NAME_SIZE - 1] = '\0';
+
+    if (strcmp(entry.name, ".") == 0) {
+      sawDot = true;
+      if (entry.inum != inodeNumber) {
+        problem.str("");
+        problem << "directory " << inodeNumber << ": . points to " << entry.inum;
+        checker->problems.push_back(problem.str());
+        EntryFix fix = {inodeNumber, slot, inodeNumber};
+        checker->fixes.push_back(fix);
+      }
+      continue;
+    }
+    if (strcmp(entry.name, "..") == 0) {
+      // Checked against the real parent once every thread is done
+      sawDotDot = true;
+      continue;
+    }
+
+    if (!isAllocatedInode(image, entry.inum)) {
+      problem.str("");
+      problem << "directory " << inodeNumber << ": entry " << entry.name << " points to unallocated inode " << entry.inum;
+      checker->problems.push_back(problem.str());
+      EntryFix fix = {inodeNumber, slot, -1};
+      checker->fixes.push_back(fix);
+      continue;
+    }
+
+    checker->referenced.push_back(entry.inum);
+    if (image.inodes[entry.inum].type == UFS_DIRECTORY) {
+      DirectoryLink link = {inodeNumber, entry.inum};
+      checker->links.push_back(link);
+    }
+  }
+
+  if (!sawDot) {
+    problem.str("");
+    problem << "directory " << inodeNumber << ": missing .";
+    checker->problems.push_back(problem.str());
+  }
+  if (!sawDotDot) {
+    problem.str("");
+    problem << "directory " << inodeNumber << ": missing ..";
+    checker->problems.push_back(problem.str());
+  }
+}
+
+void *checkDirectories(void *arg) {
+  CheckerThread *checker = (CheckerThread *) arg;
+  for (unsigned int i = 0; i < checker->directories.size(); i++) {
+    checkDirectory(checker, checker->directories[i]);
+  }
+  return NULL;
+}
+
+// Returns the slot of name in a directory, or -1
+int findSlot(Disk &disk, inode_t &inode, const char *name, vector<dir_ent_t> &entries) {
+  entries.resize(numBlocksFor(inode) * (UFS_BLOCK_SIZE / sizeof(dir_ent_t)));
+  for (int i = 0; i < numBlocksFor(inode); i++) {
+    disk.readBlock(inode.direct[i], &entries[i * (UFS_BLOCK_SIZE / sizeof(dir_ent_t))]);
+  }
+  for (int slot = 0; slot < inode.size / (int) sizeof(dir_ent_t); slot++) {
+    if (entries[slot].inum != -1 && strncmp(entries[slot].name, name, DIR_ENT_NAME_SIZE) == 0) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+// An inode with a bad type or size has no trustworthy block count, so every
+// direct pointer that lands in the data region is kept
+void holdBlocks(super_t &super, inode_t &inode, vector<bool> &held) {
+  for (int b = 0; b < DIRECT_PTRS; b++) {
+    int index = (int) inode.direct[b] - super.data_region_addr;
+    if (index >= 0 && index < super.num_data) {
+      held[index] = true;
+    }
+  }
+}
+
+void applyFix(Disk &disk, ImageState &image, EntryFix &fix) {
+  inode_t &inode = image.inodes[fix.directory];
+  int entriesPerBlock = UFS_BLOCK_SIZE / sizeof(dir_ent_t);
+  int blockIndex = fix.slot / entriesPerBlock;
+  dir_ent_t block[UFS_BLOCK_SIZE / sizeof(dir_ent_t)];
+  disk.readBlock(inode.direct[blockIndex], block);
+  block[fix.slot % entriesPerBlock].inum = fix.inum;
+  disk.writeBlock(inode.direct[blockIndex], block);
+}
+
+int fsck(LocalFileSystem &fs, int numThreads, bool repair) {
+  ImageState image;
+  fs.readSuperBlock(&image.super);
+  super_t &super = image.super;
+
+  // Metadata regions come in with one large read each
+  image.inodeBitmap.resize(super.inode_bitmap_len * UFS_BLOCK_SIZE);
+  image.dataBitmap.resize(super.data_bitmap_len * UFS_BLOCK_SIZE);
+  image.inodes.resize(super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  fs.readInodeBitmap(&super, image.inodeBitmap.data());
+  fs.readDataBitmap(&super, image.dataBitmap.data());
+  fs.readInodeRegion(&super, image.inodes.data());
+
+  vector<string> problems;
+  stringstream problem;
+
+  // Every block must belong to at most one inode
+  vector<int> blockOwner(super.num_data, -1);
+  // Blocks an unreadable inode may still point at, left alone by the bitmap repair
+  vector<bool> heldByInvalid(super.num_data, false);
+  vector<int> directories;
+  int allocatedInodes = 0;
+  for (int i = 0; i < super.num_inodes; i++) {
+    if (!isSet(image.inodeBitmap, i)) {
+      continue;
+    }
+    allocatedInodes++;
+    inode_t &inode = image.inodes[i];
+    if (inode.type != UFS_DIRECTORY && inode.type != UFS_REGULAR_FILE) {
+      problem.str("");
+      problem << "inode " << i << ": invalid type " << inode.type;
+      problems.push_back(problem.str());
+      holdBlocks(super, inode, heldByInvalid);
+      continue;
+    }
+    if (inode.size < 0 || inode.size > MAX_FILE_SIZE) {
+      problem.str("");
+      problem << "inode " << i << ": invalid size " << inode.size;
+      problems.push_back(problem.str());
+      holdBlocks(super, inode, heldByInvalid);
+      continue;
+    }
+
+    bool blocksValid = true;
+    for (int b = 0; b < numBlocksFor(inode); b++) {
+      int index = (int) inode.direct[b] - super.data_region_addr;
+      if (index < 0 || index >= super.num_data) {
+        problem.str("");
+        problem << "inode " << i << ": block " << inode.direct[b] << " is outside the data region";
+        problems.push_back(problem.str());
+        blocksValid = false;
+        continue;
+      }
+      if (blockOwner[index] != -1) {
+        problem.str("");
+        problem << "block " << inode.direct[b] << ": allocated to inode " << blockOwner[index] << " and inode " << i;
+        problems.push_back(problem.str());
+        continue;
+      }
+      blockOwner[index] = i;
+    }
+    if (inode.type == UFS_DIRECTORY && blocksValid) {
+      directories.push_back(i);
+    }
+  }
+
+  // Directory contents are checked in parallel, each thread gets every Nth directory
+  if (numThreads > (int) directories.size()) {
+    numThreads = directories.size() > 0 ? directories.size() : 1;
+  }
+  vector<CheckerThread> checkers(numThreads);
+  for (int t = 0; t < numThreads; t++) {
+    checkers[t].disk = fs.disk;
+    checkers[t].image = &image;
+  }
+  for (unsigned int i = 0; i < directories.size(); i++) {
+    checkers[i % numThreads].directories.push_back(directories[i]);
+  }
+  for (int t = 0; t < numThreads; t++) {
+    pthread_create(&checkers[t].thread, NULL, checkDirectories, &checkers[t]);
+  }
+
+  vector<int> linkCount(super.num_inodes, 0);
+  vector<int> parentOf(super.num_inodes, -1);
+  vector<EntryFix> fixes;
+  linkCount[UFS_ROOT_DIRECTORY_INODE_NUMBER]++;
+  parentOf[UFS_ROOT_DIRECTORY_INODE_NUMBER] = UFS_ROOT_DIRECTORY_INODE_NUMBER;
+  for (int t = 0; t < numThreads; t++) {
+    pthread_join(checkers[t].thread, NULL);
+    CheckerThread &checker = checkers[t];
+    problems.insert(problems.end(), checker.problems.begin(), checker.problems.end());
+    fixes.insert(fixes.end(), checker.fixes.begin(), checker.fixes.end());
+    for (unsigned int i = 0; i < checker.referenced.size(); i++) {
+      linkCount[checker.referenced[i]]++;
+    }
+    for (unsigned int i = 0; i < checker.links.size(); i++) {
+      if (parentOf[checker.links[i].child] != -1) {
+        problem.str("");
+        problem << "directory " << checker.links[i].child << ": linked from directory "
+                << parentOf[checker.links[i].child] << " and directory " << checker.links[i].parent;
+        problems.push_back(problem.str());
+        continue;
+      }
+      parentOf[checker.links[i].child] = checker.links[i].parent;
+    }
+  }
+
+  // .. has to name the one directory that links to us
+  for (unsigned int i = 0; i < directories.size(); i++) {
+    int dir = directories[i];
+    if (parentOf[dir] == -1) {
+      continue;
+    }
+    vector<dir_ent_t> entries;
+    int slot = findSlot(*fs.disk, image.inodes[dir], "..", entries);
+    if (slot >= 0 && entries[slot].inum != parentOf[dir]) {
+      problem.str("");
+      problem << "directory " << dir << ": .. points to " << entries[slot].inum << " instead of " << parentOf[dir];
+      problems.push_back(problem.str());
+      EntryFix fix = {dir, slot, parentOf[dir]};
+      fixes.push_back(fix);
+    }
+  }
+
+  for (int i = 0; i < super.num_inodes; i++) {
+    if (isSet(image.inodeBitmap, i) && linkCount[i] == 0) {
+      problem.str("");
+      problem << "inode " << i << ": allocated but not in any directory";
+      problems.push_back(problem.str());
+    }
+  }
+
+  // The data bitmap has to match the block references exactly
+  int bitmapErrors = 0;
+  for (int i = 0; i < super.num_data; i++) {
+    bool referenced = blockOwner[i] != -1;
+    if (!referenced && heldByInvalid[i]) {
+      continue;
+    }
+    if (referenced != isSet(image.dataBitmap, i)) {
+      problem.str("");
+      problem << "block " << super.data_region_addr + i << ": "
+              << (referenced ? "in use by inode but free in bitmap" : "marked allocated but unused");
+      problems.push_back(problem.str());
+      bitmapErrors++;
+    }
+  }
+
+  for (unsigned int i = 0; i < problems.size(); i++) {
+    cout << problems[i] << endl;
+  }
+  cout << "inodes " << allocatedInodes << endl;
+  cout << "directories " << directories.size() << endl;
+  cout << "problems " << problems.size() << endl;
+
+  if (!repair || problems.size() == 0) {
+    return problems.size() == 0 ? 0 : 1;
+  }
+
+  fs.disk->beginTransaction();
+  for (unsigned int i = 0; i < fixes.size(); i++) {
+    applyFix(*fs.disk, image, fixes[i]);
+  }
+  if (bitmapErrors > 0) {
+    for (int i = 0; i < super.num_data; i++) {
+      if (blockOwner[i] != -1 || !heldByInvalid[i]) {
+        setBit(image.dataBitmap, i, blockOwner[i] != -1);
+      }
+    }
+    fs.writeDataBitmap(&super, image.dataBitmap.data());
+  }
+  fs.disk->commit();
+
+  cout << "repaired " << fixes.size() + bitmapErrors << endl;
+  return 1;
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " [-r] [-t threads] diskImageFile" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool repair = false;
+  int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int option;
+  while ((option = getopt(argc, argv, "rt:")) != -1) {
+    switch (option) {
+    case 'r':
+      repair = true;
+      break;
+    case 't':
+      numThreads = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (numThreads < 1) {
+    numThreads = 1;
+  } else if (numThreads > MAX_CHECK_THREADS) {
+    numThreads = MAX_CHECK_THREADS;
+  }
+
+  string diskimage = argv[optind];
+  Disk disk(diskimage, UFS_BLOCK_SIZE);
+  LocalFileSystem filesystem(&disk);
+
+  return fsck(filesystem, numThreads, repair);
+}
@@ -2,80 +2,202 @@
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <cstdio>
 #include <vector>
+#include <deque>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "LocalFileSystem.h"
 #include "Disk.h"
 #include "ufs.h"
 
 using namespace std;
+
+#define MAX_LIST_THREADS (8)
+#define OUTPUT_FLUSH_SIZE (4 * 1024 * 1024)
+
 bool compareDirEnt(const dir_ent_t &a, const dir_ent_t &b){
   return strcmp(a.name, b.name) < 0;
 }
 
-void printdirectory(LocalFileSystem &fs, int inodeNum, const string &path){
+// Directories are read by a pool of threads pulling from one queue, each
+// sorted listing lands in the slot for its inode
+struct ListingState {
+  Disk *disk;
+  super_t super;
+  vector<inode_t> inodes;
+  vector<vector<dir_ent_t> > listings;
+  vector<bool> queued;
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  deque<int> work;
+  int busy;
+};
+
+bool isDirectory(ListingState &state, int inodeNum) {
+  return inodeNum >= 0 && inodeNum < state.super.num_inodes && state.inodes[inodeNum].type == UFS_DIRECTORY;
+}
 
-  inode_t myInode;
-  if (fs.stat(inodeNum, &myInode) != 0    ||    myInode.type != UFS_DIRECTORY){
-    return;
+void readListing(ListingState &state, int inodeNum, vector<dir_ent_t> &entries) {
+  inode_t &inode = state.inodes[inodeNum];
+  int numBlocks = min((inode.size + UFS_BLOCK_SIZE - 1) / UFS_BLOCK_SIZE, DIRECT_PTRS);
+  vector<dir_ent_t> slots(numBlocks * (UFS_BLOCK_SIZE / sizeof(dir_ent_t)));
+
+  // Blocks that sit next to each other on disk come in with one read
+  int start = 0;
+  while (start < numBlocks) {
+    int end = start + 1;
+    while (end < numBlocks && inode.direct[end] == inode.direct[end - 1] + 1) {
+      end++;
+    }
+    state.disk->readBlocks(inode.direct[start], end - start, &slots[start * (UFS_BLOCK_SIZE / sizeof(dir_ent_t))]);
+    start = end;
   }
 
-
-  // Read directory 
-  vector<dir_ent_t> entries;  //file or directory
-  char buffer[UFS_BLOCK_SIZE * DIRECT_PTRS]; 
-  int bytesRead = fs.read(inodeNum, buffer, myInode.size);
-  int offset = 0;
-
-  //Now to actually do stuff
-
-
-  while (offset < bytesRead){
-    dir_ent_t *entry = reinterpret_cast<dir_ent_t *>(buffer + offset);
-    if (entry->inum != -1){ 
-      // Valid directory 
-      entries.push_back(*entry);
+  int numSlots = min((int) slots.size(), inode.size / (int) sizeof(dir_ent_t));
+  for (int i = 0; i < numSlots; i++) {
+    if (slots[i].inum != -1) {
+      slots[i].name[DIR_ENT_NAME_SIZE - 1] = '\0';
+      entries.push_back(slots[i]);
     }
-    offset += sizeof(dir_ent_t);
   }
-
-  // Sorting directory entries by name
   sort(entries.begin(), entries.end(), compareDirEnt);
+}
 
-  cout << "Directory " << path << endl;
+void *listWorker(void *arg) {
+  ListingState &state = *(ListingState *) arg;
 
-  //print directory contents
-  for (vector<dir_ent_t>::const_iterator it = entries.begin(); it != entries.end(); ++it){
-    cout << it->inum << "\t" << it->name << endl;
+  pthread_mutex_lock(&state.lock);
+  while (true) {
+    while (state.work.empty() && state.busy > 0) {
+      pthread_cond_wait(&state.changed, &state.lock);
+    }
+    if (state.work.empty()) {
+      break;
+    }
+    int inodeNum = state.work.front();
+    state.work.pop_front();
+    state.busy++;
+    pthread_mutex_unlock(&state.lock);
+
+    vector<dir_ent_t> entries;
+    readListing(state, inodeNum, entries);
+
+    pthread_mutex_lock(&state.lock);
+    state.listings[inodeNum].swap(entries);
+    vector<dir_ent_t> &listing = state.listings[inodeNum];
+    for (unsigned int i = 0; i < listing.size(); i++) {
+      if (isDirectory(state, listing[i].inum) && !state.queued[listing[i].inum]) {
+        state.queued[listing[i].inum] = true;
+        state.work.push_back(listing[i].inum);
+      }
+    }
+    state.busy--;
+    pthread_cond_broadcast(&state.changed);
   }
-  cout << endl;
+  pthread_mutex_unlock(&state.lock);
+  return NULL;
+}
 
-  // Traverse them all!
-  for (vector<dir_ent_t>::const_iterator it = entries.begin(); it != entries.end(); ++it){
+void writeAll(string &out) {
+  size_t offset = 0;
+  while (offset < out.size()) {
+    ssize_t ret = write(STDOUT_FILENO, out.data() + offset, out.size() - offset);
+    if (ret <= 0) {
+      perror("write");
+      exit(1);
+    }
+    offset += ret;
+  }
+  out.clear();
+}
 
-    if (strcmp(it->name, ".") == 0 || strcmp(it->name, "..") == 0){
-      continue; 
+// Depth first, in sorted order, the same output the recursive version gave
+void printListings(ListingState &state) {
+  string out;
+  out.reserve(OUTPUT_FLUSH_SIZE);
+  vector<bool> printed(state.super.num_inodes, false);
+  vector<pair<int, string> > stack;
+  stack.push_back(make_pair(UFS_ROOT_DIRECTORY_INODE_NUMBER, string("/")));
+
+  char number[16];
+  while (!stack.empty()) {
+    int inodeNum = stack.back().first;
+    string path = stack.back().second;
+    stack.pop_back();
+    if (printed[inodeNum]) {
+      continue;
+    }
+    printed[inodeNum] = true;
+
+    vector<dir_ent_t> &entries = state.listings[inodeNum];
+    out += "Directory ";
+    out += path;
+    out += '\n';
+    for (unsigned int i = 0; i < entries.size(); i++) {
+      snprintf(number, sizeof(number), "%d\t", entries[i].inum);
+      out += number;
+      out += entries[i].name;
+      out += '\n';
+    }
+    out += '\n';
+    if (out.size() >= OUTPUT_FLUSH_SIZE) {
+      writeAll(out);
     }
 
-    string newPath = path + (path.back() == '/' ? "" : "/") + it->name + "/";
-    printdirectory(fs, it->inum, newPath);
+    // Pushed in reverse so the first child is printed next
+    for (int i = entries.size() - 1; i >= 0; i--) {
+      if (strcmp(entries[i].name, ".") == 0 || strcmp(entries[i].name, "..") == 0) {
+        continue;
+      }
+      if (isDirectory(state, entries[i].inum)) {
+        stack.push_back(make_pair(entries[i].inum, path + entries[i].name + "/"));
+      }
+    }
   }
+  writeAll(out);
 }
 
 
-
 int main(int argc, char *argv[]){
   if (argc != 2)
   {
     cout << argv[0] << ": diskImageFile" << endl;
     return 1;
   }
-  
+
   string diskimage = argv[1];
-  Disk disk(diskimage, 4096); //disk instance. 
+  Disk disk(diskimage, 4096); //disk instance.
   LocalFileSystem filesystem(&disk); //filesystem instance.
 
-  printdirectory(filesystem, UFS_ROOT_DIRECTORY_INODE_NUMBER, "/");
+  ListingState state;
+  state.disk = &disk;
+  filesystem.readSuperBlock(&state.super);
+  state.inodes.resize(state.super.inode_region_len * UFS_BLOCK_SIZE / sizeof(inode_t));
+  filesystem.readInodeRegion(&state.super, state.inodes.data());
+  if (!isDirectory(state, UFS_ROOT_DIRECTORY_INODE_NUMBER)) {
+    return 0;
+  }
+  state.listings.resize(state.super.num_inodes);
+  state.queued.resize(state.super.num_inodes, false);
+  state.queued[UFS_ROOT_DIRECTORY_INODE_NUMBER] = true;
+  state.work.push_back(UFS_ROOT_DIRECTORY_INODE_NUMBER);
+  state.busy = 0;
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.changed, NULL);
+
+  int numThreads = min((int) sysconf(_SC_NPROCESSORS_ONLN), MAX_LIST_THREADS);
+  vector<pthread_t> threads(max(numThreads, 1));
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    pthread_create(&threads[i], NULL, listWorker, &state);
+  }
+  for (unsigned int i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printListings(state);
 
   return 0;
 }
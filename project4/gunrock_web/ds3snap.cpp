@@ -0,0 +1,284 @@
+#include <iostream>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "Disk.h"
+#include "FastHash.h"
+#include "ufs.h"
+
+using namespace std;
+
+// Blocks hashed per trip to the disk
+#define SCAN_BLOCKS (256)
+#define FILE_BUFFER_SIZE (1024 * 1024)
+
+#define MANIFEST_MAGIC "DS3M"
+#define DELTA_MAGIC "DS3D"
+#define SNAP_VERSION (1)
+
+/**
+ * Manifest: header, then one 64-bit hash per block of the image.
+ * Delta: header, then a record per changed block holding the block
+ * number, the hash the block had in the base image and its new contents.
+ * Apply refuses to touch a block whose current hash is not the base hash.
+ */
+struct SnapHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t blockSize;
+  uint32_t numBlocks;
+};
+
+struct DeltaRecord {
+  uint32_t blockNumber;
+  uint32_t padding;
+  uint64_t baseHash;
+};
+
+void fail(string message) {
+  cerr << "ds3snap: " << message << endl;
+  exit(1);
+}
+
+FILE *openFile(string path, const char *mode) {
+  if (path == "-") {
+    return mode[0] == 'r' ? stdin : stdout;
+  }
+  FILE *file = fopen(path.c_str(), mode);
+  if (file == NULL) {
+    fail("could not open " + path);
+  }
+  setvbuf(file, NULL, _IOFBF, FILE_BUFFER_SIZE);
+  return file;
+}
+
+void closeFile(FILE *file, string path) {
+  if (fflush(file) != 0 || (file != stdout && file != stdin && fclose(file) != 0)) {
+    fail("could not write " + path);
+  }
+}
+
+void writeExactly(FILE *file, const void *data, size_t length, string path) {
+  if (fwrite(data, 1, length, file) != length) {
+    fail("could not write " + path);
+  }
+}
+
+bool readExactly(FILE *file, void *data, size_t length) {
+  return fread(data, 1, length, file) == length;
+}
+
+SnapHeader makeHeader(const char *magic, uint32_t numBlocks) {
+  SnapHeader header;
+  memcpy(header.magic, magic, 4);
+  header.version = SNAP_VERSION;
+  header.blockSize = UFS_BLOCK_SIZE;
+  header.numBlocks = numBlocks;
+  return header;
+}
+
+void checkHeader(SnapHeader &header, const char *magic, string path) {
+  if (memcmp(header.magic, magic, 4) != 0 || header.version != SNAP_VERSION) {
+    fail(path + " is not a " + magic + " file");
+  }
+  if (header.blockSize != UFS_BLOCK_SIZE) {
+    fail(path + " has a different block size");
+  }
+}
+
+bool isManifest(string path) {
+  FILE *file = fopen(path.c_str(), "r");
+  if (file == NULL) {
+    fail("could not open " + path);
+  }
+  char magic[4];
+  bool manifest = readExactly(file, magic, sizeof(magic)) && memcmp(magic, MANIFEST_MAGIC, 4) == 0;
+  fclose(file);
+  return manifest;
+}
+
+// Walks an image in large sequential reads, handing each block to the visitor
+template <typename Visitor>
+void scanImage(Disk &disk, Visitor visit) {
+  vector<unsigned char> buffer(SCAN_BLOCKS * UFS_BLOCK_SIZE);
+  int numBlocks = disk.numberOfBlocks();
+  for (int start = 0; start < numBlocks; start += SCAN_BLOCKS) {
+    int count = min(SCAN_BLOCKS, numBlocks - start);
+    disk.readBlocks(start, count, buffer.data());
+    for (int i = 0; i < count; i++) {
+      unsigned char *block = &buffer[i * UFS_BLOCK_SIZE];
+      visit(start + i, block, FastHash::hash64(block, UFS_BLOCK_SIZE));
+    }
+  }
+}
+
+vector<uint64_t> loadManifest(string path) {
+  FILE *file = openFile(path, "r");
+  SnapHeader header;
+  if (!readExactly(file, &header, sizeof(header))) {
+    fail("could not read " + path);
+  }
+  checkHeader(header, MANIFEST_MAGIC, path);
+  vector<uint64_t> hashes(header.numBlocks);
+  if (!readExactly(file, hashes.data(), hashes.size() * sizeof(uint64_t))) {
+    fail(path + " is truncated");
+  }
+  closeFile(file, path);
+  return hashes;
+}
+
+vector<uint64_t> hashImage(string path) {
+  Disk disk(path, UFS_BLOCK_SIZE);
+  vector<uint64_t> hashes(disk.numberOfBlocks());
+  scanImage(disk, [&hashes](int blockNumber, unsigned char *block, uint64_t hash) {
+    hashes[blockNumber] = hash;
+  });
+  return hashes;
+}
+
+void writeManifest(string path, vector<uint64_t> &hashes) {
+  FILE *file = openFile(path, "w");
+  SnapHeader header = makeHeader(MANIFEST_MAGIC, hashes.size());
+  writeExactly(file, &header, sizeof(header), path);
+  writeExactly(file, hashes.data(), hashes.size() * sizeof(uint64_t), path);
+  closeFile(file, path);
+}
+
+int manifest(string imagePath, string manifestPath) {
+  vector<uint64_t> hashes = hashImage(imagePath);
+  writeManifest(manifestPath, hashes);
+  cerr << "blocks " << hashes.size() << endl;
+  return 0;
+}
+
+// The base may be an image or a manifest, - for a manifest on stdin. The
+// target has to be an image since the delta carries its data
+int diff(string basePath, string imagePath, string deltaPath, string newManifestPath) {
+  bool manifestBase = basePath == "-" || isManifest(basePath);
+  vector<uint64_t> baseHashes = manifestBase ? loadManifest(basePath) : hashImage(basePath);
+
+  Disk disk(imagePath, UFS_BLOCK_SIZE);
+  if ((int) baseHashes.size() != disk.numberOfBlocks()) {
+    fail("images have different numbers of blocks");
+  }
+
+  FILE *delta = openFile(deltaPath, "w");
+  SnapHeader header = makeHeader(DELTA_MAGIC, baseHashes.size());
+  writeExactly(delta, &header, sizeof(header), deltaPath);
+
+  vector<uint64_t> newHashes(baseHashes.size());
+  int changed = 0;
+  scanImage(disk, [&](int blockNumber, unsigned char *block, uint64_t hash) {
+    newHashes[blockNumber] = hash;
+    if (hash != baseHashes[blockNumber]) {
+      DeltaRecord record;
+      record.blockNumber = blockNumber;
+      record.padding = 0;
+      record.baseHash = baseHashes[blockNumber];
+      writeExactly(delta, &record, sizeof(record), deltaPath);
+      writeExactly(delta, block, UFS_BLOCK_SIZE, deltaPath);
+      changed++;
+    }
+  });
+  closeFile(delta, deltaPath);
+
+  if (newManifestPath != "") {
+    writeManifest(newManifestPath, newHashes);
+  }
+  cerr << "blocks " << baseHashes.size() << endl;
+  cerr << "changed " << changed << endl;
+  return 0;
+}
+
+// Every block is checked and written inside one Disk transaction, so a
+// delta for the wrong base leaves the image untouched
+int apply(string imagePath, string deltaPath, bool force) {
+  Disk disk(imagePath, UFS_BLOCK_SIZE);
+  FILE *delta = openFile(deltaPath, "r");
+  SnapHeader header;
+  if (!readExactly(delta, &header, sizeof(header))) {
+    fail("could not read " + deltaPath);
+  }
+  checkHeader(header, DELTA_MAGIC, deltaPath);
+  if ((int) header.numBlocks != disk.numberOfBlocks()) {
+    fail("delta is for an image with a different number of blocks");
+  }
+
+  vector<unsigned char> current(UFS_BLOCK_SIZE);
+  vector<unsigned char> block(UFS_BLOCK_SIZE);
+  DeltaRecord record;
+  int applied = 0;
+  disk.beginTransaction();
+  while (readExactly(delta, &record, sizeof(record))) {
+    if (!readExactly(delta, block.data(), UFS_BLOCK_SIZE) || record.blockNumber >= (uint32_t) disk.numberOfBlocks()) {
+      disk.rollback();
+      fail(deltaPath + " is truncated or corrupt");
+    }
+    disk.readBlock(record.blockNumber, current.data());
+    if (!force && FastHash::hash64(current.data(), UFS_BLOCK_SIZE) != record.baseHash) {
+      disk.rollback();
+      cerr << "ds3snap: block " << record.blockNumber << " does not match the delta's base, nothing applied" << endl;
+      return 1;
+    }
+    disk.writeBlock(record.blockNumber, block.data());
+    applied++;
+  }
+  if (!feof(delta)) {
+    disk.rollback();
+    fail("could not read " + deltaPath);
+  }
+  disk.commit();
+  closeFile(delta, deltaPath);
+
+  cerr << "applied " << applied << endl;
+  return 0;
+}
+
+void usage(char *prog) {
+  cerr << "usage: " << prog << " manifest diskImageFile manifestFile" << endl;
+  cerr << "       " << prog << " diff [-m newManifestFile] baseImageOrManifest diskImageFile deltaFile" << endl;
+  cerr << "       " << prog << " apply [-f] diskImageFile deltaFile" << endl;
+  cerr << "  manifest, delta and base manifest files may be -, for stdin or stdout; images may not" << endl;
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+  }
+  string command = argv[1];
+
+  string newManifestPath;
+  bool force = false;
+  int option;
+  optind = 2;
+  while ((option = getopt(argc, argv, "m:f")) != -1) {
+    switch (option) {
+    case 'm':
+      newManifestPath = optarg;
+      break;
+    case 'f':
+      force = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  int numArgs = argc - optind;
+
+  if (command == "manifest" && numArgs == 2) {
+    return manifest(argv[optind], argv[optind + 1]);
+  } else if (command == "diff" && numArgs == 3) {
+    return diff(argv[optind], argv[optind + 1], argv[optind + 2], newManifestPath);
+  } else if (command == "apply" && numArgs == 2) {
+    return apply(argv[optind], argv[optind + 1], force);
+  }
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,232 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <unistd.h>
+#include <signal.h>
+
+#include "HttpClient.h"
+#include "HTTPClientResponse.h"
+
+using namespace std;
+
+// How long one request may take, retries included
+#define REQUEST_DEADLINE_MS (30000)
+// Further tries of a request that got no answer
+#define REQUEST_RETRIES (2)
+
+// A ds3 node, host:port, or several replicas of one. Reads hedge across
+// the replicas, writes go to the first.
+struct Node {
+  string name;
+  vector<string> replicas;
+};
+
+struct Reply {
+  int status;
+  string body;
+  string merkle;
+};
+
+// What a sync did, or with -n would do
+struct Stats {
+  int directories;
+  int copied;
+  int deleted;
+  long long bytes;
+  int errors;
+};
+
+bool dryRun = false;
+Stats stats = {0, 0, 0, 0, 0};
+
+void fail(string message) {
+  cerr << "ds3sync: " << message << endl;
+  exit(1);
+}
+
+Node parseNode(string arg) {
+  Node node;
+  node.name = arg;
+  size_t start = 0;
+  while (start <= arg.size()) {
+    size_t end = arg.find(',', start);
+    if (end == string::npos) {
+      end = arg.size();
+    }
+    string replica = arg.substr(start, end - start);
+    size_t colon = replica.rfind(':');
+    if (colon == string::npos || colon == 0 || atoi(replica.substr(colon + 1).c_str()) <= 0) {
+      fail("bad node " + replica + ", expected host:port");
+    }
+    node.replicas.push_back(replica);
+    start = end + 1;
+  }
+  return node;
+}
+
+Reply request(Node &node, string method, string path, string body) {
+  Reply reply;
+  reply.status = 0;
+  try {
+    RequestPolicy policy;
+    policy.deadline_ms = REQUEST_DEADLINE_MS;
+    policy.retries = REQUEST_RETRIES;
+    policy.hedge = method == "GET";
+    vector<string> replicas = node.replicas;
+    if (method != "GET") {
+      replicas.resize(1); // Replicas take their writes from the first
+    }
+    HTTPClientResponse *response = HttpClient::send(replicas, method, path, body, map<string, string>(), policy);
+    reply.status = response->status();
+    reply.body = response->body();
+    reply.merkle = response->header("X-Ds3-Merkle");
+    delete response;
+  } catch (...) {
+    reply.status = 0;
+  }
+  if (reply.status == 0) {
+    cerr << "ds3sync: no answer from " << node.name << endl;
+    exit(1);
+  }
+  return reply;
+}
+
+// The entries of a directory with their hashes, empty if it isn't there
+map<string, string> listing(Node &node, string path) {
+  map<string, string> entries;
+  Reply reply = request(node, "GET", path + "?merkle", "");
+  if (reply.status == 404) {
+    return entries;
+  }
+  if (reply.status != 200) {
+    fail("listing " + path + " failed");
+  }
+  size_t start = 0;
+  while (start < reply.body.size()) {
+    size_t end = reply.body.find('\n', start);
+    if (end == string::npos) {
+      end = reply.body.size();
+    }
+    string line = reply.body.substr(start, end - start);
+    size_t space = line.find(' ');
+    if (space != string::npos) {
+      entries[line.substr(space + 1)] = line.substr(0, space);
+    }
+    start = end + 1;
+  }
+  return entries;
+}
+
+bool isDirectory(const string &name) {
+  return name.size() > 0 && name[name.size() - 1] == '/';
+}
+
+void copyFile(Node &source, Node &destination, string path) {
+  cout << "copy " << path << endl;
+  stats.copied++;
+  if (dryRun) {
+    return;
+  }
+  Reply data = request(source, "GET", path, "");
+  if (data.status != 200) {
+    cerr << "ds3sync: reading " << path << " failed with " << data.status << endl;
+    stats.errors++;
+    return;
+  }
+  Reply written = request(destination, "PUT", path, data.body);
+  if (written.status != 200) {
+    cerr << "ds3sync: writing " << path << " failed with " << written.status << endl;
+    stats.errors++;
+    return;
+  }
+  stats.bytes += data.body.size();
+}
+
+// Deletes path from the node, a directory after everything in it
+void removePath(Node &node, string path, bool directory) {
+  if (directory) {
+    map<string, string> entries = listing(node, path);
+    for (map<string, string>::iterator iter = entries.begin(); iter != entries.end(); iter++) {
+      removePath(node, path + iter->first, isDirectory(iter->first));
+    }
+    path = path.substr(0, path.size() - 1);
+  } else {
+    cout << "delete " << path << endl;
+    stats.deleted++;
+  }
+  if (dryRun) {
+    return;
+  }
+  Reply reply = request(node, "DELETE", path, "");
+  // A directory holding empty directories can stay, it hashes like a
+  // missing one
+  if (reply.status != 200 && reply.status != 404 && !directory) {
+    cerr << "ds3sync: deleting " << path << " failed with " << reply.status << endl;
+    stats.errors++;
+  }
+}
+
+// Makes the directory at path on destination match source, descending
+// only into entries whose hashes differ
+void syncDirectory(Node &source, Node &destination, string path) {
+  stats.directories++;
+  map<string, string> from = listing(source, path);
+  map<string, string> to = listing(destination, path);
+
+  for (map<string, string>::iterator iter = to.begin(); iter != to.end(); iter++) {
+    string name = iter->first;
+    string other = isDirectory(name) ? name.substr(0, name.size() - 1) : name + "/";
+    // Gone from the source, or there with the other type
+    if (from.count(name) == 0) {
+      removePath(destination, path + name, isDirectory(name));
+    } else if (from.count(other) > 0) {
+      removePath(destination, path + name, isDirectory(name));
+    }
+  }
+
+  for (map<string, string>::iterator iter = from.begin(); iter != from.end(); iter++) {
+    string name = iter->first;
+    if (to.count(name) > 0 && to[name] == iter->second) {
+      continue;
+    }
+    if (isDirectory(name)) {
+      syncDirectory(source, destination, path + name);
+    } else {
+      copyFile(source, destination, path + name);
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGPIPE, SIG_IGN);
+  int option;
+  while ((option = getopt(argc, argv, "n")) != -1) {
+    switch (option) {
+    case 'n':
+      dryRun = true;
+      break;
+    default:
+      fail("usage: ds3sync [-n] sourceHost:port[,replica...] destinationHost:port");
+    }
+  }
+  if (argc - optind != 2) {
+    fail("usage: ds3sync [-n] sourceHost:port[,replica...] destinationHost:port");
+  }
+  Node source = parseNode(argv[optind]);
+  Node destination = parseNode(argv[optind + 1]);
+
+  Reply sourceRoot = request(source, "GET", "/ds3/?merkle", "");
+  Reply destinationRoot = request(destination, "GET", "/ds3/?merkle", "");
+  if (sourceRoot.status != 200 || destinationRoot.status != 200) {
+    fail("both nodes need to serve /ds3/");
+  }
+  if (sourceRoot.merkle != destinationRoot.merkle) {
+    syncDirectory(source, destination, "/ds3/");
+  }
+
+  cout << "directories compared " << stats.directories << ", files copied " << stats.copied
+       << ", files deleted " << stats.deleted << ", bytes copied " << stats.bytes << endl;
+  return stats.errors == 0 ? 0 : 1;
+}
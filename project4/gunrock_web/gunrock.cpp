@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
@@ -18,11 +19,17 @@
 #include "HttpUtils.h"
 #include "FileService.h"
 #include "DistributedFileSystemService.h"
+#include "DistributedFileSystemRouter.h"
+#include "Replicator.h"
 #include "MySocket.h"
 #include "MyServerSocket.h"
 #include "dthread.h"
 
 using namespace std;
+
+// Bytes a BodyProducer is asked for per chunk
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
 int PORT = 8080;
 int THREAD_POOL_SIZE = 1;
 int BUFFER_SIZE = 1;
@@ -30,6 +37,15 @@ string BASEDIR = "ds3";
 string SCHEDALG = "FIFO";
 string LOGFILE = "/dev/null";
 string DISKFILE = "disk.img";
+// host:port of each backend when routing /ds3/ instead of serving it
+vector<string> ROUTER_BACKENDS;
+// Data and parity shards per file when the router erasure codes, 0 when not
+int DATA_SHARDS = 0;
+int PARITY_SHARDS = 0;
+// host:port of each backend this node replicates its writes to
+vector<string> REPLICA_PEERS;
+// Copies a write needs, this node included, before it succeeds
+int WRITE_QUORUM = 1;
 
 vector<HttpService *> services;
 
@@ -70,14 +86,30 @@ void invoke_service_method(HttpService *service, HTTPRequest *request, HTTPRespo
       response->setStatus(501);
     }
   } catch (ClientError &ce) {
+    response->setBodyProducer(NULL);
     response->setStatus(ce.status_code);
   } catch (...) {
     // reset the response object and return an error
+    response->setBodyProducer(NULL);
     response->setBody("");
     response->setStatus(500);
   }
 }
 
+// Sends a producer's body as chunks, one buffer at a time
+void write_streamed_body(MySocket *client, HTTPResponse *response) {
+  BodyProducer *producer = response->getBodyProducer();
+  if (producer == NULL) {
+    return;
+  }
+  vector<char> buffer(STREAM_CHUNK_SIZE);
+  int numBytes;
+  while ((numBytes = producer->produce(buffer.data(), buffer.size())) > 0) {
+    HttpUtils::writeChunk(client, buffer.data(), numBytes);
+  }
+  HttpUtils::writeLastChunk(client);
+}
+
 void handle_request(MySocket *client) {
   HTTPRequest *request = new HTTPRequest(client, PORT);
   HTTPResponse *response = new HTTPResponse();
@@ -110,7 +142,12 @@ void handle_request(MySocket *client) {
   payload << " RESPONSE " << response->getStatus() << " client: " << (void *) client;
   sync_print("write_response", payload.str());
   cout << payload.str() << endl;
-  client->write(response->response());
+  try {
+    client->write(response->response());
+    write_streamed_body(client, response);
+  } catch (...) {
+    // the client went away, nothing more to send
+  }
     
   delete response;
   delete request;
@@ -122,12 +159,25 @@ void handle_request(MySocket *client) {
   delete client;
 }
 
+// Splits a comma separated host:port list, exits if one is malformed
+vector<string> parse_hosts(const char *arg) {
+  vector<string> hosts = StringUtils::split(arg, ',');
+  for (unsigned int idx = 0; idx < hosts.size(); idx++) {
+    size_t colon = hosts[idx].rfind(':');
+    if (colon == string::npos || colon == 0 || atoi(hosts[idx].substr(colon + 1).c_str()) <= 0) {
+      cerr << "bad backend " << hosts[idx] << ", expected host:port" << endl;
+      exit(1);
+    }
+  }
+  return hosts;
+}
+
 int main(int argc, char *argv[]) {
 
   signal(SIGPIPE, SIG_IGN);
   int option;
 
-  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, "d:p:t:b:s:l:i:r:e:R:w:")) != -1) {
     switch (option) {
     case 'd':
       BASEDIR = string(optarg);
@@ -150,12 +200,37 @@ int main(int argc, char *argv[]) {
     case 'i':
       DISKFILE = string(optarg);
       break;
+    case 'r':
+      ROUTER_BACKENDS = parse_hosts(optarg);
+      break;
+    case 'e':
+      if (sscanf(optarg, "%d,%d", &DATA_SHARDS, &PARITY_SHARDS) != 2 || DATA_SHARDS < 1 || PARITY_SHARDS < 0) {
+        cerr << "bad shard counts " << optarg << ", expected k,m" << endl;
+        exit(1);
+      }
+      break;
+    case 'R':
+      REPLICA_PEERS = parse_hosts(optarg);
+      break;
+    case 'w':
+      WRITE_QUORUM = atoi(optarg);
+      break;
     default:
-      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile]" << endl;
+      cerr<< "usage: " << argv[0] << " [-p port] [-t threads] [-b buffers] [-i diskFile] [-r host:port,... [-e k,m]] [-R host:port,... [-w quorum]]" << endl;
       exit(1);
     }
   }
 
+  if (WRITE_QUORUM < 1 || WRITE_QUORUM > (int) REPLICA_PEERS.size() + 1) {
+    cerr << "write quorum must be between 1 and " << REPLICA_PEERS.size() + 1 << endl;
+    exit(1);
+  }
+
+  if (DATA_SHARDS > 0 && (DATA_SHARDS + PARITY_SHARDS > (int) ROUTER_BACKENDS.size() || DATA_SHARDS + PARITY_SHARDS > 256)) {
+    cerr << "erasure coding needs at least k + m backends, and k + m at most 256" << endl;
+    exit(1);
+  }
+
   set_log_file(LOGFILE);
 
   cout << "Lisening on port " << PORT << endl;
@@ -166,7 +241,15 @@ int main(int argc, char *argv[]) {
 
   // The order that you push services dictates the search order
   // for path prefix matching
-  services.push_back(new DistributedFileSystemService(DISKFILE));
+  if (ROUTER_BACKENDS.empty()) {
+    Replicator *replicator = NULL;
+    if (!REPLICA_PEERS.empty()) {
+      replicator = new Replicator(REPLICA_PEERS, WRITE_QUORUM);
+    }
+    services.push_back(new DistributedFileSystemService(DISKFILE, replicator));
+  } else {
+    services.push_back(new DistributedFileSystemRouter(ROUTER_BACKENDS, DATA_SHARDS, PARITY_SHARDS));
+  }
   services.push_back(new FileService(BASEDIR));
   
   while(true) {
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <deque>
+#include <atomic>
+#include <sys/types.h>
 
 struct UndoRecord {
   int blockNumber;
@@ -13,18 +15,29 @@ class Disk {
  public:
   Disk(std::string imageFile, int blockSize);
   void readBlock(int blockNumber, void *buffer);
+  void readBlocks(int blockNumber, int numBlocks, void *buffer);
   void writeBlock(int blockNumber, void *buffer);
   int numberOfBlocks();
 
   void beginTransaction();
   void commit();
   void rollback();
-  
+  bool inTransaction();
+
+  // Blocks moved since construction or the last resetCounters(). Safe to
+  // read from several threads at once. The undo copies a transaction
+  // saves are not counted as reads
+  long long blocksRead();
+  long long blocksWritten();
+  void resetCounters();
+
  private:
   std::string imageFile;
   int blockSize;
-  int imageFileSize;
+  off_t imageFileSize;
   bool isInTransaction;
+  std::atomic<long long> numBlocksRead;
+  std::atomic<long long> numBlocksWritten;
   std::deque<struct UndoRecord> undoLog;
 };
 
@@ -0,0 +1,117 @@
+#ifndef _DISTRIBUTEDFILESYSTEMROUTER_H_
+#define _DISTRIBUTEDFILESYSTEMROUTER_H_
+
+#include "HttpService.h"
+#include "ReedSolomon.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+/**
+ * Spreads /ds3/ over several gunrock backends, each serving its own image.
+ *
+ * Every object lives on the backend that owns the hash of its path on a
+ * consistent hash ring. Each backend holds many virtual nodes on the ring
+ * so objects spread evenly and adding a backend moves about 1/N of them.
+ *
+ * Directories are implicit: a backend has the ones its objects need, so
+ * the entries of one directory are spread over the backends. Listing or
+ * deleting a directory goes to all of them and the answers are merged.
+ *
+ * In erasure coded mode a file is instead cut into k data and m parity
+ * shards stored under its path on k + m distinct backends, the ones met
+ * walking the ring from its hash. Any k shards give it back, so m backends
+ * can be lost at (k + m) / k times the storage. Shards are fetched in
+ * parallel. Each starts with a line naming its place in the object and
+ * the write it came from, so shards left behind by an older write are
+ * never mixed with newer ones. Appends, patches and batches would have to
+ * rewrite every shard and are refused with 501.
+ *
+ * A write is acknowledged once max(k, m) + 1 shards are stored, all of
+ * them when m is 0. More than k means it can be decoded on its own, and
+ * more than m means at least one of any k shards has it, so k data
+ * shards from the same write are the newest acknowledged one. A delete
+ * needs the same number of those backends to confirm it, so fewer than k
+ * shards can outlive it.
+ */
+class DistributedFileSystemRouter : public HttpService {
+ public:
+  // backends are host:port, erasure coding is on when dataShards > 0
+  DistributedFileSystemRouter(std::vector<std::string> backends, int dataShards = 0, int parityShards = 0);
+
+  virtual void head(HTTPRequest *request, HTTPResponse *response);
+  virtual void get(HTTPRequest *request, HTTPResponse *response);
+  virtual void put(HTTPRequest *request, HTTPResponse *response);
+  virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
+
+ private:
+  struct Backend {
+    std::string host;
+    int port;
+  };
+
+  // What a backend sent back
+  struct Reply {
+    int status;
+    std::string body;
+    std::map<std::string, std::string> headers;
+
+    // Matched case-insensitively, "" if absent
+    std::string header(std::string key);
+  };
+
+  // One request of a parallel fan-out
+  struct Call {
+    DistributedFileSystemRouter *router;
+    int backend;
+    std::string method;
+    std::string target;
+    std::string body;
+    Reply reply;
+  };
+
+  // The first line of a shard
+  struct ShardHeader {
+    int index;
+    long long size;
+    unsigned long long version;
+    std::string hash;
+  };
+
+  std::string objectKey(std::string path);
+  int owner(std::string key);
+  std::string target(HTTPRequest *request);
+  Reply forward(int backend, std::string method, std::string target, std::string body, HTTPRequest *request);
+  void relay(Reply &reply, HTTPResponse *response);
+  void listDirectory(HTTPRequest *request, HTTPResponse *response, int ownerIndex, Reply *ownerReply);
+  void batch(HTTPRequest *request, HTTPResponse *response, bool atomic);
+
+  void forwardAll(std::vector<Call> &calls);
+  static void *forwardThread(void *arg);
+  std::vector<int> placement(std::string key);
+  bool findDirectory(std::string path, Reply &found);
+  bool parseShard(Reply &reply, int index, ShardHeader &header, std::string &shard);
+  int readObject(std::string key, std::string &data, std::string &etag);
+  int writeObject(std::string key, const std::string &data, std::string &etag, Reply &failure);
+  std::vector<Reply> deleteEverywhere(std::string path);
+  int deletedShards(std::string key, std::vector<Reply> &replies);
+  void erasureHead(HTTPRequest *request, HTTPResponse *response);
+  void erasureGet(HTTPRequest *request, HTTPResponse *response);
+  void erasurePut(HTTPRequest *request, HTTPResponse *response);
+  void erasureDel(HTTPRequest *request, HTTPResponse *response);
+  void erasureMove(HTTPRequest *request, HTTPResponse *response, std::string key, std::string destinationKey);
+
+  std::vector<Backend> backends;
+  // Ring position to backend index
+  std::map<uint64_t, int> ring;
+  // NULL unless erasure coding
+  ReedSolomon *codec;
+  // Shards that have to be stored before a write is acknowledged
+  int writeQuorum;
+};
+
+#endif
@@ -2,20 +2,106 @@
 #define _DISTRIBUTEDFILESYSTEMSERVICE_H_
 
 #include "HttpService.h"
+#include "ClientError.h"
 #include "LocalFileSystem.h"
+#include "Replicator.h"
 
 #include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
 
 class DistributedFileSystemService : public HttpService {
  public:
-  DistributedFileSystemService(std::string driveFile);
+  // With a replicator every committed change is also sent to its peers
+  DistributedFileSystemService(std::string driveFile, Replicator *replicator = NULL);
 
+  virtual void head(HTTPRequest *request, HTTPResponse *response);
   virtual void get(HTTPRequest *request, HTTPResponse *response);
   virtual void put(HTTPRequest *request, HTTPResponse *response);
   virtual void del(HTTPRequest *request, HTTPResponse *response);
+  virtual void post(HTTPRequest *request, HTTPResponse *response);
+  virtual void move(HTTPRequest *request, HTTPResponse *response);
+
+  // One operation of a POST ?batch body
+  struct BatchOperation {
+    std::string method;
+    std::string path;
+    std::string body;
+  };
+
+  // Splits a batch body into its operations, throws a 400 if it is malformed
+  static std::vector<BatchOperation> parseBatch(const std::string &body);
 
 private:
+  // Inode numbers of directories already resolved, keyed by /a/b path
+  typedef std::map<std::string, int> PathCache;
+  typedef void (DistributedFileSystemService::*Handler)(HTTPRequest *request, HTTPResponse *response);
+
+  // Where a prefix listing has got to
+  struct ListState {
+    std::string prefix;
+    bool delimited;
+    std::string after;
+    int maxKeys;
+    std::vector<std::string> keys;
+    bool truncated;
+  };
+
+  std::vector<std::string> splitPath(std::string path);
+  std::vector<std::string> pathNames(HTTPRequest *request);
+  std::string objectPath(std::vector<std::string> &names);
+  void applyMutation(HTTPRequest *request, HTTPResponse *response, Handler handler);
+  void logMutation(std::string method, std::string path, std::string body, std::string destination);
+  void putObject(HTTPRequest *request, HTTPResponse *response);
+  void deleteObject(HTTPRequest *request, HTTPResponse *response);
+  void moveObject(HTTPRequest *request, HTTPResponse *response);
+  void postObject(HTTPRequest *request, HTTPResponse *response);
+  int lookupPath(std::vector<std::string> &names, int count, PathCache *cache = NULL);
+  int resolve(std::vector<std::string> &names, int count, PathCache *cache = NULL);
+  std::string etagFor(int inodeNumber, inode_t &inode);
+  bool etagMatches(std::string header, std::string etag, bool weak);
+  ClientError errorFor(int ret);
+  std::string renderListing(int inodeNumber);
+  std::string listingFor(int inodeNumber);
+  int makeDirectories(std::vector<std::string> &names, int count, PathCache *cache);
+  int writeFile(std::vector<std::string> &names, const std::string &data, PathCache *cache);
+  int removeEntry(std::vector<std::string> &names, PathCache *cache);
+  void patchObject(HTTPRequest *request, HTTPResponse *response, std::map<std::string, std::string> &params);
+  std::map<std::string, std::string> queryParams(HTTPRequest *request);
+  void listObjects(int inodeNumber, std::map<std::string, std::string> &params, HTTPResponse *response);
+  bool listKeys(int inodeNumber, std::string keyPrefix, ListState &state);
+  void refreshMerkle();
+  uint64_t merkleHash(int inodeNumber, int parent);
+  void merkleListing(int inodeNumber, inode_t &inode, HTTPResponse *response);
+
   LocalFileSystem *fileSystem;
+  uint64_t epoch;
+
+  Replicator *replicator;
+  // What the current request committed, for the replicator
+  std::vector<Mutation> mutations;
+  // The primary this node last applied changes from, and how far it got
+  std::string replicaEpoch;
+  unsigned long long replicaApplied;
+
+  // Rendered GET bodies for directories, valid while the directory's
+  // change count still matches
+  struct CachedListing {
+    unsigned long long changeCount;
+    std::string body;
+  };
+  std::map<int, CachedListing> listingCache;
+
+  // Content hash of every object and directory hashed so far. A change
+  // clears valid on the inode and each directory above it, so only those
+  // are hashed again. parent is where the inode was last seen
+  struct MerkleNode {
+    uint64_t hash;
+    int parent;
+    bool valid;
+  };
+  std::map<int, MerkleNode> merkleTree;
 };
 
 #endif
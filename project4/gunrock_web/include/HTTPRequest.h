@@ -25,6 +25,7 @@ public:
   std::string getPath();
   std::vector<std::string> getPathComponents();
   std::string getHeader(std::string key);
+  bool hasHeader(std::string key);
   bool hasAuthToken();
   std::string getAuthToken();
   bool isConnect();
@@ -35,6 +36,7 @@ public:
   bool isDelete() {return m_http->isDelete();}
   bool isMove() {return m_http->isMove();}
   std::map<std::string, std::string> getParams();
+  std::string getQuery() {return m_http->getQuery();}
   WwwFormEncodedDict formEncodedBody();
   std::string getBody() {return m_http->getBody();}
   
@@ -4,10 +4,29 @@
 #include <map>
 #include <string>
 
+/**
+ * Produces a response body a piece at a time.
+ *
+ * gunrock sends the headers, then calls produce() until it returns 0 and
+ * writes each piece as one chunk of a chunked transfer-encoding, so the
+ * whole body never has to sit in memory.
+ */
+class BodyProducer {
+ public:
+  virtual ~BodyProducer() {}
+
+  // Fills up to size bytes of buffer, returns how many, 0 at the end
+  virtual int produce(char *buffer, int size) = 0;
+};
+
 class HTTPResponse {
  public:
   HTTPResponse();
+  ~HTTPResponse();
   void withStreaming();
+  // Streams the body from producer, the response owns and deletes it
+  void setBodyProducer(BodyProducer *producer);
+  BodyProducer *getBodyProducer();
   void setHeader(std::string name, std::string value);
   void setBody(std::string data);
   void setContentType(std::string contentType);
@@ -23,6 +42,7 @@ class HTTPResponse {
   std::map<std::string, std::string> headers;
   std::string body;
   std::string contentType;
+  BodyProducer *producer;
 };
 
 #endif
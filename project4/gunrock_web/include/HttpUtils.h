@@ -23,6 +23,7 @@ class HttpUtils {
   static std::vector<std::string> split(const std::string &s, char delim);
 
  private:
+  static std::string urldecode(const std::string &str, const std::string &query);
   static std::vector<std::string> &split(const std::string &s,
 					 char delim,
 					 std::vector<std::string> &elems);
@@ -1,7 +1,9 @@
 #ifndef _LOCAL_FILE_SYSTEM_H_
 #define _LOCAL_FILE_SYSTEM_H_
 
+#include <set>
 #include <string>
+#include <vector>
 
 #include "Disk.h"
 #include "ufs.h"
@@ -43,6 +45,12 @@
 #define EINVALIDTYPE       (9)
 // Unlinking '.' or '..'
 #define EUNLINKNOTALLOWED  (10)
+// Moving a directory underneath itself
+#define EMOVEINTOSELF      (11)
+
+// unlink compacts a directory once this percentage of its entry slots
+// are tombstones (inum == -1) and packing the live entries frees a block
+#define DIR_COMPACT_THRESHOLD_PERCENT (50)
 
 class LocalFileSystem {
  public:
@@ -99,6 +107,30 @@ class LocalFileSystem {
    */
   int write(int inodeNumber, const void *buffer, int size);
 
+  /**
+   * Overwrite part of a file.
+   *
+   * Writes size bytes from buffer at byte offset of the file, growing it
+   * if the write runs past the end. Only the blocks the range covers are
+   * written, blocks past the old end are allocated, and the inode is
+   * updated in place if its size or blocks change. offset may be at most
+   * the current size, files don't have holes.
+   *
+   * Success: number of bytes written
+   * Failure: -EINVALIDINODE, -EINVALIDSIZE, -EINVALIDTYPE, -ENOTENOUGHSPACE.
+   * Failure modes: invalid inodeNumber, invalid size or offset, the
+   * result would be larger than MAX_FILE_SIZE, not a regular file.
+   */
+  int patch(int inodeNumber, const void *buffer, int size, int offset);
+
+  /**
+   * Add to the end of a file, patch at the current size.
+   *
+   * Success: number of bytes written
+   * Failure: as for patch.
+   */
+  int append(int inodeNumber, const void *buffer, int size);
+
   /**
    * Read the contents of a file or directory.
    *
@@ -126,6 +158,41 @@ class LocalFileSystem {
    * a failure by our definition. You can't unlink '.' or '..'
    */
   int unlink(int parentInodeNumber, std::string name);
+
+  /**
+   * Rename or move a file or directory.
+   *
+   * Moves the entry srcName in srcParentInodeNumber to dstName in
+   * dstParentInodeNumber. Only directory entries change, the data stays
+   * where it is. A directory that changes parent gets its .. updated. An
+   * existing destination of the same type is replaced, as long as it is
+   * not a directory with entries in it. The writes run inside a Disk
+   * transaction; if the caller already has one open they become part of it.
+   *
+   * Success: 0
+   * Failure: -EINVALIDINODE, -EINVALIDNAME, -ENOTFOUND, -EINVALIDTYPE,
+   *          -EDIRNOTEMPTY, -EMOVEINTOSELF, -ENOTENOUGHSPACE
+   * Failure modes: either parent is not a directory, a name is invalid or
+   * is '.' or '..', srcName does not exist, the destination exists with
+   * the other type or is a directory that isn't empty, or the destination
+   * is inside the directory being moved.
+   */
+  int rename(int srcParentInodeNumber, std::string srcName, int dstParentInodeNumber, std::string dstName);
+
+  /**
+   * Compact a directory.
+   *
+   * Packs the live entries of the directory specified by inodeNumber
+   * into as few blocks as possible, dropping tombstoned (inum == -1)
+   * slots, and returns the blocks that are no longer needed to the data
+   * bitmap. The writes run inside a Disk transaction; if the caller
+   * already has one open they become part of it.
+   *
+   * Success: number of data blocks freed
+   * Failure: -EINVALIDINODE
+   * Failure modes: inodeNumber does not exist or is not a directory.
+   */
+  int compactDirectory(int inodeNumber);
   
   /**
    * Some helper functions that you need to implement and use in your
@@ -150,11 +217,42 @@ class LocalFileSystem {
   void writeDataBitmap(super_t *super, unsigned char *dataBitmap);
   void readInodeRegion(super_t *super, inode_t *inodes);
   void writeInodeRegion(super_t *super, inode_t *inodes);
+  // Rewrites only the inode region block holding this inode
+  void writeInode(super_t *super, int inodeNumber, inode_t *inode);
+
+  // Read every entry slot of a directory, including tombstones
+  int readDirectory(int inodeNumber, inode_t *inode, std::vector<dir_ent_t> &entries);
+
+  /**
+   * How many times this object has changed an inode or its data.
+   *
+   * create, unlink, write and compactDirectory bump the count of every
+   * inode they modify, including the parent directory. Counts only grow,
+   * even across a Disk rollback, so anything cached against a count is
+   * stale exactly when the count moves. Counts start at 0 for each
+   * LocalFileSystem and do not see changes made by other processes.
+   */
+  unsigned long long changeCount(int inodeNumber);
+
+  // The inodes whose count moved since the last call, in inode order
+  std::vector<int> takeChanges();
 
   // Normally we'd mark this as private but we expose it so that you can access
   // it in a function you add that is not part of the LocalFileSystem object but
   // can still access the disk.
   Disk *disk;
+
+ private:
+  int allocateInode(super_t *super, unsigned char *inodeBitmap);
+  int allocateDataBlock(super_t *super, unsigned char *dataBitmap);
+  void freeDataBlock(super_t *super, unsigned char *dataBitmap, int blockNumber);
+  void writeDirectoryBlock(inode_t *inode, std::vector<dir_ent_t> &entries, int blockIndex);
+  int findFreeSlot(inode_t *inode, std::vector<dir_ent_t> &entries, bool *grow);
+  bool shouldCompact(std::vector<dir_ent_t> &entries);
+  void touch(int inodeNumber);
+
+  std::vector<unsigned long long> changeCounts;
+  std::set<int> changed;
 };  
 
 #endif
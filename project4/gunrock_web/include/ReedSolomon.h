@@ -0,0 +1,58 @@
+#ifndef _REEDSOLOMON_H_
+#define _REEDSOLOMON_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Systematic Reed-Solomon erasure code over GF(2^8).
+ *
+ * An object is cut into dataShards equal shards and parityShards more are
+ * computed from them, so any dataShards of the dataShards + parityShards
+ * shards give the object back. The encoding matrix is the identity over a
+ * Cauchy matrix, every square submatrix of which is invertible, so any
+ * choice of surviving shards decodes.
+ *
+ * Multiplication goes through a 64 KB product table: scaling a shard by a
+ * constant is one table row lookup per byte, which is what all encoding
+ * and decoding time is spent on.
+ */
+class ReedSolomon {
+ public:
+  // dataShards + parityShards may be at most 256
+  ReedSolomon(int dataShards, int parityShards);
+
+  int dataShards() { return numData; }
+  int parityShards() { return numParity; }
+
+  // Cuts data into dataShards shards of equal size, the last one padded
+  // with zeros, and appends the parity shards
+  std::vector<std::string> encode(const std::string &data);
+
+  /**
+   * Rebuilds the missing data shards.
+   *
+   * shards holds every shard, all the same size where present[i] is true.
+   * Returns false if fewer than dataShards are present; otherwise the
+   * first dataShards entries are all filled in.
+   */
+  bool reconstruct(std::vector<std::string> &shards, std::vector<bool> &present);
+
+ private:
+  static uint8_t multiply(uint8_t a, uint8_t b);
+  static uint8_t inverse(uint8_t a);
+  // out ^= c * in, byte by byte
+  static void multiplyAdd(uint8_t c, const uint8_t *in, uint8_t *out, size_t length);
+  static bool invert(std::vector<uint8_t> &matrix, int size);
+  static void buildTables();
+
+  int numData;
+  int numParity;
+  // Row major, (numData + numParity) x numData
+  std::vector<uint8_t> matrix;
+};
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _REPLICATOR_H_
+#define _REPLICATOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+// One committed change, as the request that makes it again on a replica
+struct Mutation {
+  std::string method;
+  std::string path;
+  std::string body;
+  std::string destination;
+};
+
+/**
+ * Ships a node's committed ds3 mutations to its backup nodes.
+ *
+ * Mutations go into an ordered in-memory log and are sent to each peer in
+ * log order as ordinary ds3 requests carrying X-Ds3-Replica: epoch:seq.
+ * The peer applies each sequence number once and in order; when it is
+ * behind or ahead it answers with X-Ds3-Replica-Applied and the sender
+ * resumes from there. A background thread keeps pushing to peers that are
+ * behind, so a peer that was down catches up once it is back.
+ *
+ * Entries every peer has are dropped from the log, and so are the oldest
+ * ones once the log holds more than a bounded number of body bytes, so a
+ * peer that stays down can't grow it without limit. A peer restarted on
+ * its own image picks up where it left off unless it fell behind what is
+ * still logged; that one, like one given an older image, has to be
+ * brought up to date with ds3sync first.
+ */
+class Replicator {
+ public:
+  // peers are host:port, quorum counts this node too
+  Replicator(std::vector<std::string> peers, int quorum);
+
+  int quorum() { return writeQuorum; }
+
+  // Adds to the log and returns its sequence number
+  unsigned long long record(Mutation &mutation);
+
+  // Brings peers up to seq until enough have it for the quorum, returns
+  // the number of nodes that have it, this one included
+  int replicate(unsigned long long seq);
+
+ private:
+  struct Peer {
+    std::string host;
+    int port;
+    unsigned long long acked;
+    pthread_mutex_t sending;
+  };
+
+  bool sync(int peer, unsigned long long seq);
+  void trim();
+  static void *catchUp(void *arg);
+
+  std::vector<Peer *> peers;
+  int writeQuorum;
+  std::string epoch;
+
+  // Guards the log, nextSeq and every peer's acked
+  pthread_mutex_t lock;
+  pthread_cond_t recorded;
+  std::deque<Mutation> log;
+  // Body bytes of the entries in the log
+  size_t logBytes;
+  unsigned long long firstSeq;
+  unsigned long long nextSeq;
+};
+
+#endif
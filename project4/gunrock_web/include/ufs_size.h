@@ -0,0 +1,16 @@
+#ifndef __ufs_size_h__
+#define __ufs_size_h__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// parses "4096", "64K", "1M", "64G", "2T", ... with binary multipliers and
+// an optional B after the suffix, -1 if arg isn't a size
+long long ufs_parse_size(const char *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ufs_size_h__
@@ -1,35 +1,73 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "ufs.h"
+#include "ufs_size.h"
 
 void usage() {
-    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>]\n");
+    fprintf(stderr, "usage: mkfs -f <image_file> [-d <num_data_blocks] [-i <num_inodes>] [-s <image_size>] [-F] [-a] [-v]\n");
+    fprintf(stderr, "  numbers and sizes take K, M, G and T suffixes (powers of 1024)\n");
+    fprintf(stderr, "  -s  size the data region so the whole image is <image_size> bytes\n");
+    fprintf(stderr, "  -F  fast mode, create a sparse image and only write non-zero blocks\n");
+    fprintf(stderr, "  -a  with -F, reserve the image's space with posix_fallocate\n");
     exit(1);
 }
 
+long long parse_size(const char *arg) {
+    long long value = ufs_parse_size(arg);
+    if (value < 0)
+	usage();
+    return value;
+}
+
+int blocks_for(long long count, int per_block) {
+    return (int) ((count + per_block - 1) / per_block);
+}
+
+// writes len bytes at block, exits on a short write
+void write_block(int fd, const void *buf, int len, int block) {
+    int rc = pwrite(fd, buf, len, (off_t) block * UFS_BLOCK_SIZE);
+    if (rc != len) {
+	perror("write");
+	exit(1);
+    }
+}
+
 int main(int argc, char *argv[]) {
     int ch;
     char *image_file = NULL;
-    int num_inodes = 32;
-    int num_data = 32;
+    long long num_inodes = 32;
+    long long num_data = 32;
+    long long image_size = 0;
     int visual = 0;
+    int fast = 0;
+    int preallocate = 0;
 
-    while ((ch = getopt(argc, argv, "i:d:f:v")) != -1) {
+    while ((ch = getopt(argc, argv, "i:d:f:s:Fav")) != -1) {
 	switch (ch) {
 	case 'i':
-	    num_inodes = atoi(optarg);
+	    num_inodes = parse_size(optarg);
 	    break;
 	case 'd':
-	    num_data = atoi(optarg);
+	    num_data = parse_size(optarg);
 	    break;
 	case 'f':
 	    image_file = optarg;
 	    break;
+	case 's':
+	    image_size = parse_size(optarg);
+	    break;
+	case 'F':
+	    fast = 1;
+	    break;
+	case 'a':
+	    preallocate = 1;
+	    break;
 	case 'v':
 	    visual = 1;
 	    break;
@@ -42,50 +80,57 @@ int main(int argc, char *argv[]) {
 
     if (image_file == NULL)
 	usage();
-
-    unsigned char *empty_buffer;
-    empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
-    if (empty_buffer == NULL) {
-	perror("calloc");
-	exit(1);
+    if (preallocate && !fast) {
+	fprintf(stderr, "mkfs: -a only applies with -F\n");
+	usage();
     }
 
-    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-	perror("open");
+    if (num_inodes < 1 || num_inodes > INT_MAX) {
+	fprintf(stderr, "mkfs: need between 1 and %d inodes\n", INT_MAX);
 	exit(1);
     }
 
-    assert(num_inodes >= 32);
-    assert(num_data >= 32);
-
     // presumed: block 0 is the super block
     super_t s;
 
-    // totals
-    s.num_inodes = num_inodes;
-    s.num_data = num_data;
-
     // inode bitmap
     int bits_per_block = (8 * UFS_BLOCK_SIZE); // remember, there are 8 bits per byte
 
+    s.num_inodes = num_inodes;
     s.inode_bitmap_addr = 1;
-    s.inode_bitmap_len = num_inodes / bits_per_block;
-    if (num_inodes % bits_per_block != 0)
-	s.inode_bitmap_len++;
+    s.inode_bitmap_len = blocks_for(num_inodes, bits_per_block);
+    s.inode_region_len = blocks_for(num_inodes * sizeof(inode_t), UFS_BLOCK_SIZE);
+
+    // with an image size, the data region gets whatever the metadata leaves over;
+    // its bitmap shrinks the region in turn, so take the smallest bitmap that
+    // covers the rest. Iterating to a fixed point can flip between two lengths
+    if (image_size > 0) {
+	long long total = image_size / UFS_BLOCK_SIZE;
+	long long left = total - 1 - s.inode_bitmap_len - s.inode_region_len;
+	long long data_bitmap_len = left > 0 ? left / (bits_per_block + 1) : 0;
+	while (left - data_bitmap_len > 0 && blocks_for(left - data_bitmap_len, bits_per_block) > data_bitmap_len)
+	    data_bitmap_len++;
+	num_data = left - data_bitmap_len;
+    }
+
+    if (num_data < 1) {
+	fprintf(stderr, "mkfs: no room for data blocks\n");
+	exit(1);
+    }
+    if (1 + s.inode_bitmap_len + s.inode_region_len + blocks_for(num_data, bits_per_block) + num_data > INT_MAX) {
+	fprintf(stderr, "mkfs: image would have more than %d blocks\n", INT_MAX);
+	exit(1);
+    }
+
+    // totals
+    s.num_data = num_data;
 
     // data bitmap
     s.data_bitmap_addr = s.inode_bitmap_addr + s.inode_bitmap_len;
-    s.data_bitmap_len = num_data / bits_per_block;
-    if (num_data % bits_per_block != 0)
-	s.data_bitmap_len++;
+    s.data_bitmap_len = blocks_for(num_data, bits_per_block);
 
     // inode table
     s.inode_region_addr = s.data_bitmap_addr + s.data_bitmap_len;
-    int total_inode_bytes = num_inodes * sizeof(inode_t);
-    s.inode_region_len = total_inode_bytes / UFS_BLOCK_SIZE;
-    if (total_inode_bytes % UFS_BLOCK_SIZE != 0)
-	s.inode_region_len++;
 
     // data blocks
     s.data_region_addr = s.inode_region_addr + s.inode_region_len;
@@ -93,6 +138,12 @@ int main(int argc, char *argv[]) {
 
     int total_blocks = 1 + s.inode_bitmap_len + s.data_bitmap_len + s.inode_region_len + s.data_region_len;
 
+    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+	perror("open");
+	exit(1);
+    }
+
     // super block is the first block
     int rc = pwrite(fd, &s, sizeof(super_t), 0);
     if (rc != sizeof(super_t)) {
@@ -101,20 +152,38 @@ int main(int argc, char *argv[]) {
     }
 
     printf("total blocks        %d\n", total_blocks);
-    printf("  inodes            %d [size of each: %lu]\n", num_inodes, sizeof(inode_t));
-    printf("  data blocks       %d\n", num_data);
+    printf("  inodes            %d [size of each: %lu]\n", s.num_inodes, sizeof(inode_t));
+    printf("  data blocks       %d\n", s.num_data);
     printf("layout details\n");
     printf("  inode bitmap address/len %d [%d]\n", s.inode_bitmap_addr, s.inode_bitmap_len);
     printf("  data bitmap address/len  %d [%d]\n", s.data_bitmap_addr, s.data_bitmap_len);
 
     // first, zero out all the blocks
     int i;
-    for (i = 1; i < total_blocks; i++) {
-	rc = pwrite(fd, empty_buffer, UFS_BLOCK_SIZE, i * UFS_BLOCK_SIZE);
-	if (rc != UFS_BLOCK_SIZE) {
-	    perror("write");
+    if (fast) {
+	// a file extended with ftruncate reads back as zeros without
+	// writing them, so only the non-zero blocks below hit the disk
+	if (ftruncate(fd, (off_t) total_blocks * UFS_BLOCK_SIZE) != 0) {
+	    perror("ftruncate");
+	    exit(1);
+	}
+	if (preallocate) {
+	    rc = posix_fallocate(fd, 0, (off_t) total_blocks * UFS_BLOCK_SIZE);
+	    if (rc != 0) {
+		fprintf(stderr, "posix_fallocate: %s\n", strerror(rc));
+		exit(1);
+	    }
+	}
+    } else {
+	unsigned char *empty_buffer;
+	empty_buffer = calloc(UFS_BLOCK_SIZE, 1);
+	if (empty_buffer == NULL) {
+	    perror("calloc");
 	    exit(1);
 	}
+	for (i = 1; i < total_blocks; i++)
+	    write_block(fd, empty_buffer, UFS_BLOCK_SIZE, i);
+	free(empty_buffer);
     }
 
     //
@@ -130,15 +199,13 @@ int main(int argc, char *argv[]) {
 	b.bits[i] = 0;
     b.bits[0] = 0x1; // first entry is allocated
     
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    write_block(fd, &b, UFS_BLOCK_SIZE, s.inode_bitmap_addr);
 
     //
     // need to allocate first data block in data bitmap
     // (can just reuse this to write out data bitmap too)
     //
-    rc = pwrite(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    write_block(fd, &b, UFS_BLOCK_SIZE, s.data_bitmap_addr);
 
     //
     // need to write out inode
@@ -148,14 +215,14 @@ int main(int argc, char *argv[]) {
     } inode_block;
 
     inode_block itable;
+    memset(&itable, 0, sizeof(itable));
     itable.inodes[0].type = UFS_DIRECTORY;
     itable.inodes[0].size = 2 * sizeof(dir_ent_t); // in bytes
     itable.inodes[0].direct[0] = s.data_region_addr;
     for (i = 1; i < DIRECT_PTRS; i++)
 	itable.inodes[0].direct[i] = -1;
 
-    rc = pwrite(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    write_block(fd, &itable, UFS_BLOCK_SIZE, s.inode_region_addr);
 
     // 
     // need to write out root directory contents to first data block
@@ -168,6 +235,7 @@ int main(int argc, char *argv[]) {
     assert(sizeof(dir_ent_t) * 128 == UFS_BLOCK_SIZE);
 
     dir_block_t parent;
+    memset(&parent, 0, sizeof(parent));
     strcpy(parent.entries[0].name, ".");
     parent.entries[0].inum = 0;
 
@@ -177,8 +245,7 @@ int main(int argc, char *argv[]) {
     for (i = 2; i < 128; i++)
 	parent.entries[i].inum = -1;
 
-    rc = pwrite(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr * UFS_BLOCK_SIZE);
-    assert(rc == UFS_BLOCK_SIZE);
+    write_block(fd, &parent, UFS_BLOCK_SIZE, s.data_region_addr);
 
     if (visual) {
 	int i;
@@ -5,25 +5,48 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/time.h>
 
 #include <sstream>
+#include <algorithm>
 
 using namespace std;
 
 HTTPClientResponse::HTTPClientResponse(MySocket *sock) {
     m_sock = sock;
     m_status_code = 0;
+    m_complete = false;
 }
 
+static long long nowMicros() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000LL + now.tv_usec;
+}
 
-string HTTPClientResponse::readResponse() {
+string HTTPClientResponse::readResponse(int timeout_ms) {
   string full_response;
+  long long deadline = timeout_ms > 0 ? nowMicros() + timeout_ms * 1000LL : 0;
+  bool timedOut = false;
 
   while (true) {
+    // The socket timeout is per read, so a server trickling bytes would
+    // otherwise keep the whole read going long past it
+    if (deadline != 0) {
+      long long remaining = deadline - nowMicros();
+      if (remaining <= 0) {
+        timedOut = true;
+        break;
+      }
+      m_sock->set_timeout(max(1LL, (remaining + 999) / 1000));
+    }
     string response;
     try {
       response = m_sock->read();
     } catch (...) {
+      timedOut = deadline != 0 && nowMicros() >= deadline;
       break;
     }
 
@@ -41,12 +64,64 @@ string HTTPClientResponse::readResponse() {
 
   string line;
   while (getline(header_stream, line)) {
+    if (line.size() > 0 && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
     if (line.find("HTTP/1.1 ") == 0 || line.find("HTTP/1.0") == 0) {
       stringstream header_line(line);
       string http;
       header_line >> http >> m_status_code >> m_status_message;
+    } else if (line.find(':') != string::npos) {
+      size_t colon = line.find(':');
+      size_t value = line.find_first_not_of(' ', colon + 1);
+      m_headers[line.substr(0, colon)] = value == string::npos ? "" : line.substr(value);
     }
   }
+
+  string length = header("Content-Length");
+  if (header("Transfer-Encoding") == "chunked") {
+    m_body = decodeChunked(m_body, m_complete);
+  } else if (length != "") {
+    m_complete = m_body.size() >= strtoul(length.c_str(), NULL, 10);
+  } else {
+    m_complete = true;
+  }
+  m_complete = m_complete && !timedOut;
   
   return m_body;
 }
+
+string HTTPClientResponse::header(string key) {
+  map<string, string>::iterator iter;
+  for (iter = m_headers.begin(); iter != m_headers.end(); iter++) {
+    if (strcasecmp(iter->first.c_str(), key.c_str()) == 0) {
+      return iter->second;
+    }
+  }
+  return "";
+}
+
+// Joins the chunks of a chunked transfer-encoding back into one body,
+// complete says whether the terminating 0-size chunk arrived
+string HTTPClientResponse::decodeChunked(string encoded, bool &complete) {
+  string decoded;
+  size_t position = 0;
+  complete = false;
+  while (position < encoded.size()) {
+    size_t lineEnd = encoded.find("\r\n", position);
+    if (lineEnd == string::npos) {
+      break;
+    }
+    size_t length = strtoul(encoded.substr(position, lineEnd - position).c_str(), NULL, 16);
+    if (length == 0) {
+      complete = true;
+      break;
+    }
+    if (lineEnd + 2 + length > encoded.size()) {
+      break;
+    }
+    decoded.append(encoded, lineEnd + 2, length);
+    position = lineEnd + 2 + length + 2;
+  }
+  return decoded;
+}
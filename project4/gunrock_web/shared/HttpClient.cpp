@@ -3,17 +3,42 @@
 #include "MySslSocket.h"
 #include "Base64.h"
 
+#include <deque>
 #include <sstream>
+#include <algorithm>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 using namespace std;
 
+// Recent attempt latencies kept for the hedge delay
+#define LATENCY_WINDOW (128)
+// Hedging waits for this many latencies before trusting the p95
+#define HEDGE_MIN_SAMPLES (20)
+// Pause before the first retry, doubled for each one after it
+#define RETRY_BACKOFF_MS (10)
+
 HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls) {
   if (use_tls) {
     connection = new MySslSocket(inet_addr, port);
   } else {
     connection = new MySocket(inet_addr, port);
   }
-  
+  init(inet_addr, port);
+}
+
+HttpClient::HttpClient(const char *inet_addr, int port, bool use_tls, int timeout_ms) {
+  if (use_tls) {
+    connection = new MySslSocket(inet_addr, port, timeout_ms);
+  } else {
+    connection = new MySocket(inet_addr, port, timeout_ms);
+  }
+  init(inet_addr, port);
+}
+
+void HttpClient::init(const char *inet_addr, int port) {
   stringstream host;
   host << inet_addr << ":" << port;
   headers["Host"] = host.str();
@@ -66,9 +91,9 @@ void HttpClient::write_request(string path, string method, string body) {
 
 
 
-HTTPClientResponse *HttpClient::read_response() {
+HTTPClientResponse *HttpClient::read_response(int timeout_ms) {
   HTTPClientResponse *response = new HTTPClientResponse(connection);
-  response->readResponse();
+  response->readResponse(timeout_ms);
   return response;
 }
 
@@ -91,3 +116,297 @@ HTTPClientResponse *HttpClient::del(string path) {
   write_request(path, "DELETE", "");
   return read_response();
 }
+
+static pthread_mutex_t latencyLock = PTHREAD_MUTEX_INITIALIZER;
+static long long latencies[LATENCY_WINDOW];
+static int latencyCount = 0;
+
+static long long nowMicros() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec * 1000000LL + now.tv_usec;
+}
+
+static void recordLatency(long long micros) {
+  pthread_mutex_lock(&latencyLock);
+  latencies[latencyCount % LATENCY_WINDOW] = micros;
+  latencyCount++;
+  pthread_mutex_unlock(&latencyLock);
+}
+
+// The p95 of the recent latencies, -1 until there are enough of them
+static long long hedgeDelay() {
+  pthread_mutex_lock(&latencyLock);
+  vector<long long> window(latencies, latencies + min(latencyCount, LATENCY_WINDOW));
+  pthread_mutex_unlock(&latencyLock);
+  if (window.size() < HEDGE_MIN_SAMPLES) {
+    return -1;
+  }
+  vector<long long>::iterator p95 = window.begin() + window.size() * 95 / 100;
+  nth_element(window.begin(), p95, window.end());
+  return *p95;
+}
+
+static bool idempotent(const string &method) {
+  return method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+}
+
+static bool safe(const string &method) {
+  return method == "GET" || method == "HEAD" || method == "OPTIONS";
+}
+
+// A response that another try may do better than. A mutation that got any
+// answer is never tried again, the server may have applied it
+static bool failed(HTTPClientResponse *response, const string &method) {
+  if (response == NULL) {
+    return true;
+  }
+  if (!safe(method)) {
+    return false;
+  }
+  return response->status() == 502 || response->status() == 503 || response->status() == 504;
+}
+
+// Milliseconds an attempt started now may take, 0 for no limit
+static int attemptTimeout(long long deadline) {
+  if (deadline == 0) {
+    return 0;
+  }
+  return max(1LL, (deadline - nowMicros() + 999) / 1000);
+}
+
+// One try at one replica, NULL if it didn't answer in full by the deadline
+static HTTPClientResponse *attempt(const string &replica, const string &method, const string &path,
+                                   const string &body, const map<string, string> &headers, long long deadline) {
+  long long start = nowMicros();
+  try {
+    size_t colon = replica.rfind(':');
+    HttpClient client(replica.substr(0, colon).c_str(), atoi(replica.substr(colon + 1).c_str()), false,
+                      attemptTimeout(deadline));
+    map<string, string>::const_iterator iter;
+    for (iter = headers.begin(); iter != headers.end(); iter++) {
+      client.set_header(iter->first, iter->second);
+    }
+    client.write_request(path, method, body);
+    HTTPClientResponse *response = client.read_response(attemptTimeout(deadline));
+    // A HEAD answer has a Content-Length but no body
+    if (response->status() == 0 || (method != "HEAD" && !response->complete())) {
+      delete response;
+      return NULL;
+    }
+    if (!failed(response, method)) {
+      recordLatency(nowMicros() - start);
+    }
+    return response;
+  } catch (...) {
+    return NULL;
+  }
+}
+
+// What the attempts of one hedged send share. The last of the caller and
+// the attempt threads to let go of it frees it.
+struct Flight {
+  string method;
+  string path;
+  string body;
+  map<string, string> headers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t landed;
+  // Responses not looked at yet, NULL for an attempt that got none
+  deque<HTTPClientResponse *> results;
+  int refs;
+  bool abandoned;
+};
+
+struct FlightAttempt {
+  Flight *flight;
+  string replica;
+  long long deadline;
+};
+
+static void release(Flight *flight) {
+  bool last = --flight->refs == 0;
+  pthread_mutex_unlock(&flight->lock);
+  if (last) {
+    pthread_mutex_destroy(&flight->lock);
+    pthread_cond_destroy(&flight->landed);
+    delete flight;
+  }
+}
+
+static void *flightAttempt(void *arg) {
+  FlightAttempt *args = (FlightAttempt *) arg;
+  Flight *flight = args->flight;
+  HTTPClientResponse *response = attempt(args->replica, flight->method, flight->path, flight->body,
+                                         flight->headers, args->deadline);
+  delete args;
+
+  pthread_mutex_lock(&flight->lock);
+  if (flight->abandoned) {
+    delete response; // Another attempt won
+  } else {
+    flight->results.push_back(response);
+    pthread_cond_signal(&flight->landed);
+  }
+  release(flight);
+  return NULL;
+}
+
+// Starts an attempt on its own thread, call with the flight locked
+static bool launch(Flight *flight, const string &replica, long long deadline) {
+  FlightAttempt *args = new FlightAttempt();
+  args->flight = flight;
+  args->replica = replica;
+  args->deadline = deadline;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, flightAttempt, args) != 0) {
+    delete args;
+    return false;
+  }
+  pthread_detach(thread);
+  flight->refs++;
+  return true;
+}
+
+// Sleeps before retry number `retry`, not past the deadline
+static void backoff(int retry, long long deadline) {
+  long long pause = (long long) RETRY_BACKOFF_MS * 1000 << min(retry, 10);
+  if (deadline != 0) {
+    pause = min(pause, deadline - nowMicros());
+  }
+  if (pause > 0) {
+    usleep(pause);
+  }
+}
+
+HTTPClientResponse *HttpClient::send(const vector<string> &replicas, string method, string path, string body,
+                                     const map<string, string> &headers, const RequestPolicy &policy) {
+  if (replicas.empty()) {
+    throw SocketError("no replicas to send to");
+  }
+  bool repeatable = idempotent(method);
+  int attempts = 1 + (repeatable ? max(0, policy.retries) : 0);
+  long long start = nowMicros();
+  long long deadline = policy.deadline_ms > 0 ? start + policy.deadline_ms * 1000LL : 0;
+  HTTPClientResponse *last = NULL;
+
+  if (!policy.hedge || !repeatable || replicas.size() < 2) {
+    for (int i = 0; i < attempts; i++) {
+      if (i > 0) {
+        backoff(i - 1, deadline);
+      }
+      if (deadline != 0 && nowMicros() >= deadline) {
+        break;
+      }
+      HTTPClientResponse *response = attempt(replicas[i % replicas.size()], method, path, body, headers, deadline);
+      if (!failed(response, method)) {
+        delete last;
+        return response;
+      }
+      if (response != NULL) {
+        delete last;
+        last = response;
+      }
+    }
+    if (last != NULL) {
+      return last;
+    }
+    throw SocketError("no replica answered");
+  }
+
+  Flight *flight = new Flight();
+  flight->method = method;
+  flight->path = path;
+  flight->body = body;
+  flight->headers = headers;
+  pthread_mutex_init(&flight->lock, NULL);
+  pthread_cond_init(&flight->landed, NULL);
+  flight->refs = 1;
+  flight->abandoned = false;
+
+  long long delay = hedgeDelay();
+  long long hedgeAt = delay >= 0 ? start + delay : 0;
+  bool hedged = false;
+  int sent = 0;
+  int outstanding = 0;
+  int retries = 0;
+  HTTPClientResponse *winner = NULL;
+
+  pthread_mutex_lock(&flight->lock);
+  if (launch(flight, replicas[0], deadline)) {
+    sent++;
+    outstanding++;
+  }
+  while (outstanding > 0 || sent < attempts) {
+    while (!flight->results.empty()) {
+      HTTPClientResponse *response = flight->results.front();
+      flight->results.pop_front();
+      outstanding--;
+      if (!failed(response, method) && winner == NULL) {
+        winner = response;
+      } else if (response != NULL) {
+        delete last;
+        last = response;
+      }
+    }
+    if (winner != NULL || (deadline != 0 && nowMicros() >= deadline)) {
+      break;
+    }
+
+    if (outstanding == 0) {
+      // Everything sent so far failed, retry on the next replica
+      if (sent >= attempts) {
+        break;
+      }
+      pthread_mutex_unlock(&flight->lock);
+      backoff(retries++, deadline);
+      pthread_mutex_lock(&flight->lock);
+      if (!launch(flight, replicas[sent % replicas.size()], deadline)) {
+        break;
+      }
+      sent++;
+      outstanding++;
+      continue;
+    }
+
+    long long wake = deadline;
+    if (!hedged && hedgeAt != 0 && (wake == 0 || hedgeAt < wake)) {
+      wake = hedgeAt;
+    }
+    if (wake == 0) {
+      pthread_cond_wait(&flight->landed, &flight->lock);
+    } else {
+      struct timespec until;
+      until.tv_sec = wake / 1000000;
+      until.tv_nsec = (wake % 1000000) * 1000;
+      pthread_cond_timedwait(&flight->landed, &flight->lock, &until);
+    }
+
+    // Slower than most recent requests, a copy elsewhere may beat it. The
+    // hedge doesn't count against the retries.
+    if (!hedged && hedgeAt != 0 && nowMicros() >= hedgeAt && flight->results.empty()) {
+      hedged = true;
+      if (launch(flight, replicas[sent % replicas.size()], deadline)) {
+        outstanding++;
+        attempts++;
+        sent++;
+      }
+    }
+  }
+  flight->abandoned = true;
+  while (!flight->results.empty()) {
+    delete flight->results.front();
+    flight->results.pop_front();
+  }
+  release(flight);
+
+  if (winner != NULL) {
+    delete last;
+    return winner;
+  }
+  if (last != NULL) {
+    return last;
+  }
+  throw SocketError("no replica answered");
+}
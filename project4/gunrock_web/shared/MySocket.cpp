@@ -1,6 +1,7 @@
 #include "MySocket.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
@@ -15,19 +16,27 @@ MySocket::MySocket(const char *inetAddr, int port) {
   call_connect(inetAddr, port);
 }
 
-void MySocket::call_connect(const char *inetAddr, int port) {
+MySocket::MySocket(const char *inetAddr, int port, int timeoutMs) {
+  call_connect(inetAddr, port, timeoutMs);
+}
+
+void MySocket::call_connect(const char *inetAddr, int port, int timeoutMs) {
     struct sockaddr_in server;
     struct addrinfo hints;
     struct addrinfo *res;
 
     // set up the new socket (TCP/IP)
     sockFd = socket(AF_INET,SOCK_STREAM,0);
+    // on Linux the send timeout bounds connect too
+    set_timeout(timeoutMs);
     
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     int ret = getaddrinfo(inetAddr, NULL, &hints, &res);
     if(ret != 0) {
+        ::close(sockFd);
+        sockFd = -1;
         string str;
         str = string("Could not get host ") + string(inetAddr);
         throw SocketError(str.c_str());
@@ -41,6 +50,8 @@ void MySocket::call_connect(const char *inetAddr, int port) {
     // conenct to the server
     if( connect(sockFd, (struct sockaddr *) &server,
                 sizeof(server)) == -1 ) {
+        ::close(sockFd);
+        sockFd = -1;
         throw SocketError("Did not connect to the server");
     }
 }
@@ -95,6 +106,17 @@ string MySocket::read() {
     return string(buffer, ret);
 }
 
+void MySocket::set_timeout(int timeoutMs) {
+    if (sockFd < 0) {
+      return;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sockFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
 void MySocket::close(void) {
     if(sockFd<0) return;
     
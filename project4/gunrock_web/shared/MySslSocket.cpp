@@ -29,6 +29,15 @@ void handleFailure() {
 
 MySslSocket::MySslSocket(const char *inetAddr, int port, bool debug_print_io) {
   this->debug_print_io = debug_print_io;
+  call_connect_tls(inetAddr, port, 0);
+}
+
+MySslSocket::MySslSocket(const char *inetAddr, int port, int timeoutMs, bool debug_print_io) {
+  this->debug_print_io = debug_print_io;
+  call_connect_tls(inetAddr, port, timeoutMs);
+}
+
+void MySslSocket::call_connect_tls(const char *inetAddr, int port, int timeoutMs) {
   ctx = NULL;
   ssl = NULL;
   int res;
@@ -42,7 +51,8 @@ MySslSocket::MySslSocket(const char *inetAddr, int port, bool debug_print_io) {
   ssl = SSL_new(ctx);
   if (!(ssl != NULL)) handleFailure();
   
-  call_connect(inetAddr, port);
+  // the socket timeouts are already set, so they bound the handshake too
+  call_connect(inetAddr, port, timeoutMs);
   SSL_set_fd(ssl, sockFd);
 
   res = SSL_connect(ssl);
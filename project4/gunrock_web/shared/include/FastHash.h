@@ -0,0 +1,23 @@
+#ifndef _FAST_HASH_H_
+#define _FAST_HASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * A fast non-cryptographic 64-bit hash for content comparison.
+ *
+ * Built like XXH64: the input is consumed 32 bytes at a time by four
+ * independent multiply-rotate lanes, so the compiler can keep them in
+ * flight together, then the lanes are merged and avalanched. Use it to
+ * detect changed data, not to resist an adversary.
+ */
+class FastHash {
+ public:
+  static uint64_t hash64(const void *data, size_t length, uint64_t seed = 0);
+
+  // Folds one more 64-bit value into an existing hash
+  static uint64_t combine(uint64_t hash, uint64_t value);
+};
+
+#endif
@@ -9,16 +9,27 @@
 class HTTPClientResponse {
  public:
   HTTPClientResponse(MySocket *sock);    
-  std::string readResponse();
+  // Reads until the server closes the connection, or for at most
+  // timeout_ms milliseconds when it isn't 0
+  std::string readResponse(int timeout_ms = 0);
   int status() { return m_status_code; }
   bool success() { return m_status_code >= 200 && m_status_code < 300; }
   std::string body() { return m_body; }
+  // Value of a response header, matched case-insensitively, "" if absent
+  std::string header(std::string key);
+  std::map<std::string, std::string> headers() { return m_headers; }
+  // Whether the whole body arrived: all Content-Length bytes, or the last
+  // chunk of a chunked body. Always false for a read cut off by its timeout
+  bool complete() { return m_complete; }
   
  protected:
+  std::string decodeChunked(std::string encoded, bool &complete);
+
   MySocket *m_sock;
   std::string m_body;
   std::map<std::string, std::string> m_headers;
   int m_status_code;
+  bool m_complete;
   std::string m_status_message;
 };
 
@@ -3,10 +3,35 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "HTTPClientResponse.h"
 #include "MySocket.h"
 
+/**
+ * How HttpClient::send handles one request.
+ *
+ * A deadline bounds the whole request, every attempt included. Retries
+ * and hedges send the request again, so they only apply to idempotent
+ * methods (GET, HEAD, PUT, DELETE, OPTIONS). A failed attempt is one that
+ * got no response or only part of one, or for GET, HEAD and OPTIONS got a
+ * 502, 503 or 504. A PUT or DELETE that got any answer isn't sent again:
+ * it may have been applied anyway, as by a ds3 node that commits and then
+ * answers 503 because its write quorum wasn't met. A hedge is a second
+ * copy sent to the next replica once the first has waited longer than the
+ * 95th percentile of recent requests; whichever answers first wins.
+ */
+struct RequestPolicy {
+  // Milliseconds for the whole request, 0 for no limit
+  int deadline_ms;
+  // Attempts after the first one fails
+  int retries;
+  // Send a second copy to the next replica when the first is slow
+  bool hedge;
+
+  RequestPolicy() : deadline_ms(0), retries(0), hedge(false) {}
+};
+
 class HttpClient {
  public:
   /**
@@ -23,6 +48,15 @@ class HttpClient {
    * @param port the port to connect to
    */
   HttpClient(const char *inet_addr, int port, bool use_tls=false);
+
+  /**
+   * Constructor with a timeout.
+   *
+   * Same as above, but connecting, the TLS handshake when use_tls is set,
+   * and each read and write of the socket give up after timeout_ms
+   * milliseconds.
+   */
+  HttpClient(const char *inet_addr, int port, bool use_tls, int timeout_ms);
   ~HttpClient();
 
 
@@ -95,9 +129,28 @@ class HttpClient {
   void set_header(std::string key, std::string value);
   
   void write_request(std::string path, std::string method, std::string body);
-  HTTPClientResponse *read_response();
+  // timeout_ms bounds the whole response, 0 for no limit
+  HTTPClientResponse *read_response(int timeout_ms = 0);
+
+  /**
+   * Send a request under a policy
+   *
+   * Sends method path to replicas[0], each a "host:port" holding the same
+   * data, and retries or hedges on the replicas after it in turn as the
+   * policy allows. Returns the first response that didn't fail, or the
+   * last failed one; the caller deletes it. Throws a SocketError if no
+   * replica answered before the deadline.
+   *
+   * @param replicas host:port of each replica, tried in order
+   * @param headers extra request headers
+   */
+  static HTTPClientResponse *send(const std::vector<std::string> &replicas, std::string method, std::string path,
+                                  std::string body, const std::map<std::string, std::string> &headers,
+                                  const RequestPolicy &policy);
   
  private:
+  void init(const char *inet_addr, int port);
+
   MySocket *connection;
   std::map<std::string, std::string> headers;
 };
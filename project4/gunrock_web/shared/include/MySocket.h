@@ -37,6 +37,13 @@ class MySocket {
    */
   MySocket(const char *inetAddr, int port);
 
+  /*
+   * same, but connecting and every later read or write fail with
+   * SocketError, SocketReadError or SocketWriteError once they have
+   * waited timeoutMs
+   */
+  MySocket(const char *inetAddr, int port, int timeoutMs);
+
   /*
    * this constructor will generally not be used except for by ServerSockets
    */
@@ -52,9 +59,12 @@ class MySocket {
   virtual std::string read();
   virtual void write(std::string data);
   virtual void close(void);
+
+  // Limits how long one read or write may block, 0 for no limit
+  void set_timeout(int timeoutMs);
   
  protected:
-  void call_connect(const char *inetAddr, int port);
+  void call_connect(const char *inetAddr, int port, int timeoutMs = 0);
   void write_bytes(const void *buffer, int len);
   int sockFd;
 };
@@ -19,6 +19,12 @@ class MySslSocket: public MySocket {
    */
   MySslSocket(const char *inetAddr, int port, bool debug_print_io=false);
 
+  /**
+   * Same as above, but connecting, the TLS handshake and every later read
+   * and write give up after timeoutMs milliseconds.
+   */
+  MySslSocket(const char *inetAddr, int port, int timeoutMs, bool debug_print_io=false);
+
   std::string read();
   void write(std::string data);
   void close(void);
@@ -27,6 +33,9 @@ class MySslSocket: public MySocket {
   SSL_CTX *ctx;
   SSL *ssl;
   bool debug_print_io;
+
+ private:
+  void call_connect_tls(const char *inetAddr, int port, int timeoutMs);
 };
 
 #endif
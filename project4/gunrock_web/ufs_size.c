@@ -0,0 +1,41 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "ufs_size.h"
+
+long long ufs_parse_size(const char *arg) {
+    char *end;
+    long long unit = 1;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if (end == arg || value < 0 || errno == ERANGE)
+	return -1;
+    // each suffix multiplies once and falls through to the smaller ones
+    switch (toupper((unsigned char) *end)) {
+    case 'T':
+	unit *= 1024;
+	/* fall through */
+    case 'G':
+	unit *= 1024;
+	/* fall through */
+    case 'M':
+	unit *= 1024;
+	/* fall through */
+    case 'K':
+	unit *= 1024;
+	end++;
+	/* fall through */
+    case '\0':
+	break;
+    default:
+	return -1;
+    }
+    if (value > LLONG_MAX / unit)
+	return -1;
+    value *= unit;
+    if (*end != '\0' && !(toupper((unsigned char) *end) == 'B' && end[1] == '\0'))
+	return -1;
+    return value;
+}